@@ -0,0 +1,5 @@
+#!/bin/bash
+# ./bench.sh [options], see ./bench.out -h; CFLAGS selects the build,
+# e.g. CFLAGS=-DRBTREE_COMPACT ./bench.sh -n 1m -s rbtree -f json
+gcc -O2 -g $CFLAGS rbtree_bench.c rbtree.c rbtree_frozen.c rbtree_arena.c -pthread -lm -o bench.out && \
+  ./bench.out "$@"
@@ -1,6 +1,14 @@
 #!/bin/bash
-gcc -g -pg --coverage rbtree_test.c rbtree.c -o a.out && \
+FILES="rbtree_test.c rbtree.c rbtree_persist.c rbtree_frozen.c rbtree_image.c rbtree_arena.c"
+gcc -g $FILES -o a.out && \
+  ./a.out && \
+  gcc -g -pg --coverage -DRBTREE_SHARED -DRBTREE_THREADS $FILES rbtree_shared.c -pthread -o a.out && \
   ./a.out && \
   gcov rbtree.c && \
+  gcov rbtree_shared.c && \
+  gcov rbtree_persist.c && \
+  gcov rbtree_frozen.c && \
+  gcov rbtree_image.c && \
+  gcov rbtree_arena.c && \
   gcov rbtree_test.c && \
   gprof > rbtree_test.gprof
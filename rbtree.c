@@ -28,15 +28,45 @@
 
 #include "rbtree.h"
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef RBTREE_STATS_LATENCY
+#include <time.h>
+#endif
+#ifdef RBTREE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 typedef rbtree_node node;
 typedef enum rbtree_node_color color;
 
+#ifdef __GNUC__
+#define prefetch(addr) __builtin_prefetch(addr)
+#else
+#define prefetch(addr)
+#endif
+
+/*
+ * Every store to a link, parent or color goes through store.  With
+ * RBTREE_SHARED it is an atomic store, so that rbtree_shared readers
+ * may load the same fields while the writer works; release ordering
+ * makes a node's key and links visible to a reader that finds it.
+ */
+#ifdef RBTREE_SHARED
+#define store(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#else
+#define store(field, value) ((field) = (value))
+#endif
+
 static node grandparent(node n);
 static node sibling(node n);
 static node uncle(node n);
+static node node_parent(node n);
+static void set_parent(node n, node parent);
 static color node_color(node n);
+static void set_color(node n, color c);
 
 #ifdef VERIFY_RBTREE
 static void verify_properties(rbtree t);
@@ -45,11 +75,68 @@ static void verify_property_2(node root);
 static void verify_property_4(node root);
 static void verify_property_5(node root);
 static void verify_property_5_helper(node n, int black_count, int* black_count_path);
+static int verify_wavl(node n);
+#ifdef RBTREE_ORDER_STATISTICS
+static size_t verify_counts(node n);
+#endif
 #else
 /* Make it go away */
 #define verify_properties(node)
 #endif
 
+/*
+ * Instrumentation, with RBTREE_STATS.  Every comparison goes through
+ * compare_keys and every rebalancing color change through recolor.
+ */
+#ifdef RBTREE_STATS
+#define count_stat(t, field, n) ((t)->counters.field += (n))
+static void count_descent(rbtree t, unsigned long depth);
+static void add_counters(struct rbtree_counters* to, const struct rbtree_counters* from);
+#else
+/* Make it go away */
+#define count_stat(t, field, n) ((void) 0)
+#define count_descent(t, depth) ((void) (depth))
+#endif
+#define compare_keys(t, left, right) \
+    (count_stat(t, comparisons, 1), (t)->compare(left, right))
+
+/*
+ * Descents compare their key, abbreviated once to abbrev, with each
+ * node through compare_node: with RBTREE_ABBREV_KEYS unequal
+ * abbreviations decide without calling the compare function.
+ */
+#ifdef RBTREE_ABBREV_KEYS
+#define key_abbrev(t, k) ((t)->abbrev != NULL ? (t)->abbrev(k) : 0)
+#define set_abbrev(t, n) ((n)->abbrev = key_abbrev(t, (n)->key))
+#define compare_node(t, k, a, n) \
+    ((a) != (n)->abbrev ? ((a) < (n)->abbrev ? -1 : 1) : compare_keys(t, k, (n)->key))
+#else
+/* Make it go away */
+#define key_abbrev(t, k) ((uint64_t) 0)
+#define set_abbrev(t, n) ((void) 0)
+#define compare_node(t, k, a, n) ((void) (a), compare_keys(t, k, (n)->key))
+#endif
+
+#ifdef RBTREE_STATS_LATENCY
+static unsigned long long clock_ns(void);
+static void count_latency(rbtree t, enum rbtree_stats_op op, unsigned long long start,
+                          size_t ops);
+#define latency_start() unsigned long long latency_start_ns = clock_ns()
+#define latency_end(t, op) count_latency(t, op, latency_start_ns, 1)
+/* ops operations, each taking an equal share of the time */
+#define latency_end_batch(t, op, ops) count_latency(t, op, latency_start_ns, ops)
+#else
+#define latency_start()
+#define latency_end(t, op)
+#define latency_end_batch(t, op, ops)
+#endif
+
+#ifdef RBTREE_ORDER_STATISTICS
+static size_t node_size(node n);
+#endif
+static void update_node(rbtree t, node n);
+static void update_path(rbtree t, node n);
+
 static node lookup_node(rbtree t, const void* key);
 static void rotate_left(rbtree t, node n);
 static void rotate_right(rbtree t, node n);
@@ -67,41 +154,155 @@ static void delete_case3(rbtree t, node n);
 static void delete_case4(rbtree t, node n);
 static void delete_case5(rbtree t, node n);
 static void delete_case6(rbtree t, node n);
+static int rank_diff(node parent, node child);
+static void wavl_insert(rbtree t, node n);
+static void wavl_delete(rbtree t, node parent, node n, int three_child);
 
 static node grandparent(node n) {
     assert (n != NULL);
-    assert (n->parent != NULL); /* Not the root node */
-    assert (n->parent->parent != NULL); /* Not child of root */
-    return n->parent->parent;
+    assert (node_parent(n) != NULL); /* Not the root node */
+    assert (node_parent(node_parent(n)) != NULL); /* Not child of root */
+    return node_parent(node_parent(n));
 }
 
 static node sibling(node n) {
+    node p;
     assert (n != NULL);
-    assert (n->parent != NULL); /* Root node has no sibling */
-    if (n == n->parent->left)
-        return n->parent->right;
+    p = node_parent(n);
+    assert (p != NULL); /* Root node has no sibling */
+    if (n == p->left)
+        return p->right;
     else
-        return n->parent->left;
+        return p->left;
 }
 
 static node uncle(node n) {
     assert (n != NULL);
-    assert (n->parent != NULL); /* Root node has no uncle */
-    assert (n->parent->parent != NULL); /* Children of root have no uncle */
-    return sibling(n->parent);
+    assert (node_parent(n) != NULL); /* Root node has no uncle */
+    assert (node_parent(node_parent(n)) != NULL); /* Children of root have no uncle */
+    return sibling(node_parent(n));
+}
+
+/*
+ * Parent and color accessors.
+ *
+ * With RBTREE_COMPACT the color lives in bit 0 of the parent pointer
+ * (nodes are always at least pointer aligned, so the bit is free),
+ * otherwise they are separate fields.  Everything below goes through
+ * these so that both layouts share the same algorithms.
+ */
+static node node_parent(node n) {
+    return rbtree_node_parent(n);
+}
+
+#ifdef RBTREE_COMPACT
+static void set_parent(node n, node parent) {
+    store(n->parent_color, (uintptr_t) parent | (n->parent_color & 1));
+}
+
+static color node_color(node n) {
+    return n == NULL ? BLACK : (color) (n->parent_color & 1);
+}
+
+static void set_color(node n, color c) {
+    store(n->parent_color, (n->parent_color & ~(uintptr_t) 1) | (uintptr_t) c);
+}
+#else
+static void set_parent(node n, node parent) {
+    store(n->parent, parent);
 }
 
 static color node_color(node n) {
     return n == NULL ? BLACK : n->color;
 }
 
+/*
+ * GCC warns that the atomic store may write through NULL wherever it
+ * cannot prove that a node being recolored is not NULL.
+ */
+#if defined(RBTREE_SHARED) && defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wstringop-overflow"
+#endif
+static void set_color(node n, color c) {
+    store(n->color, c);
+}
+#if defined(RBTREE_SHARED) && defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+static void recolor(rbtree t, node n, color c) {
+    (void) t;
+    count_stat(t, recolorings, 1);
+    set_color(n, c);
+}
+
+#ifdef RBTREE_STATS
+static void count_descent(rbtree t, unsigned long depth) {
+    t->counters.descents++;
+    t->counters.descent_depth += depth;
+    if (depth > t->counters.max_descent_depth)
+        t->counters.max_descent_depth = depth;
+}
+
+/* fold in what a working copy of a tree counted */
+static void add_counters(struct rbtree_counters* to, const struct rbtree_counters* from) {
+    to->comparisons += from->comparisons;
+    to->rotations += from->rotations;
+    to->recolorings += from->recolorings;
+    to->fixups += from->fixups;
+    to->descents += from->descents;
+    to->descent_depth += from->descent_depth;
+    if (from->max_descent_depth > to->max_descent_depth)
+        to->max_descent_depth = from->max_descent_depth;
+#ifdef RBTREE_STATS_LATENCY
+    {
+        int op, i;
+        for (op = 0; op < 3; ++op)
+            for (i = 0; i < RBTREE_LATENCY_BUCKETS; ++i)
+                to->latency[op][i] += from->latency[op][i];
+    }
+#endif
+}
+#endif
+
+#ifdef RBTREE_STATS_LATENCY
+static unsigned long long clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void count_latency(rbtree t, enum rbtree_stats_op op, unsigned long long start,
+                          size_t ops) {
+    unsigned long long elapsed;
+    int bucket = 0;
+    if (ops == 0)
+        return;
+    elapsed = (clock_ns() - start) / ops;
+    while (elapsed > 1 && bucket < RBTREE_LATENCY_BUCKETS - 1) {
+        elapsed >>= 1;
+        bucket++;
+    }
+    t->counters.latency[op][bucket] += ops;
+}
+#endif
+
 #ifdef VERIFY_RBTREE
 static void verify_properties(rbtree t) {
     verify_property_1(t->root);
-    verify_property_2(t->root);
-    /* Property 3 is implicit */
-    verify_property_4(t->root);
-    verify_property_5(t->root);
+    if (t->flags & RBTREE_WAVL) {
+        verify_wavl(t->root);
+    } else {
+        verify_property_2(t->root);
+        /* Property 3 is implicit */
+        verify_property_4(t->root);
+        verify_property_5(t->root);
+    }
+#ifdef RBTREE_ORDER_STATISTICS
+    assert (verify_counts(t->root) == (size_t) t->node_count);
+#endif
 }
 
 static void verify_property_1(node n) {
@@ -119,7 +320,7 @@ static void verify_property_4(node n) {
     if (node_color(n) == RED) {
         assert (node_color(n->left)   == BLACK);
         assert (node_color(n->right)  == BLACK);
-        assert (node_color(n->parent) == BLACK);
+        assert (node_color(node_parent(n)) == BLACK);
     }
     if (n == NULL) return;
     verify_property_4(n->left);
@@ -146,22 +347,93 @@ static void verify_property_5_helper(node n, int black_count, int* path_black_co
     verify_property_5_helper(n->left,  black_count, path_black_count);
     verify_property_5_helper(n->right, black_count, path_black_count);
 }
+
+/* both children give the same rank, and leaves have rank 0 */
+static int verify_wavl(node n) {
+    int rank;
+    if (n == NULL) return -1;
+    rank = verify_wavl(n->left) + rank_diff(n, n->left);
+    assert (rank == verify_wavl(n->right) + rank_diff(n, n->right));
+    assert (rank == 0 || n->left != NULL || n->right != NULL);
+    return rank;
+}
+
+#ifdef RBTREE_ORDER_STATISTICS
+static size_t verify_counts(node n) {
+    size_t count;
+    if (n == NULL) return 0;
+    count = 1 + verify_counts(n->left) + verify_counts(n->right);
+    assert (n->count == count);
+    return count;
+}
+#endif
+#endif
+
+/*
+ * Per-node data derived from the subtree: the order statistics count
+ * and whatever the tree's augment callback maintains.  Rotations fix
+ * the two nodes they move, insert and delete fix the path from the
+ * changed node to the root.
+ */
+#ifdef RBTREE_ORDER_STATISTICS
+static size_t node_size(node n) {
+    return n == NULL ? 0 : n->count;
+}
 #endif
 
+static void update_node(rbtree t, node n) {
+#ifdef RBTREE_ORDER_STATISTICS
+    n->count = 1 + node_size(n->left) + node_size(n->right);
+#endif
+    if (t->augment != NULL)
+        t->augment(t, n);
+}
+
+static void update_path(rbtree t, node n) {
+#ifndef RBTREE_ORDER_STATISTICS
+    if (t->augment == NULL)
+        return;
+#endif
+    while (n != NULL) {
+        update_node(t, n);
+        n = node_parent(n);
+    }
+}
+
 void rbtree_init(rbtree t, rbtree_compare_func compare) {
-    t->root = NULL;
+    rbtree_init_flags(t, compare, 0);
+}
+
+void rbtree_init_flags(rbtree t, rbtree_compare_func compare, int flags) {
+    store(t->root, NULL);
     t->compare = compare;
+    t->augment = NULL;
+#ifdef RBTREE_ABBREV_KEYS
+    t->abbrev = NULL;
+#endif
     t->node_count = 0;
+    t->flags = flags;
+#ifdef RBTREE_STATS
+    rbtree_stats_reset(t);
+#endif
 
     verify_properties(t);
 }
 
+/* in a multimap, the first node with the key */
 static node lookup_node(rbtree t, const void* key) {
     node n = t->root;
+    node found = NULL;
+    uint64_t abbrev = key_abbrev(t, key);
+    unsigned long depth = 0;
     while (n != NULL) {
-        int comp_result = t->compare(key, n->key);
+        int comp_result = compare_node(t, key, abbrev, n);
+        depth++;
         if (comp_result == 0) {
-            return n;
+            found = n;
+            if (!(t->flags & RBTREE_MULTI))
+                break;
+            n = n->left;
         } else if (comp_result < 0) {
             n = n->left;
         } else {
@@ -169,110 +441,385 @@ static node lookup_node(rbtree t, const void* key) {
             n = n->right;
         }
     }
-    return n;
+    count_descent(t, depth);
+    return found;
 }
 
 void* rbtree_lookup(rbtree t, const void* key) {
+    latency_start();
     node n = lookup_node(t, key);
+    latency_end(t, RBTREE_OP_LOOKUP);
     return n == NULL ? NULL : n->value;
 }
 
+/*
+ * Run RBTREE_BATCH_WIDTH descents side by side, one level at a time,
+ * prefetching each lane's next node so that their cache misses
+ * overlap.  A lane that finishes picks up the next key straight away.
+ */
+void rbtree_lookup_batch(rbtree t, const void* const* keys, size_t count,
+                         rbtree_node* out) {
+    node lane[RBTREE_BATCH_WIDTH];
+    size_t index[RBTREE_BATCH_WIDTH];
+    uint64_t abbrev[RBTREE_BATCH_WIDTH];
+#ifdef RBTREE_STATS
+    unsigned long depth[RBTREE_BATCH_WIDTH];
+#endif
+    size_t next = 0;
+    int multi = t->flags & RBTREE_MULTI;
+    int lanes = 0;
+    int active;
+    int i;
+    latency_start();
+
+    if (t->root == NULL) {
+        for (next = 0; next < count; ++next) {
+            out[next] = NULL;
+            count_descent(t, 0);
+        }
+        latency_end_batch(t, RBTREE_OP_LOOKUP, count);
+        return;
+    }
+    while (lanes < RBTREE_BATCH_WIDTH && next < count) {
+        out[next] = NULL;
+        abbrev[lanes] = key_abbrev(t, keys[next]);
+#ifdef RBTREE_STATS
+        depth[lanes] = 0;
+#endif
+        index[lanes] = next++;
+        lane[lanes++] = t->root;
+    }
+    prefetch(t->root);
+    active = lanes;
+    while (active > 0) {
+        for (i = 0; i < lanes; ++i) {
+            node n = lane[i];
+            int comp_result;
+            if (n == NULL)
+                continue;
+            comp_result = compare_node(t, keys[index[i]], abbrev[i], n);
+#ifdef RBTREE_STATS
+            depth[i]++;
+#endif
+            if (comp_result == 0) {
+                /* a multimap goes on left to the first node with the key */
+                out[index[i]] = n;
+                n = multi ? n->left : NULL;
+            } else {
+                n = comp_result < 0 ? n->left : n->right;
+            }
+            if (n == NULL) {
+#ifdef RBTREE_STATS
+                count_descent(t, depth[i]);
+                depth[i] = 0;
+#endif
+                if (next < count) {
+                    out[next] = NULL;
+                    abbrev[i] = key_abbrev(t, keys[next]);
+                    index[i] = next++;
+                    n = t->root;
+                } else {
+                    n = NULL;
+                    active--;
+                }
+            }
+            lane[i] = n;
+            if (n != NULL)
+                prefetch(n);
+        }
+    }
+    latency_end_batch(t, RBTREE_OP_LOOKUP, count);
+}
+
 static void rotate_left(rbtree t, node n) {
     node r = n->right;
+    count_stat(t, rotations, 1);
     replace_node(t, n, r);
-    n->right = r->left;
+    store(n->right, r->left);
     if (r->left != NULL) {
-        r->left->parent = n;
+        set_parent(r->left, n);
     }
-    r->left = n;
-    n->parent = r;
+    store(r->left, n);
+    set_parent(n, r);
+    update_node(t, n);
+    update_node(t, r);
 }
 
 static void rotate_right(rbtree t, node n) {
     node L = n->left;
+    count_stat(t, rotations, 1);
     replace_node(t, n, L);
-    n->left = L->right;
+    store(n->left, L->right);
     if (L->right != NULL) {
-        L->right->parent = n;
+        set_parent(L->right, n);
     }
-    L->right = n;
-    n->parent = L;
+    store(L->right, n);
+    set_parent(n, L);
+    update_node(t, n);
+    update_node(t, L);
 }
 
 static void replace_node(rbtree t, node oldn, node newn) {
-    if (oldn->parent == NULL) {
-        t->root = newn;
+    if (node_parent(oldn) == NULL) {
+        store(t->root, newn);
     } else {
-        if (oldn == oldn->parent->left)
-            oldn->parent->left = newn;
+        if (oldn == node_parent(oldn)->left)
+            store(node_parent(oldn)->left, newn);
         else
-            oldn->parent->right = newn;
+            store(node_parent(oldn)->right, newn);
     }
     if (newn != NULL) {
-        newn->parent = oldn->parent;
+        set_parent(newn, node_parent(oldn));
     }
 }
 
 rbtree_node rbtree_insert(rbtree t, rbtree_node inserted_node) {
-    inserted_node->color = RED;
-    inserted_node->left = NULL;
-    inserted_node->right = NULL;
-    inserted_node->parent = NULL;
+    node n = t->root;
+    node* link = &t->root;
+    uint64_t abbrev = key_abbrev(t, inserted_node->key);
+    unsigned long depth = 0;
+    latency_start();
 
-    if (t->root == NULL) {
-        t->root = inserted_node;
-    } else {
-        node n = t->root;
-        while (1) {
-            int comp_result = t->compare(inserted_node->key, n->key);
-            if (comp_result == 0) {
-                /* key exists: swap nodes */
-                inserted_node->left = n->left;
-                inserted_node->right = n->right;
-                inserted_node->parent = n->parent;
-                inserted_node->color = n->color;
-                replace_node(t, n, inserted_node);
-                if (inserted_node->left)
-                    inserted_node->left->parent = inserted_node;
-                if (inserted_node->right)
-                    inserted_node->right->parent = inserted_node;
-                /* return replaced node for disposal */
-                return n;
-            } else if (comp_result < 0) {
-                if (n->left == NULL) {
-                    n->left = inserted_node;
-                    break;
-                } else {
-                    n = n->left;
+    while (n != NULL) {
+        int comp_result = compare_node(t, inserted_node->key, abbrev, n);
+        depth++;
+        if (comp_result == 0 && !(t->flags & RBTREE_MULTI)) {
+            /* key exists: swap nodes */
+            rbtree_node_replace(t, n, inserted_node);
+            count_descent(t, depth);
+            latency_end(t, RBTREE_OP_INSERT);
+            /* return replaced node for disposal */
+            return n;
+        } else if (comp_result < 0) {
+            if (n->left == NULL) {
+                link = &n->left;
+                break;
+            }
+            n = n->left;
+        } else {
+            /* a multimap puts equal keys after those already there */
+            if (n->right == NULL) {
+                link = &n->right;
+                break;
+            }
+            n = n->right;
+        }
+    }
+    count_descent(t, depth);
+    rbtree_node_link(t, inserted_node, n, link);
+    latency_end(t, RBTREE_OP_INSERT);
+    return NULL;
+}
+
+/*
+ * Search for key from start (the root when NULL), leaving the
+ * parent and link of the empty slot where it belongs if not found;
+ * depth is the number of nodes already compared on the way to start.
+ * A nonzero tie makes key compare as less (-1) or greater (1) than
+ * nodes equal to it, so it is never found: multimaps use that to find
+ * the slot before or after the nodes with a key.
+ */
+static node descend(rbtree t, const void* key, uint64_t abbrev, node start, int tie,
+                    unsigned long depth, node* parentp, node** linkp) {
+    node parent = start == NULL ? NULL : node_parent(start);
+    node* link;
+    node n;
+
+    if (parent == NULL)
+        link = &t->root;
+    else
+        link = start == parent->left ? &parent->left : &parent->right;
+    while ((n = *link) != NULL) {
+        int comp_result = compare_node(t, key, abbrev, n);
+        depth++;
+        if (comp_result == 0)
+            comp_result = tie;
+        if (comp_result == 0)
+            break;
+        parent = n;
+        link = comp_result < 0 ? &n->left : &n->right;
+    }
+    count_descent(t, depth);
+    if (n != NULL)
+        return n;
+    *parentp = parent;
+    *linkp = link;
+    return NULL;
+}
+
+/*
+ * Finger search.  Climb from hint, comparing only with the ancestors
+ * that bound hint's subtree on the key's side, and keep the closest
+ * one still short of key; key then lies in that node's subtree.  The
+ * number of comparisons grows with the log of the distance from hint
+ * rather than the log of the tree size.
+ */
+static node finger_search(rbtree t, const void* key, node hint, int tie,
+                          node* parentp, node** linkp) {
+    node start = hint;
+    uint64_t abbrev = key_abbrev(t, key);
+    unsigned long depth = 0;
+
+    if (hint != NULL) {
+        node n = hint;
+        node parent;
+        int side = compare_node(t, key, abbrev, hint);
+        depth++;
+        if (side == 0)
+            side = tie;
+        if (side == 0) {
+            count_descent(t, depth);
+            return hint;
+        }
+        while ((parent = node_parent(n)) != NULL) {
+            if (n == (side > 0 ? parent->left : parent->right)) {
+                int comp_result = compare_node(t, key, abbrev, parent);
+                depth++;
+                if (comp_result == 0)
+                    comp_result = tie;
+                if (comp_result == 0) {
+                    count_descent(t, depth);
+                    return parent;
                 }
-            } else {
-                assert (comp_result > 0);
-                if (n->right == NULL) {
-                    n->right = inserted_node;
+                if ((comp_result > 0) != (side > 0))
                     break;
-                } else {
-                    n = n->right;
-                }
+                start = parent;
             }
+            n = parent;
+        }
+    }
+    return descend(t, key, abbrev, start, tie, depth, parentp, linkp);
+}
+
+rbtree_node rbtree_insert_hint(rbtree t, rbtree_node inserted_node, rbtree_node hint) {
+    node parent;
+    node* link;
+    node n;
+    latency_start();
+
+    n = finger_search(t, inserted_node->key, hint,
+                      (t->flags & RBTREE_MULTI) ? 1 : 0, &parent, &link);
+    if (n != NULL) {
+        /* key exists: swap nodes and return the replaced one */
+        rbtree_node_replace(t, n, inserted_node);
+    } else {
+        rbtree_node_link(t, inserted_node, parent, link);
+    }
+    latency_end(t, RBTREE_OP_INSERT);
+    return n;
+}
+
+/*
+ * Find key from hint, or where it belongs if it is not there.  A
+ * multimap looks for the slot just before the nodes with the key:
+ * the first of them, if any, follows it.
+ */
+static node find_slot(rbtree t, const void* key, node hint,
+                      node* parentp, node** linkp) {
+    node n;
+
+    if (!(t->flags & RBTREE_MULTI))
+        return finger_search(t, key, hint, 0, parentp, linkp);
+    finger_search(t, key, hint, -1, parentp, linkp);
+    if (*parentp == NULL)
+        return NULL;
+    n = *linkp == &(*parentp)->left ? *parentp : rbtree_node_next(t, *parentp);
+    if (n == NULL || compare_keys(t, key, n->key) != 0)
+        return NULL;
+    return n;
+}
+
+rbtree_node rbtree_node_lookup_hint(rbtree t, const void* key, rbtree_node hint) {
+    node parent;
+    node* link;
+    node n;
+    latency_start();
+
+    n = find_slot(t, key, hint, &parent, &link);
+    latency_end(t, RBTREE_OP_LOOKUP);
+    return n;
+}
+
+rbtree_node rbtree_find_or_insert(rbtree t, rbtree_node new_node, int* inserted) {
+    node parent;
+    node* link;
+    node n;
+    latency_start();
+
+    n = find_slot(t, new_node->key, NULL, &parent, &link);
+    *inserted = n == NULL;
+    if (n == NULL) {
+        rbtree_node_link(t, new_node, parent, link);
+        n = new_node;
+    }
+    latency_end(t, RBTREE_OP_INSERT);
+    return n;
+}
+
+rbtree_node rbtree_upsert(rbtree t, const void* key, rbtree_make_func make_fn,
+                          rbtree_update_func update_fn, void* context) {
+    node parent;
+    node* link;
+    node n;
+    latency_start();
+
+    n = find_slot(t, key, NULL, &parent, &link);
+    if (n != NULL) {
+        if (update_fn != NULL)
+            update_fn(n, context);
+    } else {
+        n = make_fn(key, context);
+        if (n != NULL) {
+            assert (compare_keys(t, key, n->key) == 0);
+            rbtree_node_link(t, n, parent, link);
         }
-        inserted_node->parent = n;
     }
-    insert_case1(t, inserted_node);
+    latency_end(t, RBTREE_OP_INSERT);
+    return n;
+}
+
+void rbtree_node_link(rbtree t, rbtree_node inserted_node, rbtree_node parent,
+                      rbtree_node* link) {
+    set_color(inserted_node, RED);
+    set_abbrev(t, inserted_node);
+    store(inserted_node->left, NULL);
+    store(inserted_node->right, NULL);
+    set_parent(inserted_node, parent);
+    store(*link, inserted_node);
+
+    update_path(t, inserted_node);
+    if (t->flags & RBTREE_WAVL)
+        wavl_insert(t, inserted_node);
+    else
+        insert_case1(t, inserted_node);
 
     t->node_count += 1;
     verify_properties(t);
-    return NULL;
+}
+
+void rbtree_node_replace(rbtree t, rbtree_node old_node, rbtree_node new_node) {
+    set_abbrev(t, new_node);
+    store(new_node->left, old_node->left);
+    store(new_node->right, old_node->right);
+    set_color(new_node, node_color(old_node));
+    replace_node(t, old_node, new_node);
+    if (new_node->left)
+        set_parent(new_node->left, new_node);
+    if (new_node->right)
+        set_parent(new_node->right, new_node);
+    update_path(t, new_node);
 }
 
 static void insert_case1(rbtree t, node n) {
-    if (n->parent == NULL)
-        n->color = BLACK;
+    count_stat(t, fixups, 1);
+    if (node_parent(n) == NULL)
+        recolor(t, n, BLACK);
     else
         insert_case2(t, n);
 }
 
 static void insert_case2(rbtree t, node n) {
-    if (node_color(n->parent) == BLACK)
+    if (node_color(node_parent(n)) == BLACK)
         return; /* Tree is still valid */
     else
         insert_case3(t, n);
@@ -280,9 +827,9 @@ static void insert_case2(rbtree t, node n) {
 
 static void insert_case3(rbtree t, node n) {
     if (node_color(uncle(n)) == RED) {
-        n->parent->color = BLACK;
-        uncle(n)->color = BLACK;
-        grandparent(n)->color = RED;
+        recolor(t, node_parent(n), BLACK);
+        recolor(t, uncle(n), BLACK);
+        recolor(t, grandparent(n), RED);
         insert_case1(t, grandparent(n));
     } else {
         insert_case4(t, n);
@@ -290,23 +837,23 @@ static void insert_case3(rbtree t, node n) {
 }
 
 static void insert_case4(rbtree t, node n) {
-    if (n == n->parent->right && n->parent == grandparent(n)->left) {
-        rotate_left(t, n->parent);
+    if (n == node_parent(n)->right && node_parent(n) == grandparent(n)->left) {
+        rotate_left(t, node_parent(n));
         n = n->left;
-    } else if (n == n->parent->left && n->parent == grandparent(n)->right) {
-        rotate_right(t, n->parent);
+    } else if (n == node_parent(n)->left && node_parent(n) == grandparent(n)->right) {
+        rotate_right(t, node_parent(n));
         n = n->right;
     }
     insert_case5(t, n);
 }
 
 static void insert_case5(rbtree t, node n) {
-    n->parent->color = BLACK;
-    grandparent(n)->color = RED;
-    if (n == n->parent->left && n->parent == grandparent(n)->left) {
+    recolor(t, node_parent(n), BLACK);
+    recolor(t, grandparent(n), RED);
+    if (n == node_parent(n)->left && node_parent(n) == grandparent(n)->left) {
         rotate_right(t, grandparent(n));
     } else {
-        assert (n == n->parent->right && n->parent == grandparent(n)->right);
+        assert (n == node_parent(n)->right && node_parent(n) == grandparent(n)->right);
         rotate_left(t, grandparent(n));
     }
 }
@@ -334,7 +881,8 @@ static node maximum_node(node n) {
 }
 
 static void delete_case1(rbtree t, node n) {
-    if (n->parent == NULL)
+    count_stat(t, fixups, 1);
+    if (node_parent(n) == NULL)
         return;
     else
         delete_case2(t, n);
@@ -342,77 +890,194 @@ static void delete_case1(rbtree t, node n) {
 
 static void delete_case2(rbtree t, node n) {
     if (node_color(sibling(n)) == RED) {
-        n->parent->color = RED;
-        sibling(n)->color = BLACK;
-        if (n == n->parent->left)
-            rotate_left(t, n->parent);
+        recolor(t, node_parent(n), RED);
+        recolor(t, sibling(n), BLACK);
+        if (n == node_parent(n)->left)
+            rotate_left(t, node_parent(n));
         else
-            rotate_right(t, n->parent);
+            rotate_right(t, node_parent(n));
     }
     delete_case3(t, n);
 }
 
 static void delete_case3(rbtree t, node n) {
-    if (node_color(n->parent) == BLACK &&
+    if (node_color(node_parent(n)) == BLACK &&
         node_color(sibling(n)) == BLACK &&
         node_color(sibling(n)->left) == BLACK &&
         node_color(sibling(n)->right) == BLACK)
     {
-        sibling(n)->color = RED;
-        delete_case1(t, n->parent);
+        recolor(t, sibling(n), RED);
+        delete_case1(t, node_parent(n));
     }
     else
         delete_case4(t, n);
 }
 
 static void delete_case4(rbtree t, node n) {
-    if (node_color(n->parent) == RED &&
+    if (node_color(node_parent(n)) == RED &&
         node_color(sibling(n)) == BLACK &&
         node_color(sibling(n)->left) == BLACK &&
         node_color(sibling(n)->right) == BLACK)
     {
-        sibling(n)->color = RED;
-        n->parent->color = BLACK;
+        recolor(t, sibling(n), RED);
+        recolor(t, node_parent(n), BLACK);
     }
     else
         delete_case5(t, n);
 }
 
 static void delete_case5(rbtree t, node n) {
-    if (n == n->parent->left &&
+    if (n == node_parent(n)->left &&
         node_color(sibling(n)) == BLACK &&
         node_color(sibling(n)->left) == RED &&
         node_color(sibling(n)->right) == BLACK)
     {
-        sibling(n)->color = RED;
-        sibling(n)->left->color = BLACK;
+        recolor(t, sibling(n), RED);
+        recolor(t, sibling(n)->left, BLACK);
         rotate_right(t, sibling(n));
     }
-    else if (n == n->parent->right &&
+    else if (n == node_parent(n)->right &&
              node_color(sibling(n)) == BLACK &&
              node_color(sibling(n)->right) == RED &&
              node_color(sibling(n)->left) == BLACK)
     {
-        sibling(n)->color = RED;
-        sibling(n)->right->color = BLACK;
+        recolor(t, sibling(n), RED);
+        recolor(t, sibling(n)->right, BLACK);
         rotate_left(t, sibling(n));
     }
     delete_case6(t, n);
 }
 
 static void delete_case6(rbtree t, node n) {
-    sibling(n)->color = node_color(n->parent);
-    n->parent->color = BLACK;
-    if (n == n->parent->left) {
+    recolor(t, sibling(n), node_color(node_parent(n)));
+    recolor(t, node_parent(n), BLACK);
+    if (n == node_parent(n)->left) {
         assert (node_color(sibling(n)->right) == RED);
-        sibling(n)->right->color = BLACK;
-        rotate_left(t, n->parent);
+        recolor(t, sibling(n)->right, BLACK);
+        rotate_left(t, node_parent(n));
     }
     else
     {
         assert (node_color(sibling(n)->left) == RED);
-        sibling(n)->left->color = BLACK;
-        rotate_right(t, n->parent);
+        recolor(t, sibling(n)->left, BLACK);
+        rotate_right(t, node_parent(n));
+    }
+}
+
+/*
+ * Weak AVL rebalancing (Haeupler, Sen and Tarjan, "Rank-Balanced
+ * Trees").  Every node has a rank, NULL children rank -1 and leaves
+ * rank 0, and a node's rank is 1 or 2 more than each child's.  With
+ * only those two differences, the parity of the ranks tells them
+ * apart, so the colour bit holds it: RED is even and BLACK, like a
+ * NULL child, odd.  Promoting or demoting a node by one flips it.
+ */
+static int rank_diff(node parent, node child) {
+    return node_color(parent) == node_color(child) ? 2 : 1;
+}
+
+static void flip_rank(rbtree t, node n) {
+    recolor(t, n, node_color(n) == RED ? BLACK : RED);
+}
+
+/*
+ * n has just been linked, or promoted, so its rank difference is 0 or
+ * 1; now it is 0 exactly when the parities agree.  Promote parents
+ * until one has a 2-child on the other side, then one or two
+ * rotations finish.
+ */
+static void wavl_insert(rbtree t, node n) {
+    node parent;
+
+    while ((parent = node_parent(n)) != NULL &&
+           node_color(parent) == node_color(n))
+    {
+        node inner;
+        count_stat(t, fixups, 1);
+        if (rank_diff(parent, n == parent->left ? parent->right : parent->left) == 1) {
+            flip_rank(t, parent);
+            n = parent;
+            continue;
+        }
+        inner = n == parent->left ? n->right : n->left;
+        if (rank_diff(n, inner) == 2) {
+            if (n == parent->left)
+                rotate_right(t, parent);
+            else
+                rotate_left(t, parent);
+            flip_rank(t, parent);
+        } else {
+            if (n == parent->left) {
+                rotate_left(t, n);
+                rotate_right(t, parent);
+            } else {
+                rotate_right(t, n);
+                rotate_left(t, parent);
+            }
+            flip_rank(t, inner);
+            flip_rank(t, n);
+            flip_rank(t, parent);
+        }
+        break;
+    }
+}
+
+/*
+ * n, possibly NULL, has just replaced a child of parent one rank
+ * higher: three_child says that child was a 2-child, so n is now a
+ * 3-child.  Otherwise the only thing that can be wrong is a parent
+ * left a leaf of rank 1.  Demote up the tree while the sibling is a
+ * 2-child, or a 1-child with two 2-children, then at most two
+ * rotations finish.
+ */
+static void wavl_delete(rbtree t, node parent, node n, int three_child) {
+    if (!three_child) {
+        if (parent->left != NULL || parent->right != NULL ||
+            node_color(parent) == RED)
+            return;
+        /* a leaf of rank 1: demote it to 0 */
+        n = parent;
+        parent = node_parent(n);
+        three_child = parent != NULL && rank_diff(parent, n) == 2;
+        flip_rank(t, n);
+    }
+    while (three_child) {
+        int left = n == parent->left;
+        node s = left ? parent->right : parent->left;
+        node up = node_parent(parent);
+        count_stat(t, fixups, 1);
+        if (rank_diff(parent, s) == 1 &&
+            (rank_diff(s, s->left) == 1 || rank_diff(s, s->right) == 1))
+        {
+            node outer = left ? s->right : s->left;
+            if (rank_diff(s, outer) == 1) {
+                if (left)
+                    rotate_left(t, parent);
+                else
+                    rotate_right(t, parent);
+                flip_rank(t, s);
+                flip_rank(t, parent);
+                if (parent->left == NULL && parent->right == NULL)
+                    flip_rank(t, parent);
+            } else {
+                /* the inner child goes up two ranks, parent down two */
+                if (left) {
+                    rotate_right(t, s);
+                    rotate_left(t, parent);
+                } else {
+                    rotate_left(t, s);
+                    rotate_right(t, parent);
+                }
+                flip_rank(t, s);
+            }
+            break;
+        }
+        three_child = up != NULL && rank_diff(up, parent) == 2;
+        if (rank_diff(parent, s) == 1)
+            flip_rank(t, s);
+        flip_rank(t, parent);
+        n = parent;
+        parent = up;
     }
 }
 
@@ -421,12 +1086,16 @@ static void delete_case6(rbtree t, node n) {
  */
 rbtree_node rbtree_node_lookup(rbtree t, const void* key)
 {
-    return lookup_node(t, key);
+    latency_start();
+    node n = lookup_node(t, key);
+    latency_end(t, RBTREE_OP_LOOKUP);
+    return n;
 }
 
 rbtree_node rbtree_node_delete(rbtree t, rbtree_node n)
 {
     node child;
+    latency_start();
     if (n == NULL)
         return NULL;
     if (n->left != NULL && n->right != NULL) {
@@ -434,51 +1103,62 @@ rbtree_node rbtree_node_delete(rbtree t, rbtree_node n)
         struct rbtree_node_t *temp;
         enum rbtree_node_color color;
         node pred = maximum_node(n->left);
-        n->left->parent = pred;
+        set_parent(n->left, pred);
         if (pred->left)
-            pred->left->parent = n;
-        n->right->parent = pred;
+            set_parent(pred->left, n);
+        set_parent(n->right, pred);
         if (pred->right)
-            pred->right->parent = n;
+            set_parent(pred->right, n);
         temp = pred->left;
-        pred->left = n->left;
-        n->left = temp;
+        store(pred->left, n->left);
+        store(n->left, temp);
         temp = pred->right;
-        pred->right = n->right;
-        n->right = temp;
-        temp = pred->parent;
-        pred->parent = n->parent;
-        n->parent = temp;
-        color = pred->color;
-        pred->color = n->color;
-        n->color = color;
-        if (pred->parent == NULL)
-            t->root = pred;
+        store(pred->right, n->right);
+        store(n->right, temp);
+        temp = node_parent(pred);
+        set_parent(pred, node_parent(n));
+        set_parent(n, temp);
+        color = node_color(pred);
+        set_color(pred, node_color(n));
+        set_color(n, color);
+        if (node_parent(pred) == NULL)
+            store(t->root, pred);
         else {
-            if (pred->parent->left == n)
-                pred->parent->left = pred;
+            if (node_parent(pred)->left == n)
+                store(node_parent(pred)->left, pred);
             else
-                pred->parent->right = pred;
+                store(node_parent(pred)->right, pred);
         }
-        if (n->parent->left == pred)
-            n->parent->left = n;
+        if (node_parent(n)->left == pred)
+            store(node_parent(n)->left, n);
         else
-            n->parent->right = n;
+            store(node_parent(n)->right, n);
     }
 
     assert(n->left == NULL || n->right == NULL);
     child = n->right == NULL ? n->left  : n->right;
-    if (node_color(n) == BLACK) {
-        n->color = node_color(child);
-        delete_case1(t, n);
+    if (t->flags & RBTREE_WAVL) {
+        node parent = node_parent(n);
+        int three_child = parent != NULL && rank_diff(parent, n) == 2;
+        replace_node(t, n, child);
+        update_path(t, parent);
+        if (parent != NULL)
+            wavl_delete(t, parent, child, three_child);
+    } else {
+        if (node_color(n) == BLACK) {
+            set_color(n, node_color(child));
+            delete_case1(t, n);
+        }
+        replace_node(t, n, child);
+        update_path(t, node_parent(n));
+        /* TODO check next two lines, should be removed? */
+        if (node_parent(n) == NULL && child != NULL) // root should be black
+            set_color(child, BLACK);
     }
-    replace_node(t, n, child);
-    /* TODO check next two lines, should be removed? */
-    if (n->parent == NULL && child != NULL) // root should be black
-        child->color = BLACK;
 
     t->node_count -= 1;
     verify_properties(t);
+    latency_end(t, RBTREE_OP_DELETE);
     return n;
 }
 
@@ -515,7 +1195,7 @@ rbtree_node rbtree_node_prev(rbtree t, rbtree_node node)
      * No left-hand children, go up until we find
      * an ancestor that is the right-hand child of its parent
      */
-    while ((parent = node->parent) && node != parent->right)
+    while ((parent = node_parent(node)) && node != parent->right)
         node = parent;
 
     return parent;
@@ -540,38 +1220,1364 @@ rbtree_node rbtree_node_next(rbtree t, rbtree_node node)
      * No right-hand children, go up until we find
      * an ancestor that is the left-hand child of its parent
      */
-    while ((parent = node->parent) && node != parent->left)
+    while ((parent = node_parent(node)) && node != parent->left)
         node = parent;
 
     return parent;
 }
 
-static int node_walk(rbtree_node node, rbtree_visitor_func f, void *context)
+/*
+ * Walks are iterative: they step through the subtree under root by
+ * following parent pointers, so they use no stack however deep the
+ * tree and can stop at any node.
+ */
+enum walk_order { WALK_INORDER, WALK_REVERSE, WALK_POSTORDER };
+
+static node subtree_next(node root, node n)
 {
-    int count = 0;
+    if (n->right != NULL)
+        return minimum_node(n->right);
+    while (n != root) {
+        node parent = node_parent(n);
+        if (n == parent->left)
+            return parent;
+        n = parent;
+    }
+    return NULL;
+}
 
-    if (node == NULL)
-        return 0;
-    if (node->left)
-        count += node_walk(node->left, f, context);
-    count++;
-    if (f)
-        f(node, context);
-    if (node->right)
-        count += node_walk(node->right, f, context);
-    return count;
+static node subtree_prev(node root, node n)
+{
+    if (n->left != NULL)
+        return maximum_node(n->left);
+    while (n != root) {
+        node parent = node_parent(n);
+        if (n == parent->right)
+            return parent;
+        n = parent;
+    }
+    return NULL;
 }
 
-int rbtree_node_walk(rbtree_node node, rbtree_visitor_func f, void *context)
+/* the first node in post-order: the leftmost of the deepest leaves */
+static node postorder_first(node n)
 {
-    return node_walk(node, f, context);
+    while (1) {
+        if (n->left != NULL)
+            n = n->left;
+        else if (n->right != NULL)
+            n = n->right;
+        else
+            return n;
+    }
 }
 
-int rbtree_walk(rbtree t, rbtree_visitor_func f, void *context)
+static node postorder_next(node root, node n)
 {
-    if (t && t->root)
-        return node_walk(t->root, f, context);
-    return 0;
+    node parent;
+
+    if (n == root)
+        return NULL;
+    parent = node_parent(n);
+    if (n == parent->left && parent->right != NULL)
+        return postorder_first(parent->right);
+    return parent;
+}
+
+static int node_walk(rbtree_node root, enum walk_order order,
+                     rbtree_visitor_func f, void *context)
+{
+    rbtree_node node, next;
+    int count = 0;
+
+    if (root == NULL)
+        return 0;
+    switch (order) {
+    case WALK_REVERSE:
+        node = maximum_node(root);
+        break;
+    case WALK_POSTORDER:
+        node = postorder_first(root);
+        break;
+    default:
+        node = minimum_node(root);
+        break;
+    }
+    while (node != NULL) {
+        /* step first, so a post-order visitor may free the node */
+        switch (order) {
+        case WALK_REVERSE:
+            next = subtree_prev(root, node);
+            break;
+        case WALK_POSTORDER:
+            next = postorder_next(root, node);
+            break;
+        default:
+            next = subtree_next(root, node);
+            break;
+        }
+        count++;
+        if (f) {
+            int result = f(node, context);
+            if (result != 0)
+                return result;
+        }
+        node = next;
+    }
+    return count;
+}
+
+int rbtree_node_walk(rbtree_node node, rbtree_visitor_func f, void *context)
+{
+    return node_walk(node, WALK_INORDER, f, context);
+}
+
+int rbtree_node_walk_reverse(rbtree_node node, rbtree_visitor_func f, void *context)
+{
+    return node_walk(node, WALK_REVERSE, f, context);
+}
+
+int rbtree_node_walk_postorder(rbtree_node node, rbtree_visitor_func f, void *context)
+{
+    return node_walk(node, WALK_POSTORDER, f, context);
+}
+
+int rbtree_walk(rbtree t, rbtree_visitor_func f, void *context)
+{
+    if (t && t->root)
+        return node_walk(t->root, WALK_INORDER, f, context);
+    return 0;
+}
+
+int rbtree_walk_reverse(rbtree t, rbtree_visitor_func f, void *context)
+{
+    if (t && t->root)
+        return node_walk(t->root, WALK_REVERSE, f, context);
+    return 0;
+}
+
+int rbtree_walk_postorder(rbtree t, rbtree_visitor_func f, void *context)
+{
+    if (t && t->root)
+        return node_walk(t->root, WALK_POSTORDER, f, context);
+    return 0;
+}
+
+static node bound_node(rbtree t, const void* key, int strict)
+{
+    node n = t->root;
+    node best = NULL;
+    uint64_t abbrev = key_abbrev(t, key);
+    unsigned long depth = 0;
+    while (n != NULL) {
+        int comp_result = compare_node(t, key, abbrev, n);
+        depth++;
+        if (comp_result == 0 && !strict) {
+            best = n;
+            if (!(t->flags & RBTREE_MULTI))
+                break;
+            n = n->left;
+        } else if (comp_result < 0) {
+            best = n;
+            n = n->left;
+        } else {
+            n = n->right;
+        }
+    }
+    count_descent(t, depth);
+    return best;
+}
+
+rbtree_node rbtree_node_lower_bound(rbtree t, const void* key)
+{
+    if (t == NULL)
+        return NULL;
+    return bound_node(t, key, 0);
+}
+
+rbtree_node rbtree_node_upper_bound(rbtree t, const void* key)
+{
+    if (t == NULL)
+        return NULL;
+    return bound_node(t, key, 1);
+}
+
+rbtree_node rbtree_equal_range(rbtree t, const void* key, rbtree_node* end)
+{
+    node first = rbtree_node_lower_bound(t, key);
+
+    if (first == NULL || compare_keys(t, key, first->key) != 0)
+        *end = first;
+    else if (t->flags & RBTREE_MULTI)
+        *end = bound_node(t, key, 1);
+    else
+        *end = rbtree_node_next(t, first);
+    return first;
+}
+
+size_t rbtree_count_key(rbtree t, const void* key)
+{
+    node end;
+    node n = rbtree_equal_range(t, key, &end);
+#ifdef RBTREE_ORDER_STATISTICS
+    if (n == end)
+        return 0;
+    return (end == NULL ? (size_t) t->node_count : rbtree_node_rank(t, end)) -
+        rbtree_node_rank(t, n);
+#else
+    size_t count = 0;
+    for (; n != end; n = rbtree_node_next(t, n))
+        count++;
+    return count;
+#endif
+}
+
+static node range_first(rbtree t, const void* lo, int flags)
+{
+    if (lo == NULL)
+        return rbtree_node_first(t);
+    return bound_node(t, lo, !(flags & RBTREE_RANGE_INCLUDE_LO));
+}
+
+static int past_range(rbtree t, node n, const void* hi, int flags)
+{
+    int comp_result;
+    if (hi == NULL)
+        return 0;
+    comp_result = compare_keys(t, n->key, hi);
+    return comp_result > 0 ||
+        (comp_result == 0 && !(flags & RBTREE_RANGE_INCLUDE_HI));
+}
+
+int rbtree_walk_range(rbtree t, const void* lo, const void* hi, int flags,
+                      rbtree_visitor_func f, void *context)
+{
+    rbtree_node node;
+    int count = 0;
+
+    if (t == NULL)
+        return 0;
+    for (node = range_first(t, lo, flags); node != NULL; node = rbtree_node_next(t, node)) {
+        if (past_range(t, node, hi, flags))
+            break;
+        count++;
+        if (f) {
+            int result = f(node, context);
+            if (result != 0)
+                return result;
+        }
+    }
+    return count;
+}
+
+/*
+ * Teardown: hand every node to free_fn in post-order, so each node is
+ * done with before it is freed, with no rebalancing.
+ */
+static int clear_nodes(node root, rbtree_free_func free_fn, void* context)
+{
+    node n, next;
+    int count = 0;
+
+    if (root == NULL)
+        return 0;
+    for (n = postorder_first(root); n != NULL; n = next) {
+        next = postorder_next(root, n);
+        count++;
+        if (free_fn)
+            free_fn(n, context);
+    }
+    return count;
+}
+
+void rbtree_clear(rbtree t, rbtree_free_func free_fn, void* context)
+{
+    if (t == NULL)
+        return;
+    if (free_fn != NULL)
+        clear_nodes(t->root, free_fn, context);
+    store(t->root, NULL);
+    t->node_count = 0;
+}
+
+/*
+ * Split and join.  Joining two trees of black heights lh >= rh around
+ * a pivot walks down the right spine of the taller tree to the black
+ * node at height rh, hangs the pivot there with the shorter tree as
+ * its right child, and repairs the one possible red violation as an
+ * insert would.  That costs O(lh - rh + 1), so the O(log n) joins a
+ * split does on the way up its search path add up to O(log n).
+ */
+
+/* black nodes from n down to a leaf, counting n */
+static int black_height(node n)
+{
+    int h = 0;
+
+    for (; n != NULL; n = n->left)
+        if (node_color(n) == BLACK)
+            h++;
+    return h;
+}
+
+/* insert_case1..3 for a joined pivot; returns 1 if the root went black */
+static int join_fixup(rbtree t, node n)
+{
+    node parent;
+
+    while ((parent = node_parent(n)) != NULL) {
+        count_stat(t, fixups, 1);
+        if (node_color(parent) == BLACK)
+            return 0;
+        if (node_color(uncle(n)) != RED) {
+            insert_case4(t, n);
+            return 0;
+        }
+        recolor(t, parent, BLACK);
+        recolor(t, uncle(n), BLACK);
+        n = grandparent(n);
+        recolor(t, n, RED);
+    }
+    recolor(t, n, BLACK);
+    return 1;
+}
+
+/*
+ * Join l, pivot and r into t->root, where every key in l is before
+ * pivot's and every key in r after it.  lh and rh are the black
+ * heights of l and r; the height of the result is left in *hp.
+ */
+static node join_nodes(rbtree t, node l, int lh, node pivot, node r, int rh, int* hp)
+{
+    node n, parent = NULL;
+    int h;
+
+    /* the roots must be black for the walk down to stop in time */
+    if (node_color(l) == RED) {
+        set_color(l, BLACK);
+        lh++;
+    }
+    if (node_color(r) == RED) {
+        set_color(r, BLACK);
+        rh++;
+    }
+    if (l != NULL)
+        set_parent(l, NULL);
+    if (r != NULL)
+        set_parent(r, NULL);
+    if (lh >= rh) {
+        n = l;
+        store(t->root, n);
+        for (h = lh; node_color(n) == RED || h > rh; n = n->right) {
+            if (node_color(n) == BLACK)
+                h--;
+            parent = n;
+        }
+        store(pivot->left, n);
+        store(pivot->right, r);
+        if (parent != NULL)
+            store(parent->right, pivot);
+    } else {
+        n = r;
+        store(t->root, n);
+        for (h = rh; node_color(n) == RED || h > lh; n = n->left) {
+            if (node_color(n) == BLACK)
+                h--;
+            parent = n;
+        }
+        store(pivot->left, l);
+        store(pivot->right, n);
+        if (parent != NULL)
+            store(parent->left, pivot);
+    }
+    if (parent == NULL)
+        store(t->root, pivot);
+    set_parent(pivot, parent);
+    set_color(pivot, RED);
+    if (pivot->left != NULL)
+        set_parent(pivot->left, pivot);
+    if (pivot->right != NULL)
+        set_parent(pivot->right, pivot);
+    update_path(t, pivot);
+    *hp = (lh > rh ? lh : rh) + join_fixup(t, pivot);
+    return t->root;
+}
+
+int rbtree_join(rbtree left, rbtree_node pivot, rbtree right)
+{
+    node last, first;
+    int out_of_order;
+    int h;
+
+    if (left == NULL || right == NULL || left == right)
+        return -1;
+    if ((left->flags | right->flags) & RBTREE_WAVL)
+        return -1;
+#ifdef RBTREE_ABBREV_KEYS
+    if (left->abbrev != right->abbrev)
+        return -1;
+#endif
+    /* comparisons from out_of_order up reject: a multimap may join equal keys */
+    out_of_order = (left->flags & RBTREE_MULTI) ? 1 : 0;
+    last = rbtree_node_last(left);
+    first = rbtree_node_first(right);
+    if (pivot == NULL) {
+        if (first == NULL)
+            return 0;
+        if (last != NULL && compare_keys(left, last->key, first->key) >= out_of_order)
+            return -1;
+        pivot = rbtree_node_delete(right, first);
+    } else {
+        if (last != NULL && compare_keys(left, last->key, pivot->key) >= out_of_order)
+            return -1;
+        if (first != NULL && compare_keys(left, pivot->key, first->key) >= out_of_order)
+            return -1;
+        set_abbrev(left, pivot);
+    }
+    join_nodes(left, left->root, black_height(left->root),
+               pivot, right->root, black_height(right->root), &h);
+    left->node_count += right->node_count + 1;
+    store(right->root, NULL);
+    right->node_count = 0;
+
+    verify_properties(left);
+    return 0;
+}
+
+/*
+ * Split the subtree under root, whose parent must be NULL, around key.
+ * Climb the search path from where key is, or would be, joining each
+ * ancestor and its other subtree onto the side of the split it falls
+ * on.  A node's other subtree has the black height of the child we
+ * came from, so the heights are tracked on the way up.
+ */
+static node split_nodes(rbtree t, node root, const void* key, int tie,
+                        node* lp, int* lhp, node* rp, int* rhp)
+{
+    node n = root;
+    node found = NULL;
+    node parent = NULL;
+    node l = NULL, r = NULL;
+    uint64_t abbrev = key_abbrev(t, key);
+    int lh = 0, rh = 0, h = 0;
+    int from_left = 0;
+
+    while (n != NULL) {
+        int comp_result = compare_node(t, key, abbrev, n);
+        if (comp_result == 0)
+            comp_result = tie;
+        if (comp_result == 0) {
+            found = n;
+            break;
+        }
+        parent = n;
+        from_left = comp_result < 0;
+        n = from_left ? n->left : n->right;
+    }
+    if (found != NULL) {
+        l = found->left;
+        r = found->right;
+        lh = rh = black_height(l);
+        h = lh + (node_color(found) == BLACK);
+        if (parent != NULL)
+            from_left = found == parent->left;
+    }
+    while (parent != NULL) {
+        node up = node_parent(parent);
+        int black = node_color(parent) == BLACK;
+        int up_from_left = up != NULL && parent == up->left;
+        if (from_left)
+            r = join_nodes(t, r, rh, parent, parent->right, h, &rh);
+        else
+            l = join_nodes(t, parent->left, h, parent, l, lh, &lh);
+        h += black;
+        from_left = up_from_left;
+        parent = up;
+    }
+
+    if (l != NULL) {
+        set_parent(l, NULL);
+        if (node_color(l) == RED) {
+            set_color(l, BLACK);
+            lh++;
+        }
+    }
+    if (r != NULL) {
+        set_parent(r, NULL);
+        if (node_color(r) == RED) {
+            set_color(r, BLACK);
+            rh++;
+        }
+    }
+    *lp = l;
+    *lhp = lh;
+    *rp = r;
+    *rhp = rh;
+    return found;
+}
+
+#ifdef RBTREE_ORDER_STATISTICS
+rbtree_node rbtree_split(rbtree t, const void* key, rbtree left, rbtree right)
+{
+    struct rbtree_t work = *t;
+    node found, l, r;
+    int lh, rh;
+    int count = t->node_count;
+
+    if (left == right || (t->flags & RBTREE_WAVL))
+        return NULL;
+    /* a multimap keeps the nodes with key, on the right */
+    found = split_nodes(&work, t->root, key, (t->flags & RBTREE_MULTI) ? -1 : 0,
+                        &l, &lh, &r, &rh);
+    if (found != NULL)
+        count--;
+
+    store(left->root, l);
+    left->compare = t->compare;
+    left->augment = t->augment;
+    left->flags = t->flags;
+    store(right->root, r);
+    right->compare = t->compare;
+    right->augment = t->augment;
+    right->flags = t->flags;
+#ifdef RBTREE_ABBREV_KEYS
+    left->abbrev = t->abbrev;
+    right->abbrev = t->abbrev;
+#endif
+#ifdef RBTREE_STATS
+    if (left != t)
+        rbtree_stats_reset(left);
+    if (right != t)
+        rbtree_stats_reset(right);
+#endif
+    left->node_count = (int) node_size(l);
+    right->node_count = count - left->node_count;
+    if (t != left && t != right) {
+        store(t->root, NULL);
+        t->node_count = 0;
+    }
+
+    verify_properties(left);
+    verify_properties(right);
+    return found;
+}
+#endif
+
+/*
+ * Set operations, by divide and conquer: split b around the key at
+ * a's root, combine the two lefts and the two rights, and join the
+ * results around a's root (or b's equal node, if merge picks it).
+ * The halves are independent, so with RBTREE_THREADS the left one
+ * is queued for a pool of workers while the subproblem is big enough
+ * and a worker is to be had.  The pool starts no more than one worker
+ * per spare CPU, as the queue first needs them, and they serve the
+ * whole operation; a fork that finds its half still queued takes it
+ * back, and one whose half is running helps with the queue meanwhile.
+ * Each subproblem counts its RBTREE_STATS in its own copy of the
+ * tree, and hands them up with its result.
+ */
+enum set_kind { SET_UNION, SET_INTERSECTION, SET_DIFFERENCE };
+
+struct set_op {
+    struct rbtree_t tree;  /* compare and augment for the result */
+    enum set_kind kind;
+    rbtree_merge_func merge;
+    rbtree_free_func free_fn;
+    void* context;
+    int spare_threads;
+#ifdef RBTREE_THREADS
+    size_t grain;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;     /* work queued, or the pool stopping */
+    pthread_cond_t done;     /* a queued subproblem finished */
+    struct set_args* queue;
+    int queued;
+    pthread_t* workers;
+    int num_workers, max_workers, idle_workers;
+    int stopping;
+#endif
+};
+
+enum set_state { SET_QUEUED, SET_RUNNING, SET_DONE };
+
+struct set_args {
+    struct set_op* op;
+    node a, b;
+    int ah, bh;
+    node result;
+    int h;
+    int matches;
+#ifdef RBTREE_STATS
+    struct rbtree_counters counters;
+#endif
+#ifdef RBTREE_THREADS
+    struct set_args* next;   /* in op->queue */
+    enum set_state state;
+#endif
+};
+
+static void discard_nodes(struct set_op* op, node n)
+{
+    if (op->free_fn != NULL)
+        clear_nodes(n, op->free_fn, op->context);
+}
+
+/* join without a pivot: borrow the first node of r */
+static node join2(rbtree t, node l, int lh, node r, int* hp)
+{
+    node pivot;
+
+    if (r == NULL) {
+        *hp = lh;
+        return l;
+    }
+    store(t->root, r);
+#ifdef RBTREE_ORDER_STATISTICS
+    t->node_count = (int) node_size(r);
+#endif
+    pivot = rbtree_node_delete(t, minimum_node(r));
+    r = t->root;
+    return join_nodes(t, l, lh, pivot, r, black_height(r), hp);
+}
+
+#ifdef RBTREE_THREADS
+static size_t set_grain = RBTREE_SET_GRAIN;
+static int set_workers = RBTREE_SET_WORKERS;
+
+void rbtree_set_threads(size_t grain, int workers)
+{
+    set_grain = grain;
+    set_workers = workers;
+}
+
+static void set_nodes(struct set_args* s);
+
+/* a lower bound on the number of nodes in the subproblem */
+static size_t set_size(struct set_args* s)
+{
+#ifdef RBTREE_ORDER_STATISTICS
+    return node_size(s->a) + node_size(s->b);
+#else
+    return ((size_t) 1 << s->ah) + ((size_t) 1 << s->bh) - 2;
+#endif
+}
+
+static int take_thread(struct set_op* op)
+{
+    int spare = __atomic_load_n(&op->spare_threads, __ATOMIC_RELAXED);
+
+    while (spare > 0)
+        if (__atomic_compare_exchange_n(&op->spare_threads, &spare, spare - 1, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return 1;
+    return 0;
+}
+
+static void give_thread(struct set_op* op)
+{
+    __atomic_add_fetch(&op->spare_threads, 1, __ATOMIC_RELAXED);
+}
+
+/* run a queued subproblem; called and returns with op->lock held */
+static void run_queued(struct set_op* op)
+{
+    struct set_args* s = op->queue;
+
+    op->queue = s->next;
+    op->queued--;
+    s->state = SET_RUNNING;
+    pthread_mutex_unlock(&op->lock);
+    set_nodes(s);
+    pthread_mutex_lock(&op->lock);
+    s->state = SET_DONE;
+    pthread_cond_broadcast(&op->done);
+}
+
+static void* set_worker(void* arg)
+{
+    struct set_op* op = arg;
+
+    pthread_mutex_lock(&op->lock);
+    while (1) {
+        op->idle_workers++;
+        while (op->queue == NULL && !op->stopping)
+            pthread_cond_wait(&op->wake, &op->lock);
+        op->idle_workers--;
+        if (op->queue == NULL)
+            break;
+        run_queued(op);
+    }
+    pthread_mutex_unlock(&op->lock);
+    return NULL;
+}
+
+static void start_pool(struct set_op* op)
+{
+    op->queue = NULL;
+    op->queued = 0;
+    op->num_workers = op->idle_workers = 0;
+    op->stopping = 0;
+    op->max_workers = op->spare_threads;
+    op->workers = NULL;
+    if (op->max_workers > 0)
+        op->workers = malloc(op->max_workers * sizeof(*op->workers));
+    if (op->workers == NULL) {
+        op->spare_threads = 0;
+        return;
+    }
+    pthread_mutex_init(&op->lock, NULL);
+    pthread_cond_init(&op->wake, NULL);
+    pthread_cond_init(&op->done, NULL);
+}
+
+static void stop_pool(struct set_op* op)
+{
+    int i;
+
+    if (op->workers == NULL)
+        return;
+    pthread_mutex_lock(&op->lock);
+    op->stopping = 1;
+    pthread_cond_broadcast(&op->wake);
+    pthread_mutex_unlock(&op->lock);
+    for (i = 0; i < op->num_workers; ++i)
+        pthread_join(op->workers[i], NULL);
+    pthread_mutex_destroy(&op->lock);
+    pthread_cond_destroy(&op->wake);
+    pthread_cond_destroy(&op->done);
+    free(op->workers);
+}
+
+/* queue s for the pool, starting a worker if none will be free for it */
+static void fork_set(struct set_op* op, struct set_args* s)
+{
+    pthread_mutex_lock(&op->lock);
+    s->state = SET_QUEUED;
+    s->next = op->queue;
+    op->queue = s;
+    op->queued++;
+    if (op->queued > op->idle_workers && op->num_workers < op->max_workers &&
+        pthread_create(&op->workers[op->num_workers], NULL, set_worker, op) == 0)
+        op->num_workers++;
+    pthread_cond_signal(&op->wake);
+    pthread_mutex_unlock(&op->lock);
+}
+
+/* wait for a forked s, running it here if no worker has taken it yet */
+static void join_set(struct set_op* op, struct set_args* s)
+{
+    struct set_args** p;
+
+    pthread_mutex_lock(&op->lock);
+    if (s->state == SET_QUEUED) {
+        for (p = &op->queue; *p != s; p = &(*p)->next)
+            ;
+        *p = s->next;
+        op->queued--;
+        pthread_mutex_unlock(&op->lock);
+        set_nodes(s);
+        return;
+    }
+    while (s->state != SET_DONE) {
+        if (op->queue != NULL)
+            run_queued(op);
+        else
+            pthread_cond_wait(&op->done, &op->lock);
+    }
+    pthread_mutex_unlock(&op->lock);
+}
+#endif
+
+static void set_nodes(struct set_args* s)
+{
+    struct set_op* op = s->op;
+    struct rbtree_t work = op->tree;
+    struct set_args left, right;
+    node a = s->a;
+    node found, pivot;
+    int h;
+#ifdef RBTREE_THREADS
+    int forked = 0;
+#endif
+
+    s->matches = 0;
+#ifdef RBTREE_STATS
+    memset(&s->counters, 0, sizeof(s->counters));
+#endif
+    if (a == NULL || s->b == NULL) {
+        if (op->kind == SET_INTERSECTION) {
+            discard_nodes(op, a);
+            discard_nodes(op, s->b);
+            s->result = NULL;
+            s->h = 0;
+        } else if (a == NULL && op->kind == SET_UNION) {
+            s->result = s->b;
+            s->h = s->bh;
+        } else {
+            discard_nodes(op, s->b);
+            s->result = a;
+            s->h = s->ah;
+        }
+        return;
+    }
+
+    h = s->ah - (node_color(a) == BLACK);
+    left.op = right.op = op;
+    left.a = a->left;
+    right.a = a->right;
+    left.ah = right.ah = h;
+    if (a->left != NULL)
+        set_parent(a->left, NULL);
+    if (a->right != NULL)
+        set_parent(a->right, NULL);
+    found = split_nodes(&work, s->b, a->key, 0, &left.b, &left.bh, &right.b, &right.bh);
+
+#ifdef RBTREE_THREADS
+    if (set_size(&left) >= op->grain && take_thread(op)) {
+        fork_set(op, &left);
+        forked = 1;
+    }
+    if (!forked)
+        set_nodes(&left);
+    set_nodes(&right);
+    if (forked) {
+        join_set(op, &left);
+        give_thread(op);
+    }
+#else
+    set_nodes(&left);
+    set_nodes(&right);
+#endif
+
+    pivot = a;
+    if (found != NULL) {
+        s->matches = 1;
+        if (op->kind == SET_DIFFERENCE) {
+            pivot = NULL;
+            if (op->free_fn != NULL) {
+                op->free_fn(a, op->context);
+                op->free_fn(found, op->context);
+            }
+        } else {
+            pivot = op->merge != NULL ? op->merge(a, found, op->context) : a;
+            if (op->free_fn != NULL)
+                op->free_fn(pivot == a ? found : a, op->context);
+        }
+    } else if (op->kind == SET_INTERSECTION) {
+        pivot = NULL;
+        if (op->free_fn != NULL)
+            op->free_fn(a, op->context);
+    }
+    s->matches += left.matches + right.matches;
+    if (pivot != NULL)
+        s->result = join_nodes(&work, left.result, left.h, pivot,
+                               right.result, right.h, &s->h);
+    else
+        s->result = join2(&work, left.result, left.h, right.result, &s->h);
+#ifdef RBTREE_STATS
+    s->counters = work.counters;
+    add_counters(&s->counters, &left.counters);
+    add_counters(&s->counters, &right.counters);
+#endif
+}
+
+static int set_operation(rbtree a, rbtree b, enum set_kind kind, rbtree_merge_func merge,
+                         rbtree_free_func free_fn, void* context)
+{
+    struct set_op op;
+    struct set_args s;
+
+    if ((a->flags | b->flags) & (RBTREE_WAVL | RBTREE_MULTI))
+        return -1;
+#ifdef RBTREE_ABBREV_KEYS
+    if (a->abbrev != b->abbrev)
+        return -1;
+#endif
+    op.tree = *a;
+#ifdef RBTREE_STATS
+    rbtree_stats_reset(&op.tree);
+#endif
+    op.kind = kind;
+    op.merge = merge;
+    op.free_fn = free_fn;
+    op.context = context;
+    op.spare_threads = 0;
+#ifdef RBTREE_THREADS
+    op.grain = set_grain;
+    op.spare_threads = set_workers;
+    if (op.spare_threads == 0)
+        op.spare_threads = (int) sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    start_pool(&op);
+#endif
+    s.op = &op;
+    s.a = a->root;
+    s.ah = black_height(a->root);
+    s.b = b->root;
+    s.bh = black_height(b->root);
+    set_nodes(&s);
+#ifdef RBTREE_THREADS
+    stop_pool(&op);
+#endif
+
+#ifdef RBTREE_STATS
+    add_counters(&a->counters, &s.counters);
+#endif
+
+    store(a->root, s.result);
+    if (a->root != NULL) {
+        set_parent(a->root, NULL);
+        set_color(a->root, BLACK);
+    }
+    switch (kind) {
+    case SET_UNION:
+        a->node_count += b->node_count - s.matches;
+        break;
+    case SET_INTERSECTION:
+        a->node_count = s.matches;
+        break;
+    case SET_DIFFERENCE:
+        a->node_count -= s.matches;
+        break;
+    }
+    store(b->root, NULL);
+    b->node_count = 0;
+
+    verify_properties(a);
+    return s.matches;
+}
+
+int rbtree_union(rbtree a, rbtree b, rbtree_merge_func merge,
+                 rbtree_free_func free_fn, void* context)
+{
+    if (a == NULL || b == NULL || a == b)
+        return -1;
+    return set_operation(a, b, SET_UNION, merge, free_fn, context);
+}
+
+int rbtree_intersection(rbtree a, rbtree b, rbtree_merge_func merge,
+                        rbtree_free_func free_fn, void* context)
+{
+    if (a == NULL || b == NULL || a == b)
+        return -1;
+    return set_operation(a, b, SET_INTERSECTION, merge, free_fn, context);
+}
+
+int rbtree_difference(rbtree a, rbtree b, rbtree_free_func free_fn, void* context)
+{
+    if (a == NULL || b == NULL || a == b)
+        return -1;
+    return set_operation(a, b, SET_DIFFERENCE, NULL, free_fn, context);
+}
+
+/*
+ * Split off the range and join what is left either side of it: only
+ * the paths to the two bounds are restructured.  Each split sends the
+ * nodes equal to its bound to the side the flags put them on.
+ */
+int rbtree_delete_range(rbtree t, const void* lo, const void* hi, int flags,
+                        rbtree_free_func free_fn, void* context)
+{
+    struct rbtree_t work;
+    node l = NULL, m, r = NULL;
+    int lh = 0, mh = 0, rh = 0, h;
+    int removed;
+
+    if (t == NULL || t->root == NULL)
+        return 0;
+    if (t->flags & RBTREE_WAVL) {
+        node n = range_first(t, lo, flags);
+        removed = 0;
+        while (n != NULL && !past_range(t, n, hi, flags)) {
+            node next = rbtree_node_next(t, n);
+            rbtree_node_delete(t, n);
+            if (free_fn)
+                free_fn(n, context);
+            removed++;
+            n = next;
+        }
+        return removed;
+    }
+    work = *t;
+    m = t->root;
+    if (lo != NULL)
+        split_nodes(&work, m, lo, (flags & RBTREE_RANGE_INCLUDE_LO) ? -1 : 1,
+                    &l, &lh, &m, &mh);
+    if (hi != NULL)
+        split_nodes(&work, m, hi, (flags & RBTREE_RANGE_INCLUDE_HI) ? 1 : -1,
+                    &m, &mh, &r, &rh);
+    removed = clear_nodes(m, free_fn, context);
+
+    store(t->root, join2(&work, l, lh, r, &h));
+    if (t->root != NULL) {
+        set_parent(t->root, NULL);
+        set_color(t->root, BLACK);
+    }
+    t->node_count -= removed;
+
+    verify_properties(t);
+    return removed;
+}
+
+int rbtree_delete_all(rbtree t, const void* key, rbtree_free_func free_fn, void* context)
+{
+    return rbtree_delete_range(t, key, key, RBTREE_RANGE_CLOSED, free_fn, context);
+}
+
+/*
+ * Link nodes[lo..hi) into a perfectly balanced subtree.  Every node on
+ * red_depth (the bottom level of an incomplete tree) is red, the rest
+ * are black, so all paths carry the same number of black nodes.  In a
+ * WAVL tree each node's rank is its height, floor(log2(hi - lo)),
+ * which the left half always matches one rank down.
+ */
+static node build_sorted(rbtree t, rbtree_node *nodes, size_t lo, size_t hi,
+                         node parent, int depth, int red_depth)
+{
+    size_t mid;
+    node n;
+
+    if (lo >= hi)
+        return NULL;
+    mid = lo + (hi - lo) / 2;
+    n = nodes[mid];
+    set_parent(n, parent);
+    set_abbrev(t, n);
+    if (t->flags & RBTREE_WAVL) {
+        size_t size;
+        int rank = -1;
+        for (size = hi - lo; size > 0; size >>= 1)
+            ++rank;
+        set_color(n, rank & 1 ? BLACK : RED);
+    } else {
+        set_color(n, depth == red_depth ? RED : BLACK);
+    }
+    store(n->left, build_sorted(t, nodes, lo, mid, n, depth + 1, red_depth));
+    store(n->right, build_sorted(t, nodes, mid + 1, hi, n, depth + 1, red_depth));
+    update_node(t, n);
+    return n;
+}
+
+int rbtree_build_sorted(rbtree t, rbtree_node *nodes, size_t count)
+{
+    size_t i;
+    int depth = -1;
+    int out_of_order;
+
+    if (t == NULL || t->root != NULL || (count > 0 && nodes == NULL))
+        return -1;
+    /* strictly ascending, or just ascending for a multimap */
+    out_of_order = (t->flags & RBTREE_MULTI) ? 1 : 0;
+    for (i = 0; i < count; ++i) {
+        if (nodes[i] == NULL)
+            return -1;
+        if (i > 0 && compare_keys(t, nodes[i - 1]->key, nodes[i]->key) >= out_of_order)
+            return -1;
+    }
+
+    /* colour the bottom level red unless it is completely full */
+    if (count > 0 && ((count + 1) & count) != 0)
+        for (i = count; i > 0; i >>= 1)
+            ++depth;
+    store(t->root, build_sorted(t, nodes, 0, count, NULL, 0, depth));
+    t->node_count = (int) count;
+
+    verify_properties(t);
+    return 0;
+}
+
+#ifdef RBTREE_ORDER_STATISTICS
+rbtree_node rbtree_node_select(rbtree t, size_t k)
+{
+    node n = t ? t->root : NULL;
+
+    while (n != NULL) {
+        size_t left = node_size(n->left);
+        if (k < left) {
+            n = n->left;
+        } else if (k == left) {
+            return n;
+        } else {
+            k -= left + 1;
+            n = n->right;
+        }
+    }
+    return NULL;
+}
+
+size_t rbtree_node_rank(rbtree t, rbtree_node n)
+{
+    size_t rank;
+    node parent;
+
+    (void)t;
+
+    assert (n != NULL);
+    rank = node_size(n->left);
+    while ((parent = node_parent(n)) != NULL) {
+        if (n == parent->right)
+            rank += node_size(parent->left) + 1;
+        n = parent;
+    }
+    return rank;
+}
+#endif
+
+static int wavl_rank(node n)
+{
+    if (n == NULL)
+        return -1;
+    return wavl_rank(n->left) + rank_diff(n, n->left);
+}
+
+/*
+ * Statistics.  The depths come from an in-order walk that tracks the
+ * depth as it steps down and up, so it needs no stack.
+ */
+void rbtree_stats(rbtree t, struct rbtree_stats* out)
+{
+    node n = t->root;
+    unsigned long total = 0;
+    int depth = 1;
+
+    memset(out, 0, sizeof(*out));
+    out->node_count = t->node_count;
+    if (t->flags & RBTREE_WAVL)
+        out->black_height = wavl_rank(t->root);
+    else
+        out->black_height = black_height(t->root);
+    out->memory = sizeof(struct rbtree_t) + t->node_count * sizeof(struct rbtree_node_t);
+#ifdef RBTREE_STATS
+    out->counters = t->counters;
+#endif
+    if (n == NULL)
+        return;
+    for (; n->left != NULL; n = n->left)
+        depth++;
+    while (n != NULL) {
+        total += depth;
+        if (depth > out->height)
+            out->height = depth;
+        if (n->right != NULL) {
+            for (n = n->right, depth++; n->left != NULL; n = n->left)
+                depth++;
+        } else {
+            node parent;
+            while ((parent = node_parent(n)) != NULL && n == parent->right) {
+                n = parent;
+                depth--;
+            }
+            n = parent;
+            depth--;
+        }
+    }
+    out->average_depth = (double) total / t->node_count;
+}
+
+#ifdef RBTREE_STATS
+void rbtree_stats_reset(rbtree t)
+{
+    memset(&t->counters, 0, sizeof(t->counters));
+}
+#endif
+
+static void augment_all(rbtree t, node n)
+{
+    if (n == NULL)
+        return;
+    augment_all(t, n->left);
+    augment_all(t, n->right);
+    t->augment(t, n);
+}
+
+void rbtree_set_augment(rbtree t, rbtree_augment_func augment)
+{
+    t->augment = augment;
+    if (augment != NULL)
+        augment_all(t, t->root);
+}
+
+#ifdef RBTREE_ABBREV_KEYS
+static void abbrev_all(rbtree t, node n)
+{
+    for (; n != NULL; n = n->right) {
+        abbrev_all(t, n->left);
+        set_abbrev(t, n);
+    }
+}
+
+void rbtree_set_abbrev(rbtree t, rbtree_abbrev_func abbrev)
+{
+    t->abbrev = abbrev;
+    abbrev_all(t, t->root);
+}
+#endif
+
+/*
+ * Interval tree: node.key is the low endpoint, ordered by the tree's
+ * compare function, which also orders the high endpoints.  Each node
+ * keeps the largest high endpoint in its subtree so that queries can
+ * skip subtrees that end before the query starts.
+ */
+static void interval_augment(rbtree t, rbtree_node n)
+{
+    rbtree_interval_node in = (rbtree_interval_node) n;
+    const void* max_high = in->high;
+
+    if (n->left != NULL) {
+        rbtree_interval_node l = (rbtree_interval_node) n->left;
+        if (compare_keys(t, l->max_high, max_high) > 0)
+            max_high = l->max_high;
+    }
+    if (n->right != NULL) {
+        rbtree_interval_node r = (rbtree_interval_node) n->right;
+        if (compare_keys(t, r->max_high, max_high) > 0)
+            max_high = r->max_high;
+    }
+    in->max_high = max_high;
+}
+
+void rbtree_interval_init(rbtree t, rbtree_compare_func compare)
+{
+    rbtree_interval_init_flags(t, compare, RBTREE_MULTI);
+}
+
+void rbtree_interval_init_flags(rbtree t, rbtree_compare_func compare, int flags)
+{
+    rbtree_init_flags(t, compare, flags);
+    rbtree_set_augment(t, interval_augment);
+}
+
+/*
+ * Adds the overlaps under n to *count.  Returns nonzero, the visitor's
+ * result, if the visitor asked to stop.
+ */
+static int interval_overlaps(rbtree t, node n, const void* lo, const void* hi,
+                             rbtree_visitor_func f, void *context, int *count)
+{
+    while (n != NULL) {
+        rbtree_interval_node in = (rbtree_interval_node) n;
+        int result;
+        /* nothing in this subtree reaches lo */
+        if (compare_keys(t, in->max_high, lo) < 0)
+            break;
+        result = interval_overlaps(t, n->left, lo, hi, f, context, count);
+        if (result != 0)
+            return result;
+        /* this node and everything to its right starts after hi */
+        if (compare_keys(t, n->key, hi) > 0)
+            break;
+        if (compare_keys(t, in->high, lo) >= 0) {
+            ++*count;
+            if (f && (result = f(n, context)) != 0)
+                return result;
+        }
+        n = n->right;
+    }
+    return 0;
+}
+
+int rbtree_interval_overlaps(rbtree t, const void* lo, const void* hi,
+                             rbtree_visitor_func f, void *context)
+{
+    int count = 0;
+    int result;
+
+    if (t == NULL)
+        return 0;
+    result = interval_overlaps(t, t->root, lo, hi, f, context, &count);
+    return result != 0 ? result : count;
+}
+
+/*
+ * Node pool.  Nodes are carved in order from large slabs and freed
+ * nodes are chained through their first word, so allocation and
+ * freeing are a few instructions and no locking: give each thread its
+ * own pool.  Each slab starts with a header, one alignment unit wide,
+ * linking it to the previous slab.
+ */
+#define POOL_ALIGN (2 * sizeof(void*))
+#define POOL_SLAB_BYTES 65536
+
+void rbtree_pool_init(rbtree_pool p, size_t node_size, size_t nodes_per_slab)
+{
+    if (node_size < sizeof(void*))
+        node_size = sizeof(void*);
+    p->node_size = (node_size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+    if (nodes_per_slab == 0)
+        nodes_per_slab = POOL_SLAB_BYTES / p->node_size;
+    p->nodes_per_slab = nodes_per_slab > 0 ? nodes_per_slab : 1;
+    p->slabs = NULL;
+    p->free_list = NULL;
+    p->next = NULL;
+    p->end = NULL;
+}
+
+void* rbtree_pool_alloc(rbtree_pool p)
+{
+    void* n = p->free_list;
+
+    if (n != NULL) {
+        p->free_list = *(void**) n;
+        return n;
+    }
+    if (p->next == p->end) {
+        char* slab = malloc(POOL_ALIGN + p->node_size * p->nodes_per_slab);
+        if (slab == NULL)
+            return NULL;
+        *(void**) slab = p->slabs;
+        p->slabs = slab;
+        p->next = slab + POOL_ALIGN;
+        p->end = p->next + p->node_size * p->nodes_per_slab;
+    }
+    n = p->next;
+    p->next += p->node_size;
+    return n;
+}
+
+void rbtree_pool_free(rbtree_pool p, void* n)
+{
+    if (n == NULL)
+        return;
+    *(void**) n = p->free_list;
+    p->free_list = n;
+}
+
+void rbtree_pool_destroy(rbtree_pool p)
+{
+    void* slab = p->slabs;
+
+    while (slab != NULL) {
+        void* next = *(void**) slab;
+        free(slab);
+        slab = next;
+    }
+    p->slabs = NULL;
+    p->free_list = NULL;
+    p->next = NULL;
+    p->end = NULL;
+}
+
+rbtree_node rbtree_pool_insert(rbtree t, rbtree_pool p, rbtree_node n)
+{
+    rbtree_pool_free(p, rbtree_insert(t, n));
+    return n;
+}
+
+int rbtree_pool_delete(rbtree t, rbtree_pool p, const void* key)
+{
+    node n = rbtree_delete(t, key);
+
+    if (n == NULL)
+        return 0;
+    rbtree_pool_free(p, n);
+    return 1;
+}
+
+void rbtree_pool_release(rbtree t, rbtree_pool p)
+{
+    store(t->root, NULL);
+    t->node_count = 0;
+    rbtree_pool_destroy(p);
 }
 
 /* vim: set ts=8 sw=4 sts=4 et: */
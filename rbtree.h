@@ -31,6 +31,11 @@
 #ifndef _RBTREE_H_
 #define _RBTREE_H_
 
+#include <stddef.h>
+#if defined(RBTREE_COMPACT) || defined(RBTREE_ABBREV_KEYS)
+#include <stdint.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -39,24 +44,129 @@ enum rbtree_node_color { RED, BLACK };
 
 typedef int (*rbtree_compare_func)(const void* left_key, const void* right_key);
 
+/*
+ * Define RBTREE_COMPACT to fold the node color into the low bit of the
+ * parent pointer, which takes a 64-bit node from 48 to 40 bytes.  The
+ * default layout keeps separate parent and color fields for ABI
+ * compatibility.  Either way, read them with rbtree_node_parent() and
+ * rbtree_node_color() rather than touching the fields.
+ */
 typedef struct rbtree_node_t {
     void* key;
     void* value;
     struct rbtree_node_t* left;
     struct rbtree_node_t* right;
+#ifdef RBTREE_COMPACT
+    uintptr_t parent_color;  /* private */
+#else
     struct rbtree_node_t* parent;
     enum rbtree_node_color color;
+#endif
+#ifdef RBTREE_ORDER_STATISTICS
+    size_t count;  /* private: nodes in this subtree */
+#endif
+#ifdef RBTREE_ABBREV_KEYS
+    uint64_t abbrev;  /* private: see rbtree_set_abbrev */
+#endif
 } *rbtree_node;
 
-typedef struct rbtree_t {
+#ifdef RBTREE_COMPACT
+#define rbtree_node_parent(n) \
+    ((struct rbtree_node_t*) ((n)->parent_color & ~(uintptr_t) 1))
+#define rbtree_node_color(n) \
+    ((enum rbtree_node_color) ((n)->parent_color & 1))
+#else
+#define rbtree_node_parent(n) ((n)->parent)
+#define rbtree_node_color(n) ((n)->color)
+#endif
+
+typedef struct rbtree_t *rbtree;
+
+/*
+ * Define RBTREE_STATS to count what each tree does, and
+ * RBTREE_STATS_LATENCY (which implies it) to also keep log2 histograms
+ * of insert, lookup and delete times.  rbtree_lookup_batch counts
+ * each key as a lookup taking an equal share of the batch's time.  The
+ * counters are plain integers: under concurrent readers they are
+ * approximate.
+ */
+#if defined(RBTREE_STATS_LATENCY) && !defined(RBTREE_STATS)
+#define RBTREE_STATS
+#endif
+#ifdef RBTREE_STATS
+enum rbtree_stats_op { RBTREE_OP_INSERT, RBTREE_OP_LOOKUP, RBTREE_OP_DELETE };
+#define RBTREE_LATENCY_BUCKETS 32
+
+struct rbtree_counters {
+    unsigned long comparisons;        /* calls of the compare function */
+    unsigned long rotations;
+    unsigned long recolorings;
+    unsigned long fixups;             /* rebalancing steps */
+    unsigned long descents;           /* searches down the tree */
+    unsigned long descent_depth;      /* nodes visited by them */
+    unsigned long max_descent_depth;
+#ifdef RBTREE_STATS_LATENCY
+    /* latency[op][i]: operations that took [2^i, 2^(i+1)) ns */
+    unsigned long latency[3][RBTREE_LATENCY_BUCKETS];
+#endif
+};
+#endif
+
+/*
+ * Recompute the augmented data of node from node itself and its
+ * children.  Called bottom-up for every node whose subtree changes.
+ */
+typedef void (*rbtree_augment_func)(rbtree t, rbtree_node node);
+
+#ifdef RBTREE_ABBREV_KEYS
+typedef uint64_t (*rbtree_abbrev_func)(const void* key);
+#endif
+
+struct rbtree_t {
     rbtree_node root;
     rbtree_compare_func compare;  /* private */
+    rbtree_augment_func augment;  /* private */
+#ifdef RBTREE_ABBREV_KEYS
+    rbtree_abbrev_func abbrev;    /* private */
+#endif
     int node_count;
-} *rbtree;
+    int flags;                    /* private */
+#ifdef RBTREE_STATS
+    struct rbtree_counters counters;
+#endif
+};
 
 typedef int (*rbtree_visitor_func)(rbtree_node node, void* context);
+typedef void (*rbtree_free_func)(rbtree_node node, void* context);
+
+/* flags for rbtree_walk_range */
+#define RBTREE_RANGE_INCLUDE_LO 1
+#define RBTREE_RANGE_INCLUDE_HI 2
+#define RBTREE_RANGE_HALF_OPEN  RBTREE_RANGE_INCLUDE_LO  /* [lo, hi) */
+#define RBTREE_RANGE_CLOSED     (RBTREE_RANGE_INCLUDE_LO | RBTREE_RANGE_INCLUDE_HI)
+
+/*
+ * flags for rbtree_init_flags
+ *
+ * RBTREE_WAVL balances the tree as a weak AVL tree instead: the colour
+ * bit holds the parity of each node's rank.  Inserts rebalance exactly
+ * like AVL, deletes do at most two rotations, and rebalancing is O(1)
+ * amortized.  Split, join and the set operations need red-black trees
+ * and refuse WAVL ones.
+ */
+#define RBTREE_WAVL             1
+/*
+ * RBTREE_MULTI makes the tree a multimap: an equal key is inserted as
+ * one more node, after those already there, rather than replacing one.
+ * Lookups and deletes by key then find the first node with the key,
+ * and rbtree_delete_all deletes them all.  Split keeps the nodes equal
+ * to key on the right, and the set operations refuse multimaps.
+ * rbtree_gen.h trees are always maps.
+ */
+#define RBTREE_MULTI            2
 
 void rbtree_init(rbtree t, rbtree_compare_func);
+void rbtree_init_flags(rbtree t, rbtree_compare_func, int flags);
 void* rbtree_lookup(rbtree t, const void* key);
 /* you must free the returned node */
 rbtree_node rbtree_insert(rbtree t, rbtree_node);
@@ -66,14 +176,270 @@ rbtree_node rbtree_delete(rbtree t, const void* key);
 /*
  * Additional methods
  */
+/*
+ * Look up count keys at once: out[i] is the node for keys[i], or NULL,
+ * exactly as rbtree_node_lookup would return.  The descents are
+ * interleaved RBTREE_BATCH_WIDTH at a time so their cache misses
+ * overlap, which pays off once the tree no longer fits in cache.
+ */
+#ifndef RBTREE_BATCH_WIDTH
+#define RBTREE_BATCH_WIDTH 8
+#endif
+void rbtree_lookup_batch(rbtree t, const void* const* keys, size_t count,
+                         rbtree_node* out);
 rbtree_node rbtree_node_lookup(rbtree t, const void* key);
 rbtree_node rbtree_node_delete(rbtree t, rbtree_node node);
 rbtree_node rbtree_node_first(rbtree t);
 rbtree_node rbtree_node_last(rbtree t);
 rbtree_node rbtree_node_prev(rbtree t, rbtree_node node);
 rbtree_node rbtree_node_next(rbtree t, rbtree_node node);
+/*
+ * Insert and look up starting from hint, a node in t near key such as
+ * the last one inserted, instead of the root.  Ascending or clustered
+ * keys then cost O(1) comparisons each; any hint, or NULL, is correct.
+ */
+rbtree_node rbtree_insert_hint(rbtree t, rbtree_node node, rbtree_node hint);
+rbtree_node rbtree_node_lookup_hint(rbtree t, const void* key, rbtree_node hint);
+/*
+ * Insert only if the key is missing, in one descent.  rbtree_find_or_insert
+ * returns the node already there with node's key (the first, in a
+ * multimap), leaving node alone, or else links node and returns it;
+ * *inserted says which.  rbtree_upsert calls update_fn, if not NULL,
+ * on the node with key if there is one, and otherwise links the node
+ * make_fn returns, whose key must equal key.  make_fn must not change
+ * the tree and may return NULL, say out of memory, to insert nothing.
+ * rbtree_upsert returns the node found or made.
+ */
+typedef rbtree_node (*rbtree_make_func)(const void* key, void* context);
+typedef void (*rbtree_update_func)(rbtree_node node, void* context);
+rbtree_node rbtree_find_or_insert(rbtree t, rbtree_node node, int* inserted);
+rbtree_node rbtree_upsert(rbtree t, const void* key, rbtree_make_func make_fn,
+                          rbtree_update_func update_fn, void* context);
+/*
+ * Low-level insertion, for callers that do their own descent (see
+ * rbtree_gen.h).  rbtree_node_link makes node the child of parent
+ * at *link, which is &t->root for an empty tree, and rebalances.
+ * rbtree_node_replace puts new_node in the place of old_node, whose
+ * key must compare equal; old_node is left to the caller.
+ */
+void rbtree_node_link(rbtree t, rbtree_node node, rbtree_node parent,
+                      rbtree_node* link);
+void rbtree_node_replace(rbtree t, rbtree_node old_node, rbtree_node new_node);
+/*
+ * Walks visit nodes in key order, reverse key order or post-order
+ * (children before parents, so the visitor may free each node).
+ * They return the number of nodes visited, unless the visitor returns
+ * nonzero, which stops the walk and is returned instead.
+ */
 int rbtree_node_walk(rbtree_node node, rbtree_visitor_func f, void *context);
+int rbtree_node_walk_reverse(rbtree_node node, rbtree_visitor_func f, void *context);
+int rbtree_node_walk_postorder(rbtree_node node, rbtree_visitor_func f, void *context);
 int rbtree_walk(rbtree t, rbtree_visitor_func f, void *context);
+int rbtree_walk_reverse(rbtree t, rbtree_visitor_func f, void *context);
+int rbtree_walk_postorder(rbtree t, rbtree_visitor_func f, void *context);
+/* first node with key >= key, or NULL */
+rbtree_node rbtree_node_lower_bound(rbtree t, const void* key);
+/* first node with key > key, or NULL */
+rbtree_node rbtree_node_upper_bound(rbtree t, const void* key);
+/*
+ * The nodes with key are first, which is returned, up to but not
+ * including *end (NULL for the end of the tree), so none if the two
+ * are the same.  In a map there is at most one.
+ */
+rbtree_node rbtree_equal_range(rbtree t, const void* key, rbtree_node* end);
+/* O(log n) with RBTREE_ORDER_STATISTICS, otherwise O(log n + count) */
+size_t rbtree_count_key(rbtree t, const void* key);
+/*
+ * Visit, in order, the nodes between lo and hi in O(log n + k).
+ * A NULL bound is unbounded; flags select whether the bounds are
+ * included.  Returns as the walks above.
+ */
+int rbtree_walk_range(rbtree t, const void* lo, const void* hi, int flags,
+                      rbtree_visitor_func f, void *context);
+/*
+ * Link count nodes, sorted by strictly ascending key, into the empty
+ * tree t in O(n).  Returns 0, or -1 (tree untouched) if t is not empty
+ * or the keys are unsorted or duplicated.  A multimap takes duplicates,
+ * in order.
+ */
+int rbtree_build_sorted(rbtree t, rbtree_node *nodes, size_t count);
+
+/*
+ * Empty t in O(n) without rebalancing, passing each node to free_fn,
+ * if not NULL, after its children.
+ */
+void rbtree_clear(rbtree t, rbtree_free_func free_fn, void* context);
+/*
+ * Delete the nodes between lo and hi, selected as by rbtree_walk_range,
+ * in O(log n + k), passing each to free_fn if not NULL.  Returns the
+ * number of nodes deleted.  WAVL trees delete them one by one, in
+ * O(k log n).
+ */
+int rbtree_delete_range(rbtree t, const void* lo, const void* hi, int flags,
+                        rbtree_free_func free_fn, void* context);
+/* delete every node with key, as rbtree_delete_range, and return how many */
+int rbtree_delete_all(rbtree t, const void* key, rbtree_free_func free_fn, void* context);
+/*
+ * Join left, pivot and right into left in O(log n), leaving right
+ * empty.  Every key in left must be before pivot's and every key in
+ * right after it (or equal, if left is a multimap); pivot may be NULL
+ * to join the two trees directly.  Returns 0, or -1 (trees untouched)
+ * if the keys are out of order or either tree is a WAVL tree.
+ */
+int rbtree_join(rbtree left, rbtree_node pivot, rbtree right);
+
+/*
+ * Set operations, in O(m log(n/m + 1)) for trees of sizes m <= n.
+ * Each combines a and b into a and leaves b empty; nodes that drop
+ * out of the result go to free_fn, if not NULL.  Where a key is in
+ * both trees, merge, if not NULL, returns the one of its two nodes to
+ * keep (it may update that node's value), otherwise a's is kept.
+ * They return the number of keys found in both trees, or -1 if a and
+ * b are the same tree or either is a WAVL tree or a multimap.  Built
+ * with RBTREE_THREADS, subproblems of at least RBTREE_SET_GRAIN nodes
+ * go to a pool of up to one worker thread per spare CPU, kept for the
+ * length of the operation, and merge and free_fn may be called from
+ * several threads at once.
+ */
+#ifndef RBTREE_SET_GRAIN
+#define RBTREE_SET_GRAIN 8192
+#endif
+/* workers for one operation; 0 for one per spare CPU */
+#ifndef RBTREE_SET_WORKERS
+#define RBTREE_SET_WORKERS 0
+#endif
+#ifdef RBTREE_THREADS
+/* change the grain and workers of set operations started from now on */
+void rbtree_set_threads(size_t grain, int workers);
+#endif
+typedef rbtree_node (*rbtree_merge_func)(rbtree_node a, rbtree_node b, void* context);
+int rbtree_union(rbtree a, rbtree b, rbtree_merge_func merge,
+                 rbtree_free_func free_fn, void* context);
+int rbtree_intersection(rbtree a, rbtree b, rbtree_merge_func merge,
+                        rbtree_free_func free_fn, void* context);
+/* the nodes of a whose keys are not in b */
+int rbtree_difference(rbtree a, rbtree b, rbtree_free_func free_fn, void* context);
+
+/*
+ * Augmented trees: the callback is run on every node whose subtree
+ * changes through insert, delete or rotation, and on the whole tree
+ * when it is set.
+ */
+void rbtree_set_augment(rbtree t, rbtree_augment_func augment);
+
+#ifdef RBTREE_ABBREV_KEYS
+/*
+ * Abbreviated keys, with RBTREE_ABBREV_KEYS.  abbrev maps a key to an
+ * integer that orders as the key does: wherever abbrev(a) < abbrev(b),
+ * a must compare before b, such as the first eight bytes of a string
+ * read big-endian.  Every node keeps its key's abbreviation, and
+ * descents compare those first, calling the compare function only
+ * when they are equal.  Setting it, or NULL to stop, takes O(n).
+ * Joins and set operations refuse trees with different abbrev
+ * functions, and the descents of rbtree_gen.h do not use them.
+ */
+void rbtree_set_abbrev(rbtree t, rbtree_abbrev_func abbrev);
+#endif
+
+/*
+ * Interval tree: node.key is the low endpoint and high the high
+ * endpoint, both ordered by the compare function.  rbtree_interval_init
+ * makes it a multimap, so intervals with the same low endpoint are all
+ * kept; rbtree_interval_init_flags takes the flags of
+ * rbtree_init_flags, and without RBTREE_MULTI an equal low endpoint
+ * replaces the old node.
+ */
+typedef struct rbtree_interval_node_t {
+    struct rbtree_node_t node;
+    const void* high;
+    const void* max_high;  /* private */
+} *rbtree_interval_node;
+
+void rbtree_interval_init(rbtree t, rbtree_compare_func compare);
+void rbtree_interval_init_flags(rbtree t, rbtree_compare_func compare, int flags);
+/*
+ * Visit the intervals that overlap the closed interval [lo, hi],
+ * skipping subtrees whose intervals all end before lo or start
+ * after hi.  Returns as the walks above.
+ */
+int rbtree_interval_overlaps(rbtree t, const void* lo, const void* hi,
+                             rbtree_visitor_func f, void *context);
+
+/*
+ * Node pool: fixed-size nodes carved from large slabs, with a free
+ * list.  Nodes are allocated uninitialized; the struct rbtree_node_t
+ * must be the first member of the node type.  A pool is not locked,
+ * so each thread should own its pools.
+ */
+typedef struct rbtree_pool_t {
+    size_t node_size;       /* private */
+    size_t nodes_per_slab;  /* private */
+    void* slabs;            /* private */
+    void* free_list;        /* private */
+    char* next;             /* private */
+    char* end;              /* private */
+} *rbtree_pool;
+
+/* nodes_per_slab may be 0 for slabs of about 64KiB */
+void rbtree_pool_init(rbtree_pool p, size_t node_size, size_t nodes_per_slab);
+void* rbtree_pool_alloc(rbtree_pool p);
+void rbtree_pool_free(rbtree_pool p, void* node);
+/* free every node of the pool at once, in O(slabs) */
+void rbtree_pool_destroy(rbtree_pool p);
+/*
+ * Convenience for trees whose nodes all come from one pool: a node
+ * replaced or deleted goes back to the pool, and rbtree_pool_release
+ * empties the tree and destroys the pool without visiting any node.
+ */
+rbtree_node rbtree_pool_insert(rbtree t, rbtree_pool p, rbtree_node node);
+int rbtree_pool_delete(rbtree t, rbtree_pool p, const void* key);
+void rbtree_pool_release(rbtree t, rbtree_pool p);
+
+/*
+ * The shape of the tree, found in O(n), and with RBTREE_STATS the
+ * counters since rbtree_init or rbtree_stats_reset.  Depths count
+ * nodes, so the root is at depth 1 and height is the maximum depth.
+ * For a WAVL tree black_height is the rank of the root instead.
+ * memory is the size of the tree and its rbtree_node_t headers, not
+ * of whatever the nodes are embedded in, nor of keys and values.
+ */
+struct rbtree_stats {
+    int node_count;
+    int height;
+    int black_height;
+    double average_depth;
+    size_t memory;
+#ifdef RBTREE_STATS
+    struct rbtree_counters counters;
+#endif
+};
+
+void rbtree_stats(rbtree t, struct rbtree_stats* out);
+#ifdef RBTREE_STATS
+void rbtree_stats_reset(rbtree t);
+#endif
+
+#ifdef RBTREE_ORDER_STATISTICS
+/*
+ * Order statistics, O(log n).  Only available when built with
+ * RBTREE_ORDER_STATISTICS, which adds a subtree count to every node.
+ */
+/* the node at 0-based position k in key order, or NULL */
+rbtree_node rbtree_node_select(rbtree t, size_t k);
+/* the 0-based position of node in key order */
+size_t rbtree_node_rank(rbtree t, rbtree_node node);
+/*
+ * Split t around key in O(log n): left gets the nodes before key and
+ * right those after it, and the node equal to key, if any, is
+ * unlinked and returned (in a multimap, the nodes equal to key go to
+ * right and NULL is returned).  t is left empty unless it is left or right.
+ * Both take t's compare and augment functions.  The subtree counts
+ * give the halves' node_count; without them, counting a half would
+ * take time linear in its size, so split is only built here.  A WAVL
+ * tree is not split: NULL is returned and nothing changes.
+ */
+rbtree_node rbtree_split(rbtree t, const void* key, rbtree left, rbtree right);
+#endif
 
 #ifdef __cplusplus
 }
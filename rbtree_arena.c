@@ -0,0 +1,678 @@
+/* Red-black trees in a node arena with 32-bit links
+ * Copyright (c) 2008 Derrick Coetzee
+ * Douglas Clowes, February 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT
+ * OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rbtree_arena.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The algorithms are those of rbtree.c, on indices instead of
+ * pointers.  Slot 0 stands for NULL: it is allocated with the first
+ * node but never linked, so reading its links is harmless, and it is
+ * always black.  Freed slots are chained through left.
+ */
+#define NIL RBTREE_ARENA_NIL
+#define BLACK_BIT 0x80000000u
+#define MIN_CAPACITY 16
+
+typedef uint32_t node;
+typedef enum rbtree_node_color color;
+typedef struct rbtree_arena_link_t* node_link;
+
+#ifdef VERIFY_RBTREE
+static void verify_properties(rbtree_arena a);
+#else
+/* Make it go away */
+#define verify_properties(a)
+#endif
+
+static node_link at(rbtree_arena a, node n) {
+    return rbtree_arena_link(a, n);
+}
+
+static node node_parent(rbtree_arena a, node n) {
+    return at(a, n)->parent & ~BLACK_BIT;
+}
+
+static void set_parent(rbtree_arena a, node n, node parent) {
+    at(a, n)->parent = parent | (at(a, n)->parent & BLACK_BIT);
+}
+
+static color node_color(rbtree_arena a, node n) {
+    return n == NIL || (at(a, n)->parent & BLACK_BIT) ? BLACK : RED;
+}
+
+static void set_color(rbtree_arena a, node n, color c) {
+    if (c == BLACK)
+        at(a, n)->parent |= BLACK_BIT;
+    else
+        at(a, n)->parent &= ~BLACK_BIT;
+}
+
+static node grandparent(rbtree_arena a, node n) {
+    assert (node_parent(a, n) != NIL); /* Not the root node */
+    assert (node_parent(a, node_parent(a, n)) != NIL); /* Not child of root */
+    return node_parent(a, node_parent(a, n));
+}
+
+static node sibling(rbtree_arena a, node n) {
+    node p = node_parent(a, n);
+    assert (p != NIL); /* Root node has no sibling */
+    if (n == at(a, p)->left)
+        return at(a, p)->right;
+    else
+        return at(a, p)->left;
+}
+
+static node uncle(rbtree_arena a, node n) {
+    return sibling(a, node_parent(a, n));
+}
+
+#ifdef RBTREE_ORDER_STATISTICS
+static uint32_t node_size(rbtree_arena a, node n) {
+    return n == NIL ? 0 : at(a, n)->count;
+}
+
+static void update_node(rbtree_arena a, node n) {
+    at(a, n)->count = 1 + node_size(a, at(a, n)->left) + node_size(a, at(a, n)->right);
+}
+
+static void update_path(rbtree_arena a, node n) {
+    while (n != NIL) {
+        update_node(a, n);
+        n = node_parent(a, n);
+    }
+}
+#else
+/* Make it go away */
+#define update_node(a, n)
+#define update_path(a, n)
+#endif
+
+#ifdef VERIFY_RBTREE
+static void verify_node(rbtree_arena a, node n, int black_count, int* path_black_count) {
+    if (node_color(a, n) == BLACK)
+        black_count++;
+    if (n == NIL) {
+        if (*path_black_count == -1)
+            *path_black_count = black_count;
+        else
+            assert (black_count == *path_black_count);
+        return;
+    }
+    assert (n < a->used);
+    if (node_color(a, n) == RED) {
+        assert (node_color(a, at(a, n)->left) == BLACK);
+        assert (node_color(a, at(a, n)->right) == BLACK);
+    }
+    if (at(a, n)->left != NIL)
+        assert (node_parent(a, at(a, n)->left) == n);
+    if (at(a, n)->right != NIL)
+        assert (node_parent(a, at(a, n)->right) == n);
+#ifdef RBTREE_ORDER_STATISTICS
+    assert (at(a, n)->count == 1 + node_size(a, at(a, n)->left) +
+                               node_size(a, at(a, n)->right));
+#endif
+    verify_node(a, at(a, n)->left, black_count, path_black_count);
+    verify_node(a, at(a, n)->right, black_count, path_black_count);
+}
+
+static void verify_properties(rbtree_arena a) {
+    int black_count_path = -1;
+    assert (node_color(a, a->root) == BLACK);
+    assert (a->root == NIL || node_parent(a, a->root) == NIL);
+    verify_node(a, a->root, 0, &black_count_path);
+#ifdef RBTREE_ORDER_STATISTICS
+    assert (node_size(a, a->root) == a->node_count);
+#endif
+}
+#endif
+
+static void replace_node(rbtree_arena a, node oldn, node newn) {
+    node parent = node_parent(a, oldn);
+    if (parent == NIL) {
+        a->root = newn;
+    } else {
+        if (oldn == at(a, parent)->left)
+            at(a, parent)->left = newn;
+        else
+            at(a, parent)->right = newn;
+    }
+    if (newn != NIL) {
+        set_parent(a, newn, parent);
+    }
+}
+
+static void rotate_left(rbtree_arena a, node n) {
+    node r = at(a, n)->right;
+    replace_node(a, n, r);
+    at(a, n)->right = at(a, r)->left;
+    if (at(a, r)->left != NIL) {
+        set_parent(a, at(a, r)->left, n);
+    }
+    at(a, r)->left = n;
+    set_parent(a, n, r);
+    update_node(a, n);
+    update_node(a, r);
+}
+
+static void rotate_right(rbtree_arena a, node n) {
+    node L = at(a, n)->left;
+    replace_node(a, n, L);
+    at(a, n)->left = at(a, L)->right;
+    if (at(a, L)->right != NIL) {
+        set_parent(a, at(a, L)->right, n);
+    }
+    at(a, L)->right = n;
+    set_parent(a, n, L);
+    update_node(a, n);
+    update_node(a, L);
+}
+
+static node minimum_node(rbtree_arena a, node n) {
+    assert (n != NIL);
+    while (at(a, n)->left != NIL) {
+        n = at(a, n)->left;
+    }
+    return n;
+}
+
+static node maximum_node(rbtree_arena a, node n) {
+    assert (n != NIL);
+    while (at(a, n)->right != NIL) {
+        n = at(a, n)->right;
+    }
+    return n;
+}
+
+/* grow by doubling, up to RBTREE_ARENA_MAX nodes and slot 0 */
+static int grow(rbtree_arena a, size_t capacity) {
+    char* slots;
+    if (capacity > (size_t) RBTREE_ARENA_MAX + 1)
+        capacity = (size_t) RBTREE_ARENA_MAX + 1;
+    if (capacity <= a->capacity)
+        return -1;
+    slots = realloc(a->slots, capacity * a->slot_size);
+    if (slots == NULL)
+        return -1;
+    if (a->slots == NULL)
+        memset(slots, 0, a->slot_size);  /* slot 0 */
+    a->slots = slots;
+    a->capacity = (uint32_t) capacity;
+    return 0;
+}
+
+static node alloc_node(rbtree_arena a) {
+    node n = a->free_list;
+    if (n != NIL) {
+        a->free_list = at(a, n)->left;
+        return n;
+    }
+    if (a->used >= a->capacity &&
+        grow(a, a->capacity ? 2 * (size_t) a->capacity : MIN_CAPACITY) != 0)
+        return NIL;
+    return a->used++;
+}
+
+static void free_node(rbtree_arena a, node n) {
+    at(a, n)->left = a->free_list;
+    a->free_list = n;
+}
+
+static void insert_case1(rbtree_arena a, node n);
+static void insert_case2(rbtree_arena a, node n);
+static void insert_case3(rbtree_arena a, node n);
+static void insert_case4(rbtree_arena a, node n);
+static void insert_case5(rbtree_arena a, node n);
+static void delete_case1(rbtree_arena a, node n);
+static void delete_case2(rbtree_arena a, node n);
+static void delete_case3(rbtree_arena a, node n);
+static void delete_case4(rbtree_arena a, node n);
+static void delete_case5(rbtree_arena a, node n);
+static void delete_case6(rbtree_arena a, node n);
+
+static void insert_case1(rbtree_arena a, node n) {
+    if (node_parent(a, n) == NIL)
+        set_color(a, n, BLACK);
+    else
+        insert_case2(a, n);
+}
+
+static void insert_case2(rbtree_arena a, node n) {
+    if (node_color(a, node_parent(a, n)) == BLACK)
+        return; /* Tree is still valid */
+    else
+        insert_case3(a, n);
+}
+
+static void insert_case3(rbtree_arena a, node n) {
+    if (node_color(a, uncle(a, n)) == RED) {
+        set_color(a, node_parent(a, n), BLACK);
+        set_color(a, uncle(a, n), BLACK);
+        set_color(a, grandparent(a, n), RED);
+        insert_case1(a, grandparent(a, n));
+    } else {
+        insert_case4(a, n);
+    }
+}
+
+static void insert_case4(rbtree_arena a, node n) {
+    node p = node_parent(a, n);
+    node g = grandparent(a, n);
+    if (n == at(a, p)->right && p == at(a, g)->left) {
+        rotate_left(a, p);
+        n = at(a, n)->left;
+    } else if (n == at(a, p)->left && p == at(a, g)->right) {
+        rotate_right(a, p);
+        n = at(a, n)->right;
+    }
+    insert_case5(a, n);
+}
+
+static void insert_case5(rbtree_arena a, node n) {
+    node p = node_parent(a, n);
+    node g = grandparent(a, n);
+    set_color(a, p, BLACK);
+    set_color(a, g, RED);
+    if (n == at(a, p)->left && p == at(a, g)->left) {
+        rotate_right(a, g);
+    } else {
+        assert (n == at(a, p)->right && p == at(a, g)->right);
+        rotate_left(a, g);
+    }
+}
+
+static void delete_case1(rbtree_arena a, node n) {
+    if (node_parent(a, n) == NIL)
+        return;
+    else
+        delete_case2(a, n);
+}
+
+static void delete_case2(rbtree_arena a, node n) {
+    if (node_color(a, sibling(a, n)) == RED) {
+        set_color(a, node_parent(a, n), RED);
+        set_color(a, sibling(a, n), BLACK);
+        if (n == at(a, node_parent(a, n))->left)
+            rotate_left(a, node_parent(a, n));
+        else
+            rotate_right(a, node_parent(a, n));
+    }
+    delete_case3(a, n);
+}
+
+static void delete_case3(rbtree_arena a, node n) {
+    node s = sibling(a, n);
+    if (node_color(a, node_parent(a, n)) == BLACK &&
+        node_color(a, s) == BLACK &&
+        node_color(a, at(a, s)->left) == BLACK &&
+        node_color(a, at(a, s)->right) == BLACK)
+    {
+        set_color(a, s, RED);
+        delete_case1(a, node_parent(a, n));
+    }
+    else
+        delete_case4(a, n);
+}
+
+static void delete_case4(rbtree_arena a, node n) {
+    node s = sibling(a, n);
+    if (node_color(a, node_parent(a, n)) == RED &&
+        node_color(a, s) == BLACK &&
+        node_color(a, at(a, s)->left) == BLACK &&
+        node_color(a, at(a, s)->right) == BLACK)
+    {
+        set_color(a, s, RED);
+        set_color(a, node_parent(a, n), BLACK);
+    }
+    else
+        delete_case5(a, n);
+}
+
+static void delete_case5(rbtree_arena a, node n) {
+    node s = sibling(a, n);
+    if (n == at(a, node_parent(a, n))->left &&
+        node_color(a, s) == BLACK &&
+        node_color(a, at(a, s)->left) == RED &&
+        node_color(a, at(a, s)->right) == BLACK)
+    {
+        set_color(a, s, RED);
+        set_color(a, at(a, s)->left, BLACK);
+        rotate_right(a, s);
+    }
+    else if (n == at(a, node_parent(a, n))->right &&
+             node_color(a, s) == BLACK &&
+             node_color(a, at(a, s)->right) == RED &&
+             node_color(a, at(a, s)->left) == BLACK)
+    {
+        set_color(a, s, RED);
+        set_color(a, at(a, s)->right, BLACK);
+        rotate_left(a, s);
+    }
+    delete_case6(a, n);
+}
+
+static void delete_case6(rbtree_arena a, node n) {
+    node s = sibling(a, n);
+    node p = node_parent(a, n);
+    set_color(a, s, node_color(a, p));
+    set_color(a, p, BLACK);
+    if (n == at(a, p)->left) {
+        assert (node_color(a, at(a, s)->right) == RED);
+        set_color(a, at(a, s)->right, BLACK);
+        rotate_left(a, p);
+    }
+    else
+    {
+        assert (node_color(a, at(a, s)->left) == RED);
+        set_color(a, at(a, s)->left, BLACK);
+        rotate_right(a, p);
+    }
+}
+
+void rbtree_arena_init(rbtree_arena a, size_t elem_size, rbtree_compare_func compare)
+{
+    a->slots = NULL;
+    a->elem_size = elem_size;
+    a->slot_size = sizeof(struct rbtree_arena_link_t) + ((elem_size + 7) & ~(size_t) 7);
+    a->compare = compare;
+    a->root = NIL;
+    a->node_count = 0;
+    a->capacity = 0;
+    a->used = 1;
+    a->free_list = NIL;
+}
+
+void rbtree_arena_destroy(rbtree_arena a)
+{
+    free(a->slots);
+    rbtree_arena_init(a, a->elem_size, a->compare);
+}
+
+void rbtree_arena_clear(rbtree_arena a)
+{
+    a->root = NIL;
+    a->node_count = 0;
+    a->used = 1;
+    a->free_list = NIL;
+}
+
+int rbtree_arena_reserve(rbtree_arena a, size_t count)
+{
+    if (count > RBTREE_ARENA_MAX)
+        return -1;
+    if (count + 1 <= a->capacity)
+        return 0;
+    return grow(a, count + 1);
+}
+
+int rbtree_arena_copy(rbtree_arena dst, rbtree_arena src)
+{
+    *dst = *src;
+    if (src->slots == NULL)
+        return 0;
+    dst->slots = malloc((size_t) src->used * src->slot_size);
+    if (dst->slots == NULL) {
+        rbtree_arena_init(dst, src->elem_size, src->compare);
+        return -1;
+    }
+    memcpy(dst->slots, src->slots, (size_t) src->used * src->slot_size);
+    dst->capacity = src->used;
+    return 0;
+}
+
+uint32_t rbtree_arena_insert(rbtree_arena a, const void* elem)
+{
+    node n = a->root;
+    node parent = NIL;
+    int comp_result = 0;
+
+    while (n != NIL) {
+        comp_result = a->compare(elem, rbtree_arena_elem(a, n));
+        if (comp_result == 0) {
+            /* key exists: overwrite in place */
+            memcpy(rbtree_arena_elem(a, n), elem, a->elem_size);
+            return n;
+        }
+        parent = n;
+        n = comp_result < 0 ? at(a, n)->left : at(a, n)->right;
+    }
+
+    /* indices survive alloc_node moving the slots */
+    n = alloc_node(a);
+    if (n == NIL)
+        return NIL;
+    at(a, n)->left = NIL;
+    at(a, n)->right = NIL;
+    at(a, n)->parent = parent;  /* red */
+    at(a, n)->count = 1;
+    memcpy(rbtree_arena_elem(a, n), elem, a->elem_size);
+    if (parent == NIL)
+        a->root = n;
+    else if (comp_result < 0)
+        at(a, parent)->left = n;
+    else
+        at(a, parent)->right = n;
+
+    update_path(a, parent);
+    insert_case1(a, n);
+    a->node_count += 1;
+    verify_properties(a);
+    return n;
+}
+
+uint32_t rbtree_arena_lookup(rbtree_arena a, const void* key)
+{
+    node n = a->root;
+    while (n != NIL) {
+        int comp_result = a->compare(key, rbtree_arena_elem(a, n));
+        if (comp_result == 0)
+            return n;
+        n = comp_result < 0 ? at(a, n)->left : at(a, n)->right;
+    }
+    return NIL;
+}
+
+int rbtree_arena_delete(rbtree_arena a, const void* key, void* out)
+{
+    node n = rbtree_arena_lookup(a, key);
+    if (n == NIL)
+        return 0;
+    if (out != NULL)
+        memcpy(out, rbtree_arena_elem(a, n), a->elem_size);
+    rbtree_arena_node_delete(a, n);
+    return 1;
+}
+
+void rbtree_arena_node_delete(rbtree_arena a, uint32_t n)
+{
+    node child;
+    assert (n != NIL && n < a->used);
+    if (at(a, n)->left != NIL && at(a, n)->right != NIL) {
+        /* node has two children: swap position with predecessor */
+        node temp;
+        color c;
+        node pred = maximum_node(a, at(a, n)->left);
+        set_parent(a, at(a, n)->left, pred);
+        if (at(a, pred)->left != NIL)
+            set_parent(a, at(a, pred)->left, n);
+        set_parent(a, at(a, n)->right, pred);
+        if (at(a, pred)->right != NIL)
+            set_parent(a, at(a, pred)->right, n);
+        temp = at(a, pred)->left;
+        at(a, pred)->left = at(a, n)->left;
+        at(a, n)->left = temp;
+        temp = at(a, pred)->right;
+        at(a, pred)->right = at(a, n)->right;
+        at(a, n)->right = temp;
+        temp = node_parent(a, pred);
+        set_parent(a, pred, node_parent(a, n));
+        set_parent(a, n, temp);
+        c = node_color(a, pred);
+        set_color(a, pred, node_color(a, n));
+        set_color(a, n, c);
+        if (node_parent(a, pred) == NIL)
+            a->root = pred;
+        else {
+            if (at(a, node_parent(a, pred))->left == n)
+                at(a, node_parent(a, pred))->left = pred;
+            else
+                at(a, node_parent(a, pred))->right = pred;
+        }
+        if (at(a, node_parent(a, n))->left == pred)
+            at(a, node_parent(a, n))->left = n;
+        else
+            at(a, node_parent(a, n))->right = n;
+    }
+
+    assert (at(a, n)->left == NIL || at(a, n)->right == NIL);
+    child = at(a, n)->right == NIL ? at(a, n)->left : at(a, n)->right;
+    if (node_color(a, n) == BLACK) {
+        set_color(a, n, node_color(a, child));
+        delete_case1(a, n);
+    }
+    replace_node(a, n, child);
+    update_path(a, node_parent(a, n));
+    if (node_parent(a, n) == NIL && child != NIL) /* root should be black */
+        set_color(a, child, BLACK);
+
+    free_node(a, n);
+    a->node_count -= 1;
+    verify_properties(a);
+}
+
+uint32_t rbtree_arena_first(rbtree_arena a)
+{
+    return a->root == NIL ? NIL : minimum_node(a, a->root);
+}
+
+uint32_t rbtree_arena_last(rbtree_arena a)
+{
+    return a->root == NIL ? NIL : maximum_node(a, a->root);
+}
+
+uint32_t rbtree_arena_next(rbtree_arena a, uint32_t n)
+{
+    node parent;
+
+    if (n == NIL)
+        return NIL;
+    if (at(a, n)->right != NIL)
+        return minimum_node(a, at(a, n)->right);
+    while ((parent = node_parent(a, n)) != NIL && n != at(a, parent)->left)
+        n = parent;
+    return parent;
+}
+
+uint32_t rbtree_arena_prev(rbtree_arena a, uint32_t n)
+{
+    node parent;
+
+    if (n == NIL)
+        return NIL;
+    if (at(a, n)->left != NIL)
+        return maximum_node(a, at(a, n)->left);
+    while ((parent = node_parent(a, n)) != NIL && n != at(a, parent)->right)
+        n = parent;
+    return parent;
+}
+
+static node bound(rbtree_arena a, const void* key, int upper) {
+    node n = a->root;
+    node best = NIL;
+    while (n != NIL) {
+        int comp_result = a->compare(key, rbtree_arena_elem(a, n));
+        if (comp_result < 0 || (comp_result == 0 && !upper)) {
+            best = n;
+            n = at(a, n)->left;
+        } else {
+            n = at(a, n)->right;
+        }
+    }
+    return best;
+}
+
+uint32_t rbtree_arena_lower_bound(rbtree_arena a, const void* key)
+{
+    return bound(a, key, 0);
+}
+
+uint32_t rbtree_arena_upper_bound(rbtree_arena a, const void* key)
+{
+    return bound(a, key, 1);
+}
+
+int rbtree_arena_walk(rbtree_arena a, rbtree_arena_visitor_func f, void* context)
+{
+    node n, next;
+    int count = 0;
+
+    for (n = rbtree_arena_first(a); n != NIL; n = next) {
+        next = rbtree_arena_next(a, n);
+        if (f != NULL) {
+            int result = f(a, n, context);
+            if (result)
+                return result;
+        }
+        count++;
+    }
+    return count;
+}
+
+#ifdef RBTREE_ORDER_STATISTICS
+uint32_t rbtree_arena_select(rbtree_arena a, size_t k)
+{
+    node n = a->root;
+
+    while (n != NIL) {
+        size_t left = node_size(a, at(a, n)->left);
+        if (k < left) {
+            n = at(a, n)->left;
+        } else if (k == left) {
+            return n;
+        } else {
+            k -= left + 1;
+            n = at(a, n)->right;
+        }
+    }
+    return NIL;
+}
+
+size_t rbtree_arena_rank(rbtree_arena a, uint32_t n)
+{
+    size_t rank;
+    node parent;
+
+    assert (n != NIL);
+    rank = node_size(a, at(a, n)->left);
+    while ((parent = node_parent(a, n)) != NIL) {
+        if (n == at(a, parent)->right)
+            rank += node_size(a, at(a, parent)->left) + 1;
+        n = parent;
+    }
+    return rank;
+}
+#endif
+/* vim: set ts=8 sw=4 sts=4 et: */
@@ -0,0 +1,125 @@
+/* Red-black trees in a node arena with 32-bit links
+ * Copyright (c) 2008 Derrick Coetzee
+ * Douglas Clowes, February 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT
+ * OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _RBTREE_ARENA_H_
+#define _RBTREE_ARENA_H_
+
+#include "rbtree.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Arena trees.  Elements of a fixed size are copied into one growable
+ * array, each after a 16-byte header of 32-bit links in place of the
+ * 40 bytes of pointers in rbtree_node_t, with the colour in the top
+ * bit of the parent index.  Nodes are named by index, 0 being none,
+ * so the whole tree can be copied or moved with memcpy and the array
+ * written to disk as it is.  The balancing is that of rbtree.c.
+ *
+ * Keys are elements, as in rbtree_gen.h: compare gets two elements,
+ * and searches take an element with its key fields filled in.  An
+ * index stays with its element until it is deleted, but the element
+ * may move whenever the arena grows, so do not hold pointers from
+ * rbtree_arena_elem across an insert, nor insert an element that is
+ * itself in the arena.  Elements are 8-byte aligned.
+ */
+#define RBTREE_ARENA_NIL 0
+#define RBTREE_ARENA_MAX 0x7fffffffu  /* the most nodes an arena holds */
+
+struct rbtree_arena_link_t {
+    uint32_t left;
+    uint32_t right;
+    uint32_t parent;  /* private: the top bit is set for black */
+    uint32_t count;   /* private: nodes in this subtree, with RBTREE_ORDER_STATISTICS */
+};
+
+typedef struct rbtree_arena_t {
+    char* slots;                  /* private: slot 0 is never used */
+    size_t slot_size;             /* private */
+    size_t elem_size;
+    rbtree_compare_func compare;  /* private */
+    uint32_t root;
+    uint32_t node_count;
+    uint32_t capacity;            /* private: slots allocated */
+    uint32_t used;                /* private: slots ever handed out */
+    uint32_t free_list;           /* private: linked through left */
+} *rbtree_arena;
+
+typedef int (*rbtree_arena_visitor_func)(rbtree_arena a, uint32_t node, void* context);
+
+void rbtree_arena_init(rbtree_arena a, size_t elem_size, rbtree_compare_func compare);
+void rbtree_arena_destroy(rbtree_arena a);
+/* empty the tree in O(1), keeping the memory */
+void rbtree_arena_clear(rbtree_arena a);
+/* make room for count nodes in all; returns 0, or -1 if out of memory */
+int rbtree_arena_reserve(rbtree_arena a, size_t count);
+/* dst, which is not initialized, becomes a copy of src; returns 0 or -1 */
+int rbtree_arena_copy(rbtree_arena dst, rbtree_arena src);
+
+/*
+ * Copy elem into the tree and return its node.  An element with an
+ * equal key is overwritten, keeping its node.  Returns NIL if the
+ * arena is full or out of memory.
+ */
+uint32_t rbtree_arena_insert(rbtree_arena a, const void* elem);
+uint32_t rbtree_arena_lookup(rbtree_arena a, const void* key);
+/* returns 1 if deleted, copying the element to out if not NULL, else 0 */
+int rbtree_arena_delete(rbtree_arena a, const void* key, void* out);
+void rbtree_arena_node_delete(rbtree_arena a, uint32_t node);
+
+uint32_t rbtree_arena_first(rbtree_arena a);
+uint32_t rbtree_arena_last(rbtree_arena a);
+uint32_t rbtree_arena_next(rbtree_arena a, uint32_t node);
+uint32_t rbtree_arena_prev(rbtree_arena a, uint32_t node);
+/* first node with key >= key, or NIL */
+uint32_t rbtree_arena_lower_bound(rbtree_arena a, const void* key);
+/* first node with key > key, or NIL */
+uint32_t rbtree_arena_upper_bound(rbtree_arena a, const void* key);
+/* as rbtree_walk */
+int rbtree_arena_walk(rbtree_arena a, rbtree_arena_visitor_func f, void* context);
+#ifdef RBTREE_ORDER_STATISTICS
+/* as rbtree_node_select and rbtree_node_rank */
+uint32_t rbtree_arena_select(rbtree_arena a, size_t k);
+size_t rbtree_arena_rank(rbtree_arena a, uint32_t node);
+#endif
+
+static inline struct rbtree_arena_link_t* rbtree_arena_link(rbtree_arena a, uint32_t node)
+{
+    return (struct rbtree_arena_link_t*) (a->slots + (size_t) node * a->slot_size);
+}
+
+static inline void* rbtree_arena_elem(rbtree_arena a, uint32_t node)
+{
+    return rbtree_arena_link(a, node) + 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+/* vim: set ts=8 sw=4 sts=4 et: */
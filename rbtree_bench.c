@@ -0,0 +1,932 @@
+/* Benchmarks for rbtree
+ * Copyright (c) 2008 Derrick Coetzee
+ * 2017 Douglas Clowes
+ *
+ * Retrieved from:
+ * http://en.literateprograms.org/Red-black_tree_(C)?oldid=7982
+ * http://en.literateprograms.org/Red-black_tree_(C)?oldid=19567
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT
+ * OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rbtree.h"
+#include "rbtree_frozen.h"
+#include "rbtree_arena.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h> /* getrusage() */
+#include <sys/wait.h> /* waitpid() */
+#include <unistd.h> /* fork(), getopt() */
+
+/*
+ * Each run loads one structure with one key workload and times these
+ * phases in order:
+ *
+ *   insert  load n keys into the empty structure
+ *   lookup  look up keys that are present
+ *   batch   the same, through rbtree_lookup_batch (rbtree and wavl)
+ *   mixed   half lookups, a quarter each inserts and deletes, at
+ *           constant size
+ *   union   rbtree_union with a tree of n keys, half of them new and
+ *           half copies of keys present (rbtree only)
+ *   intersection
+ *           rbtree_intersection with copies of the newest two thirds
+ *           of the keys, bringing the size back to about n
+ *   delete  delete every key again
+ *
+ * ns/op and ops/sec come from the wall time of the whole phase.  The
+ * latency percentiles come from every SAMPLE_EVERY'th operation timed
+ * on its own, less the cost of reading the clock, so that timing does
+ * not swamp the operations it measures.  The set phases time one
+ * operation over the whole tree, building the other operand untimed,
+ * and count each of its keys as an op.  Each structure and workload
+ * runs in a child process of its own, so the peak RSS reported after
+ * each phase is that run's so far, not that of an earlier, bigger one.
+ */
+#define SAMPLE_EVERY 16
+#define MAX_SIZES 16
+/* a run's exit status when it reported a phase */
+#define RUN_REPORTED 3
+
+enum workload { WL_RANDOM, WL_SEQUENTIAL, WL_REVERSED, WL_ZIPF, NUM_WORKLOADS };
+static const char* const workload_names[] = {
+    "random", "sequential", "reversed", "zipf"
+};
+
+enum phase {
+    PH_INSERT, PH_LOOKUP, PH_BATCH, PH_MIXED, PH_UNION, PH_INTERSECTION, PH_DELETE,
+    NUM_PHASES
+};
+static const char* const phase_names[] = {
+    "insert", "lookup", "batch", "mixed", "union", "intersection", "delete"
+};
+
+enum format { FMT_CSV, FMT_JSON };
+
+/* xorshift: cheap, repeatable, and the same on every platform */
+static unsigned int rng_state = 2463534242u;
+
+static unsigned int rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* the least time between two readings of the clock */
+static double clock_cost(void) {
+    double best = 1.0;
+    int i;
+    for (i = 0; i < 1000; ++i) {
+        double start = now();
+        double elapsed = now() - start;
+        if (elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+/*
+ * The key inserted idx'th.  Random keys are an invertible mix of idx,
+ * so they are distinct without having to be checked.
+ */
+static unsigned int key_at(enum workload w, size_t idx) {
+    unsigned int x = (unsigned int) idx;
+    switch (w) {
+    case WL_SEQUENTIAL:
+        return x;
+    case WL_REVERSED:
+        return ~x;
+    default:
+        x *= 0x9e3779b1u;
+        x ^= x >> 15;
+        x *= 0x85ebca77u;
+        x ^= x >> 13;
+        return x;
+    }
+}
+
+/*
+ * Zipf-distributed ranks, 0 the most popular, by the method of Gray
+ * et al., "Quickly generating billion-record synthetic databases".
+ */
+static struct {
+    size_t n;
+    double theta, alpha, zetan, eta;
+} zipf;
+
+static void zipf_init(size_t n, double theta) {
+    size_t i;
+
+    if (zipf.n == n && zipf.theta == theta)
+        return;
+    zipf.zetan = 0;
+    for (i = 1; i <= n; ++i)
+        zipf.zetan += 1.0 / pow((double) i, theta);
+    zipf.n = n;
+    zipf.theta = theta;
+    zipf.alpha = 1.0 / (1.0 - theta);
+    zipf.eta = (1.0 - pow(2.0 / n, 1.0 - theta)) /
+               (1.0 - (1.0 + pow(0.5, theta)) / zipf.zetan);
+}
+
+static size_t zipf_next(void) {
+    double u = rng() / 4294967296.0;
+    double uz = u * zipf.zetan;
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + pow(0.5, zipf.theta))
+        return 1;
+    return (size_t) (zipf.n * pow(zipf.eta * u - zipf.eta + 1.0, zipf.alpha));
+}
+
+/*
+ * The structures under test.  Each holds a set of unsigned keys.  A
+ * structure may leave out lookup_batch, and may load in bulk: the
+ * insert phase then calls load for each key and loaded at the end.
+ * One with set operations builds their other operand with operand
+ * and runs the union or intersection phase's operation with combine,
+ * which returns the number of keys in both.
+ */
+struct structure {
+    const char* name;
+    void (*init)(size_t capacity);
+    void (*load)(unsigned int key);
+    void (*insert)(unsigned int key);
+    int (*lookup)(unsigned int key);
+    void (*remove)(unsigned int key);
+    size_t (*lookup_batch)(const unsigned int* keys, size_t count);
+    void (*loaded)(void);
+    void (*destroy)(void);
+    size_t update_limit;  /* skip mixed and delete above this size */
+    void (*operand)(const unsigned int* keys, size_t count);
+    size_t (*combine)(enum phase p);
+};
+
+/* rbtree, with nodes allocated one at a time as a real user would */
+typedef struct {
+    struct rbtree_node_t rbnode;
+    unsigned int skey;
+} data_node;
+
+static struct rbtree_t tree;
+static size_t batch = 256;  /* at most 256 */
+
+static int compare_uint(const void* leftp, const void* rightp) {
+    unsigned int left = * (const unsigned int *)leftp;
+    unsigned int right = * (const unsigned int *)rightp;
+    return (left > right) - (left < right);
+}
+
+static void free_node(rbtree_node node, void* context) {
+    (void) context;
+    free(node);
+}
+
+static void tree_init(size_t capacity) {
+    (void) capacity;
+    rbtree_init(&tree, compare_uint);
+}
+
+/* the same tree, balanced as a WAVL tree */
+static void wavl_init(size_t capacity) {
+    (void) capacity;
+    rbtree_init_flags(&tree, compare_uint, RBTREE_WAVL);
+}
+
+static void tree_insert(unsigned int key) {
+    data_node *dnode = malloc(sizeof(data_node));
+    dnode->skey = key;
+    dnode->rbnode.key = &dnode->skey;
+    free(rbtree_insert(&tree, &dnode->rbnode));
+}
+
+static int tree_lookup(unsigned int key) {
+    return rbtree_node_lookup(&tree, &key) != NULL;
+}
+
+static void tree_remove(unsigned int key) {
+    free(rbtree_delete(&tree, &key));
+}
+
+static size_t tree_lookup_batch(const unsigned int* keys, size_t count) {
+    const void* ptrs[256];
+    rbtree_node out[256];
+    size_t found = 0;
+    size_t i, j;
+
+    for (i = 0; i < count; i += 256) {
+        size_t n = count - i < 256 ? count - i : 256;
+        for (j = 0; j < n; ++j)
+            ptrs[j] = &keys[i + j];
+        rbtree_lookup_batch(&tree, ptrs, n, out);
+        for (j = 0; j < n; ++j)
+            found += out[j] != NULL;
+    }
+    return found;
+}
+
+static void tree_destroy(void) {
+    rbtree_clear(&tree, free_node, NULL);
+}
+
+static struct rbtree_t operand;
+
+static void tree_operand(const unsigned int* keys, size_t count) {
+    size_t i;
+
+    rbtree_init(&operand, compare_uint);
+    for (i = 0; i < count; ++i) {
+        data_node *dnode = malloc(sizeof(data_node));
+        dnode->skey = keys[i];
+        dnode->rbnode.key = &dnode->skey;
+        free(rbtree_insert(&operand, &dnode->rbnode));
+    }
+}
+
+static size_t tree_combine(enum phase p) {
+    if (p == PH_UNION)
+        return rbtree_union(&tree, &operand, NULL, free_node, NULL);
+    return rbtree_intersection(&tree, &operand, NULL, free_node, NULL);
+}
+
+/*
+ * Frozen trees: loaded into a tree, frozen and searched read-only, so
+ * they skip mixed and delete.  "frozen" is the generic index over the
+ * same nodes as rbtree, "frozen-u64" the integer one (build with
+ * CFLAGS=-mavx2 for its vector search).
+ */
+static struct rbtree_frozen_t frozen;
+
+static void frozen_freeze(void) {
+    if (rbtree_freeze(&frozen, &tree, sizeof(unsigned int)) != 0) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int frozen_lookup(unsigned int key) {
+    return rbtree_frozen_lookup(&frozen, &key) != NULL;
+}
+
+static void frozen_destroy(void) {
+    rbtree_frozen_destroy(&frozen, free_node, NULL);
+}
+
+static void frozen_u64_init(size_t capacity) {
+    (void) capacity;
+    rbtree_u64_init(&tree);
+}
+
+static void frozen_u64_load(unsigned int key) {
+    rbtree_u64_node unode = malloc(sizeof(*unode));
+    unode->key = key;
+    free(rbtree_u64_insert(&tree, unode));
+}
+
+static void frozen_u64_freeze(void) {
+    if (rbtree_freeze_u64(&frozen, &tree) != 0) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int frozen_u64_lookup(unsigned int key) {
+    return rbtree_frozen_u64_lookup(&frozen, key) != NULL;
+}
+
+/* the same keys in an arena tree, reserved up front */
+static struct rbtree_arena_t arena;
+
+static void arena_init(size_t capacity) {
+    rbtree_arena_init(&arena, sizeof(unsigned int), compare_uint);
+    rbtree_arena_reserve(&arena, capacity);
+}
+
+static void arena_insert(unsigned int key) {
+    rbtree_arena_insert(&arena, &key);
+}
+
+static int arena_lookup(unsigned int key) {
+    return rbtree_arena_lookup(&arena, &key) != RBTREE_ARENA_NIL;
+}
+
+static void arena_remove(unsigned int key) {
+    rbtree_arena_delete(&arena, &key, NULL);
+}
+
+static void arena_destroy(void) {
+    rbtree_arena_destroy(&arena);
+}
+
+/*
+ * Sorted array and bsearch: loaded in bulk and sorted once, since
+ * inserting in place costs O(n) a key.
+ */
+static unsigned int* array;
+static size_t array_size, array_capacity;
+
+static int compare_key(const void* leftp, const void* rightp) {
+    return compare_uint(leftp, rightp);
+}
+
+static void array_init(size_t capacity) {
+    array_capacity = capacity + 1;
+    array = malloc(array_capacity * sizeof(*array));
+    array_size = 0;
+}
+
+static void array_append(unsigned int key) {
+    if (array_size == array_capacity) {
+        array_capacity *= 2;
+        array = realloc(array, array_capacity * sizeof(*array));
+    }
+    array[array_size++] = key;
+}
+
+static void array_sort(void) {
+    qsort(array, array_size, sizeof(*array), compare_key);
+}
+
+/* the position of the first key >= key */
+static size_t array_position(unsigned int key) {
+    size_t lo = 0, hi = array_size;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (array[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int array_lookup(unsigned int key) {
+    return bsearch(&key, array, array_size, sizeof(*array), compare_key) != NULL;
+}
+
+/* after loading, insertion in place keeps the order */
+static void array_insert(unsigned int key) {
+    size_t pos = array_position(key);
+    if (pos < array_size && array[pos] == key)
+        return;
+    array_append(key);
+    memmove(array + pos + 1, array + pos, (array_size - 1 - pos) * sizeof(*array));
+    array[pos] = key;
+}
+
+static void array_remove(unsigned int key) {
+    size_t pos = array_position(key);
+    if (pos < array_size && array[pos] == key) {
+        array_size--;
+        memmove(array + pos, array + pos + 1, (array_size - pos) * sizeof(*array));
+    }
+}
+
+static void array_destroy(void) {
+    free(array);
+    array = NULL;
+    array_size = 0;
+}
+
+/* hash table: open addressing with linear probing, at most half full */
+enum { SLOT_EMPTY, SLOT_FULL, SLOT_DELETED };
+static unsigned int* hash_keys;
+static unsigned char* hash_state;
+static size_t hash_mask, hash_used, hash_live;
+
+static size_t hash_slot(unsigned int key) {
+    return (size_t) ((key * 0x9e3779b97f4a7c15ull) >> 32) & hash_mask;
+}
+
+static void hash_alloc(size_t capacity) {
+    size_t slots = 16;
+    while (slots < 2 * capacity)
+        slots *= 2;
+    hash_keys = malloc(slots * sizeof(*hash_keys));
+    hash_state = calloc(slots, 1);
+    hash_mask = slots - 1;
+    hash_used = 0;
+    hash_live = 0;
+}
+
+static void hash_insert(unsigned int key);
+
+/* rebuild without the deleted slots, growing if need be */
+static void hash_rehash(void) {
+    unsigned int* keys = hash_keys;
+    unsigned char* state = hash_state;
+    size_t slots = hash_mask + 1;
+    size_t i;
+
+    hash_alloc(hash_live + 1);
+    for (i = 0; i < slots; ++i)
+        if (state[i] == SLOT_FULL)
+            hash_insert(keys[i]);
+    free(keys);
+    free(state);
+}
+
+static void hash_init(size_t capacity) {
+    hash_alloc(capacity);
+}
+
+static void hash_insert(unsigned int key) {
+    size_t i = hash_slot(key);
+    size_t target = (size_t) -1;
+
+    for (; hash_state[i] != SLOT_EMPTY; i = (i + 1) & hash_mask) {
+        if (hash_state[i] == SLOT_FULL && hash_keys[i] == key)
+            return;
+        if (hash_state[i] == SLOT_DELETED && target == (size_t) -1)
+            target = i;
+    }
+    if (target == (size_t) -1) {
+        target = i;
+        hash_used++;
+    }
+    hash_keys[target] = key;
+    hash_state[target] = SLOT_FULL;
+    hash_live++;
+    if (2 * hash_used > hash_mask + 1)
+        hash_rehash();
+}
+
+static int hash_lookup(unsigned int key) {
+    size_t i;
+    for (i = hash_slot(key); hash_state[i] != SLOT_EMPTY; i = (i + 1) & hash_mask)
+        if (hash_state[i] == SLOT_FULL && hash_keys[i] == key)
+            return 1;
+    return 0;
+}
+
+static void hash_remove(unsigned int key) {
+    size_t i;
+    for (i = hash_slot(key); hash_state[i] != SLOT_EMPTY; i = (i + 1) & hash_mask) {
+        if (hash_state[i] == SLOT_FULL && hash_keys[i] == key) {
+            hash_state[i] = SLOT_DELETED;
+            hash_live--;
+            return;
+        }
+    }
+}
+
+static void hash_destroy(void) {
+    free(hash_keys);
+    free(hash_state);
+    hash_keys = NULL;
+    hash_state = NULL;
+}
+
+static const struct structure structures[] = {
+    { "rbtree", tree_init, tree_insert, tree_insert, tree_lookup, tree_remove,
+      tree_lookup_batch, NULL, tree_destroy, (size_t) -1, tree_operand, tree_combine },
+    { "wavl", wavl_init, tree_insert, tree_insert, tree_lookup, tree_remove,
+      tree_lookup_batch, NULL, tree_destroy, (size_t) -1, NULL, NULL },
+    { "frozen", tree_init, tree_insert, NULL, frozen_lookup, NULL,
+      NULL, frozen_freeze, frozen_destroy, 0, NULL, NULL },
+    { "frozen-u64", frozen_u64_init, frozen_u64_load, NULL, frozen_u64_lookup, NULL,
+      NULL, frozen_u64_freeze, frozen_destroy, 0, NULL, NULL },
+    { "arena", arena_init, arena_insert, arena_insert, arena_lookup, arena_remove,
+      NULL, NULL, arena_destroy, (size_t) -1, NULL, NULL },
+    { "array", array_init, array_append, array_insert, array_lookup, array_remove,
+      NULL, array_sort, array_destroy, 1u << 18, NULL, NULL },
+    { "hash", hash_init, hash_insert, hash_insert, hash_lookup, hash_remove,
+      NULL, NULL, hash_destroy, (size_t) -1, NULL, NULL },
+};
+#define NUM_STRUCTURES ((int) (sizeof(structures) / sizeof(structures[0])))
+
+/*
+ * The structure being run holds the keys inserted lo'th to hi'th, so
+ * mixed inserts at hi, deletes at lo, and lookups pick in between.
+ */
+static const struct structure* s;
+static enum workload w;
+static size_t lo, hi, found;
+
+static size_t pick(size_t i) {
+    size_t live = hi - lo;
+    switch (w) {
+    case WL_SEQUENTIAL:
+    case WL_REVERSED:
+        return lo + i % live;
+    case WL_ZIPF:
+        return lo + zipf_next() % live;
+    default:
+        return lo + rng() % live;
+    }
+}
+
+/*
+ * Operations are generated a chunk at a time, outside the timed loop,
+ * so that making up keys (a Zipf draw is two calls to pow) is not
+ * counted against the structure.
+ */
+#define CHUNK 4096
+
+enum op { OP_LOAD, OP_INSERT, OP_LOOKUP, OP_REMOVE };
+
+static size_t prepare(enum phase p, size_t i, size_t n,
+                      unsigned char* ops, unsigned int* keys) {
+    size_t k;
+
+    for (k = 0; k < n; ++k, ++i) {
+        switch (p) {
+        case PH_INSERT:
+            ops[k] = OP_LOAD;
+            keys[k] = key_at(w, hi++);
+            break;
+        case PH_LOOKUP:
+        case PH_BATCH:
+            ops[k] = OP_LOOKUP;
+            keys[k] = key_at(w, pick(i));
+            break;
+        case PH_MIXED:
+            switch (rng() & 3) {
+            case 0:
+            case 1:
+                ops[k] = OP_LOOKUP;
+                keys[k] = key_at(w, pick(i));
+                break;
+            case 2:
+                ops[k] = OP_INSERT;
+                keys[k] = key_at(w, hi++);
+                break;
+            default:
+                /* never empty the structure */
+                ops[k] = hi > lo + 1 ? OP_REMOVE : OP_LOOKUP;
+                keys[k] = key_at(w, ops[k] == OP_REMOVE ? lo++ : pick(i));
+                break;
+            }
+            break;
+        default:
+            ops[k] = OP_REMOVE;
+            keys[k] = key_at(w, lo++);
+            break;
+        }
+    }
+    return n;
+}
+
+static size_t execute(unsigned char op, unsigned int key) {
+    switch (op) {
+    case OP_LOAD:
+        s->load(key);
+        return 0;
+    case OP_INSERT:
+        s->insert(key);
+        return 0;
+    case OP_LOOKUP:
+        return s->lookup(key);
+    default:
+        s->remove(key);
+        return 0;
+    }
+}
+
+struct result {
+    double total;
+    size_t ops;
+    double* samples;
+    size_t num_samples;
+};
+
+static int compare_double(const void* leftp, const void* rightp) {
+    double left = * (const double *)leftp;
+    double right = * (const double *)rightp;
+    return (left > right) - (left < right);
+}
+
+static double percentile(struct result* r, double p) {
+    size_t i;
+    if (r->num_samples == 0)
+        return 0;
+    i = (size_t) (p * (r->num_samples - 1) + 0.5);
+    return r->samples[i] * 1e9;
+}
+
+static void run_phase(enum phase p, size_t count, double cost, struct result* r) {
+    static unsigned char ops[CHUNK];
+    static unsigned int keys[CHUNK];
+    size_t i, k, n, lookups = 0;
+    double start, t0;
+
+    r->total = 0;
+    r->ops = count;
+    r->num_samples = 0;
+    found = 0;
+    for (i = 0; i < count; i += n) {
+        n = prepare(p, i, count - i < CHUNK ? count - i : CHUNK, ops, keys);
+        for (k = 0; k < n; ++k)
+            lookups += ops[k] == OP_LOOKUP;
+        start = now();
+        if (p == PH_BATCH) {
+            for (k = 0; k < n; k += batch) {
+                size_t m = n - k < batch ? n - k : batch;
+                t0 = now();
+                found += s->lookup_batch(keys + k, m);
+                r->samples[r->num_samples++] = (now() - t0 - cost) / m;
+            }
+        } else {
+            for (k = 0; k < n; ++k) {
+                if ((i + k) % SAMPLE_EVERY != 0) {
+                    found += execute(ops[k], keys[k]);
+                    continue;
+                }
+                t0 = now();
+                found += execute(ops[k], keys[k]);
+                r->samples[r->num_samples++] = now() - t0 - cost;
+            }
+        }
+        r->total += now() - start;
+    }
+    if (p == PH_INSERT && s->loaded != NULL) {
+        start = now();
+        s->loaded();
+        r->total += now() - start;
+    }
+    if (found != lookups)
+        fprintf(stderr, "%s %s %s: missed %zu keys\n", s->name,
+                workload_names[w], phase_names[p], lookups - found);
+}
+
+/*
+ * The set phases: union adds keys hi.. and copies of keys from lo..,
+ * intersection keeps copies of the newest two thirds and drops the rest
+ */
+static void run_set_phase(enum phase p, size_t size, struct result* r) {
+    size_t live = hi - lo;
+    size_t n = p == PH_UNION ? size : live - live / 3;
+    unsigned int* keys = malloc(n * sizeof(*keys));
+    size_t i, expect;
+    double start;
+
+    if (p == PH_UNION) {
+        expect = 0;
+        for (i = 0; i < n; ++i) {
+            if (i % 2 == 0) {
+                keys[i] = key_at(w, hi++);
+            } else {
+                keys[i] = key_at(w, lo + i / 2 % live);
+                expect += i / 2 < live;
+            }
+        }
+    } else {
+        lo += live / 3;
+        expect = n;
+        for (i = 0; i < n; ++i)
+            keys[i] = key_at(w, lo + i);
+    }
+    s->operand(keys, n);
+    free(keys);
+    start = now();
+    found = s->combine(p);
+    r->total = now() - start;
+    r->ops = n;
+    r->samples[0] = r->total / n;
+    r->num_samples = 1;
+    if (found != expect)
+        fprintf(stderr, "%s %s %s: missed %zu keys\n", s->name,
+                workload_names[w], phase_names[p], expect - found);
+}
+
+static long run_peak_rss_kb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void report(enum format fmt, int first, size_t size, enum phase p,
+                   struct result* r) {
+    double ns = r->total * 1e9 / r->ops;
+
+    qsort(r->samples, r->num_samples, sizeof(*r->samples), compare_double);
+    if (fmt == FMT_CSV) {
+        printf("%s,%s,%s,%zu,%zu,%.1f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%ld\n",
+               s->name, workload_names[w], phase_names[p], size, r->ops, ns,
+               r->ops / r->total, percentile(r, 0.5), percentile(r, 0.9),
+               percentile(r, 0.99), percentile(r, 0.999), percentile(r, 1.0),
+               run_peak_rss_kb());
+    } else {
+        printf("%s  {\"structure\": \"%s\", \"workload\": \"%s\", \"phase\": \"%s\", "
+               "\"size\": %zu, \"ops\": %zu, \"ns_per_op\": %.1f, \"ops_per_sec\": %.0f, "
+               "\"p50_ns\": %.0f, \"p90_ns\": %.0f, \"p99_ns\": %.0f, \"p999_ns\": %.0f, "
+               "\"max_ns\": %.0f, \"run_peak_rss_kb\": %ld}",
+               first ? "" : ",\n", s->name, workload_names[w], phase_names[p],
+               size, r->ops, ns, r->ops / r->total, percentile(r, 0.5),
+               percentile(r, 0.9), percentile(r, 0.99), percentile(r, 0.999),
+               percentile(r, 1.0), run_peak_rss_kb());
+    }
+    fflush(stdout);
+}
+
+/*
+ * Load s with workload w and run the phases in phase_mask, reporting
+ * each; returns whether any was reported.  The caller forks for it.
+ */
+static int run_workload(size_t size, size_t ops, int phase_mask, double theta,
+                        unsigned int seed, double cost, enum format fmt, int first,
+                        struct result* r) {
+    int reported = 0;
+    enum phase p;
+
+    if (w == WL_ZIPF)
+        zipf_init(size, theta);
+    rng_state = seed;
+    s->init(size);
+    lo = hi = 0;
+    for (p = 0; p < NUM_PHASES; ++p) {
+        size_t phase_ops = p == PH_INSERT ? size : p == PH_DELETE ? hi - lo : ops;
+        if (p == PH_BATCH && s->lookup_batch == NULL)
+            continue;
+        if ((p == PH_UNION || p == PH_INTERSECTION) &&
+            (s->combine == NULL || !(phase_mask & (1 << p))))
+            continue;
+        if ((p == PH_MIXED || p == PH_DELETE) && size > s->update_limit) {
+            if (phase_mask & (1 << p))
+                fprintf(stderr, "%s %s: skipped at size %zu\n",
+                        s->name, phase_names[p], size);
+            continue;
+        }
+        if (!(phase_mask & (1 << p))) {
+            /* not reported, but the later phases need the keys */
+            if (p == PH_INSERT)
+                run_phase(p, phase_ops, cost, r);
+            continue;
+        }
+        if (p == PH_UNION || p == PH_INTERSECTION)
+            run_set_phase(p, size, r);
+        else
+            run_phase(p, phase_ops, cost, r);
+        report(fmt, first && !reported, size, p, r);
+        reported = 1;
+    }
+    s->destroy();
+    return reported;
+}
+
+/* a comma-separated list of names, as a bit mask */
+static int parse_names(char* arg, const char* const* names, int count) {
+    int mask = 0;
+    char* name;
+    int i;
+
+    for (name = strtok(arg, ","); name != NULL; name = strtok(NULL, ",")) {
+        for (i = 0; i < count; ++i)
+            if (strcmp(name, names[i]) == 0)
+                break;
+        if (i == count)
+            return 0;
+        mask |= 1 << i;
+    }
+    return mask;
+}
+
+/* a number with an optional k, m or g suffix */
+static size_t parse_size(const char* arg) {
+    char* end;
+    size_t n = strtoul(arg, &end, 0);
+    switch (*end) {
+    case 'k': case 'K': n *= 1000; break;
+    case 'm': case 'M': n *= 1000000; break;
+    case 'g': case 'G': n *= 1000000000; break;
+    }
+    return n;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [-n sizes] [-o ops] [-s structures] [-w workloads]\n"
+            "       [-p phases] [-z theta] [-b batch] [-r seed] [-f csv|json]\n"
+            "  sizes:      comma-separated, with k/m/g suffixes (1k,1m)\n"
+            "  structures: rbtree,wavl,frozen,frozen-u64,arena,array,hash\n"
+            "  workloads:  random,sequential,reversed,zipf\n"
+            "  phases:     insert,lookup,batch,mixed,union,intersection,delete\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+    static const char* const structure_names[] = {
+        "rbtree", "wavl", "frozen", "frozen-u64", "arena", "array", "hash"
+    };
+    size_t sizes[MAX_SIZES] = { 1000, 1000000 };
+    int num_sizes = 2;
+    size_t ops_arg = 0;
+    int structure_mask = (1 << NUM_STRUCTURES) - 1;
+    int workload_mask = (1 << NUM_WORKLOADS) - 1;
+    int phase_mask = (1 << NUM_PHASES) - 1;
+    enum format fmt = FMT_CSV;
+    double theta = 0.99;
+    unsigned int seed = rng_state;
+    double cost;
+    struct result r;
+    int first = 1;
+    int failed = 0;
+    int opt, si, n;
+    char* arg;
+
+    while ((opt = getopt(argc, argv, "n:o:s:w:p:z:b:r:f:")) != -1) {
+        switch (opt) {
+        case 'n':
+            num_sizes = 0;
+            for (arg = strtok(optarg, ","); arg != NULL; arg = strtok(NULL, ","))
+                if (num_sizes < MAX_SIZES)
+                    sizes[num_sizes++] = parse_size(arg);
+            break;
+        case 'o': ops_arg = parse_size(optarg); break;
+        case 's': structure_mask = parse_names(optarg, structure_names, NUM_STRUCTURES); break;
+        case 'w': workload_mask = parse_names(optarg, workload_names, NUM_WORKLOADS); break;
+        case 'p': phase_mask = parse_names(optarg, phase_names, NUM_PHASES); break;
+        case 'z': theta = strtod(optarg, NULL); break;
+        case 'b': batch = strtoul(optarg, NULL, 0); break;
+        case 'r': seed = strtoul(optarg, NULL, 0); break;
+        case 'f':
+            if (strcmp(optarg, "csv") == 0)
+                fmt = FMT_CSV;
+            else if (strcmp(optarg, "json") == 0)
+                fmt = FMT_JSON;
+            else
+                usage(argv[0]);
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (num_sizes == 0 || structure_mask == 0 || workload_mask == 0 ||
+        phase_mask == 0 || batch == 0 || batch > 256 || seed == 0 ||
+        theta <= 0 || theta == 1.0)
+        usage(argv[0]);
+    for (n = 0; n < num_sizes; ++n)
+        if (sizes[n] == 0 || sizes[n] > 0xffffffffu)
+            usage(argv[0]);
+
+    cost = clock_cost();
+    if (fmt == FMT_CSV)
+        printf("structure,workload,phase,size,ops,ns_per_op,ops_per_sec,"
+               "p50_ns,p90_ns,p99_ns,p999_ns,max_ns,run_peak_rss_kb\n");
+    else
+        printf("[\n");
+
+    for (n = 0; n < num_sizes; ++n) {
+        size_t size = sizes[n];
+        size_t ops = ops_arg != 0 ? ops_arg : size > 1000000 ? size : 1000000;
+        size_t max_ops = ops > size ? ops : size;
+        r.samples = malloc((max_ops / SAMPLE_EVERY + max_ops / batch + 2) * sizeof(*r.samples));
+        for (si = 0; si < NUM_STRUCTURES; ++si) {
+            if (!(structure_mask & (1 << si)))
+                continue;
+            s = &structures[si];
+            for (w = 0; w < NUM_WORKLOADS; ++w) {
+                pid_t pid;
+                int status;
+                if (!(workload_mask & (1 << w)))
+                    continue;
+                fflush(stdout);
+                pid = fork();
+                if (pid == 0)
+                    exit(run_workload(size, ops, phase_mask, theta, seed, cost, fmt,
+                                      first, &r) ? RUN_REPORTED : EXIT_SUCCESS);
+                if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+                    (WEXITSTATUS(status) != EXIT_SUCCESS &&
+                     WEXITSTATUS(status) != RUN_REPORTED)) {
+                    fprintf(stderr, "%s %s: run failed at size %zu\n",
+                            s->name, workload_names[w], size);
+                    failed = 1;
+                } else if (WEXITSTATUS(status) == RUN_REPORTED) {
+                    first = 0;
+                }
+            }
+        }
+        free(r.samples);
+    }
+    if (fmt == FMT_JSON)
+        printf("\n]\n");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+/* vim: set ts=8 sw=4 sts=4: */
@@ -0,0 +1,388 @@
+/* Frozen, read-only search indexes over red-black trees
+ * Copyright (c) 2008 Derrick Coetzee
+ * Douglas Clowes, February 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT
+ * OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rbtree_frozen.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/*
+ * The generic index: entry k's children are entries 2k and 2k + 1,
+ * entry 1 is the root, and 0 is unused.  Entries are key_size bytes
+ * of key, or a key pointer, and eytzinger_ranks has the position in
+ * key order of each, needed only once the search has ended.
+ */
+
+/*
+ * The integer index is a static B-tree: block k holds BLOCK sorted
+ * keys and its children are blocks k * (BLOCK + 1) + 1 onwards, child
+ * i leading to the keys between key i - 1 and key i.  Keys have bias
+ * subtracted so that signed comparisons order them; slots past the
+ * last key hold INT64_MAX, which sorts after every key.
+ */
+#define BLOCK 8
+#define CACHE_LINE 64
+
+#ifdef __GNUC__
+#define prefetch(p) __builtin_prefetch(p)
+#define popcount(x) __builtin_popcount(x)
+#else
+#define prefetch(p) ((void)(p))
+static int popcount(unsigned x) {
+    int n = 0;
+    for (; x; x &= x - 1)
+        n++;
+    return n;
+}
+#endif
+
+static void* alloc_aligned(size_t size) {
+    void* p;
+    if (posix_memalign(&p, CACHE_LINE, size ? size : 1) != 0)
+        return NULL;
+    return p;
+}
+
+static size_t child_block(size_t k, size_t i) {
+    return k * (BLOCK + 1) + i + 1;
+}
+
+static size_t entry_size(rbtree_frozen f) {
+    return f->key_size ? f->key_size : sizeof(void*);
+}
+
+static const void* entry_key(rbtree_frozen f, size_t k) {
+    if (f->key_size)
+        return f->eytzinger + k * f->key_size;
+    return ((const void* const*) f->eytzinger)[k];
+}
+
+static size_t fill_eytzinger(rbtree_frozen f, size_t rank, size_t k) {
+    if (k <= f->count) {
+        rank = fill_eytzinger(f, rank, 2 * k);
+        if (f->key_size)
+            memcpy(f->eytzinger + k * f->key_size, f->nodes[rank]->key, f->key_size);
+        else
+            ((void**) f->eytzinger)[k] = f->nodes[rank]->key;
+        f->eytzinger_ranks[k] = rank;
+        rank = fill_eytzinger(f, rank + 1, 2 * k + 1);
+    }
+    return rank;
+}
+
+static size_t fill_blocks(rbtree_frozen f, size_t rank, size_t k) {
+    size_t i;
+    if (k >= f->blocks)
+        return rank;
+    for (i = 0; i < BLOCK; ++i) {
+        size_t slot = k * BLOCK + i;
+        rank = fill_blocks(f, rank, child_block(k, i));
+        if (rank < f->count) {
+            f->keys[slot] = ((rbtree_u64_node) f->nodes[rank])->key - f->bias;
+            f->ranks[slot] = rank++;
+        } else {
+            f->keys[slot] = INT64_MAX;
+            f->ranks[slot] = f->count;
+        }
+    }
+    return fill_blocks(f, rank, child_block(k, BLOCK));
+}
+
+/* all or nothing: t is emptied only once every array is allocated */
+static int freeze(rbtree_frozen f, rbtree t, int integer, uint64_t bias, size_t key_size) {
+    rbtree_node n;
+    size_t i = 0;
+
+    f->count = t->node_count;
+    f->compare = t->compare;
+    f->augment = t->augment;
+#ifdef RBTREE_ABBREV_KEYS
+    f->abbrev = t->abbrev;
+#endif
+    f->flags = t->flags;
+    f->eytzinger = NULL;
+    f->eytzinger_ranks = NULL;
+    f->key_size = key_size;
+    f->keys = NULL;
+    f->ranks = NULL;
+    f->blocks = 0;
+    f->bias = bias;
+    f->nodes = malloc((f->count ? f->count : 1) * sizeof(rbtree_node));
+    if (f->nodes == NULL)
+        return -1;
+    if (integer) {
+        f->blocks = (f->count + BLOCK - 1) / BLOCK;
+        f->keys = alloc_aligned(f->blocks * BLOCK * sizeof(int64_t));
+        f->ranks = malloc((f->blocks * BLOCK + 1) * sizeof(size_t));
+        if (f->keys == NULL || f->ranks == NULL) {
+            rbtree_frozen_destroy(f, NULL, NULL);
+            return -1;
+        }
+    } else {
+        f->eytzinger = alloc_aligned((f->count + 1) * entry_size(f));
+        f->eytzinger_ranks = malloc((f->count + 1) * sizeof(size_t));
+        if (f->eytzinger == NULL || f->eytzinger_ranks == NULL) {
+            rbtree_frozen_destroy(f, NULL, NULL);
+            return -1;
+        }
+    }
+
+    for (n = rbtree_node_first(t); n != NULL; n = rbtree_node_next(t, n))
+        f->nodes[i++] = n;
+    assert (i == f->count);
+    if (integer)
+        fill_blocks(f, 0, 0);
+    else
+        fill_eytzinger(f, 0, 1);
+    t->root = NULL;
+    t->node_count = 0;
+    return 0;
+}
+
+int rbtree_freeze(rbtree_frozen f, rbtree t, size_t key_size)
+{
+    return freeze(f, t, 0, 0, key_size);
+}
+
+int rbtree_freeze_u64(rbtree_frozen f, rbtree t)
+{
+    return freeze(f, t, 1, (uint64_t) 1 << 63, 0);
+}
+
+int rbtree_freeze_s64(rbtree_frozen f, rbtree t)
+{
+    return freeze(f, t, 1, 0, 0);
+}
+
+void rbtree_thaw(rbtree_frozen f, rbtree t)
+{
+    int result;
+
+    rbtree_init_flags(t, f->compare, f->flags);
+    t->augment = f->augment;
+#ifdef RBTREE_ABBREV_KEYS
+    t->abbrev = f->abbrev;
+#endif
+    result = rbtree_build_sorted(t, f->nodes, f->count);
+    assert (result == 0);
+    (void) result;
+    rbtree_frozen_destroy(f, NULL, NULL);
+}
+
+void rbtree_frozen_destroy(rbtree_frozen f, rbtree_free_func free_fn, void* context)
+{
+    size_t i;
+
+    if (free_fn != NULL)
+        for (i = 0; i < f->count; ++i)
+            free_fn(f->nodes[i], context);
+    free(f->nodes);
+    free(f->eytzinger);
+    free(f->eytzinger_ranks);
+    free(f->keys);
+    free(f->ranks);
+    f->nodes = NULL;
+    f->eytzinger = NULL;
+    f->eytzinger_ranks = NULL;
+    f->keys = NULL;
+    f->ranks = NULL;
+    f->count = 0;
+    f->blocks = 0;
+}
+
+/*
+ * Descend as if to a leaf, going right past every key before the one
+ * searched for (or not after it, for upper).  The bound is the last
+ * entry where the search went left: strip the trailing right turns,
+ * which are 1 bits, and the left turn before them.  0 means there is
+ * none.  The eight entries three levels down are fetched while
+ * comparing, as far as the array has them.
+ */
+static size_t eytzinger_search(rbtree_frozen f, const void* key, int upper) {
+    size_t size = entry_size(f);
+    size_t k = 1;
+
+    while (k <= f->count) {
+        int comp_result;
+        if (8 * k <= f->count) {
+            prefetch(f->eytzinger + 8 * k * size);
+            if (8 * k + 4 <= f->count)
+                prefetch(f->eytzinger + (8 * k + 4) * size);
+        }
+        comp_result = f->compare(key, entry_key(f, k));
+        k = 2 * k + (upper ? comp_result >= 0 : comp_result > 0);
+    }
+    while (k & 1)
+        k >>= 1;
+    return k >> 1;
+}
+
+/* the number of keys in the block before y (or not after it, for upper) */
+static unsigned block_rank(const int64_t* block, int64_t y, int upper) {
+#ifdef __AVX2__
+    __m256i yv = _mm256_set1_epi64x(y);
+    __m256i lo = _mm256_load_si256((const __m256i*) block);
+    __m256i hi = _mm256_load_si256((const __m256i*) (block + 4));
+    unsigned mask;
+    if (upper) {
+        mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(lo, yv))) |
+               _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(hi, yv))) << 4;
+        return BLOCK - popcount(mask);
+    }
+    mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(yv, lo))) |
+           _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(yv, hi))) << 4;
+    return popcount(mask);
+#else
+    unsigned i, rank = 0;
+    for (i = 0; i < BLOCK; ++i)
+        rank += upper ? block[i] <= y : block[i] < y;
+    return rank;
+#endif
+}
+
+/*
+ * As eytzinger_search: the slot of the last key the search passed on
+ * the left, or the number of slots if there is none.
+ */
+static size_t block_search(rbtree_frozen f, int64_t y, int upper) {
+    size_t k = 0;
+    size_t slot = f->blocks * BLOCK;
+
+    while (k < f->blocks) {
+        unsigned i = block_rank(f->keys + k * BLOCK, y, upper);
+        if (i < BLOCK)
+            slot = k * BLOCK + i;
+        k = child_block(k, i);
+    }
+    return slot;
+}
+
+static int64_t block_key(rbtree_frozen f, const void* key) {
+    return (int64_t) (((const struct rbtree_u64_node_t*) key)->key - f->bias);
+}
+
+static rbtree_node node_at(rbtree_frozen f, size_t rank) {
+    return rank < f->count ? f->nodes[rank] : NULL;
+}
+
+/* the rank of the first key at or after key (or after it, for upper) */
+static size_t bound(rbtree_frozen f, const void* key, int upper) {
+    if (f->keys != NULL) {
+        size_t slot = block_search(f, block_key(f, key), upper);
+        return slot < f->blocks * BLOCK ? f->ranks[slot] : f->count;
+    } else {
+        size_t k = eytzinger_search(f, key, upper);
+        return k > 0 ? f->eytzinger_ranks[k] : f->count;
+    }
+}
+
+/* the key found is checked in the index, so only the node returned is read */
+static rbtree_node block_lookup(rbtree_frozen f, int64_t y) {
+    size_t slot = block_search(f, y, 0);
+    if (slot == f->blocks * BLOCK || f->keys[slot] != y)
+        return NULL;
+    return node_at(f, f->ranks[slot]);
+}
+
+rbtree_node rbtree_frozen_lookup(rbtree_frozen f, const void* key)
+{
+    size_t k;
+
+    if (f->keys != NULL)
+        return block_lookup(f, block_key(f, key));
+    k = eytzinger_search(f, key, 0);
+    if (k == 0 || f->compare(key, entry_key(f, k)) != 0)
+        return NULL;
+    return f->nodes[f->eytzinger_ranks[k]];
+}
+
+rbtree_node rbtree_frozen_lower_bound(rbtree_frozen f, const void* key)
+{
+    return node_at(f, bound(f, key, 0));
+}
+
+rbtree_node rbtree_frozen_upper_bound(rbtree_frozen f, const void* key)
+{
+    return node_at(f, bound(f, key, 1));
+}
+
+static int walk_ranks(rbtree_frozen f, size_t first, size_t last,
+                      rbtree_visitor_func fn, void* context)
+{
+    size_t i;
+
+    for (i = first; i < last; ++i) {
+        if (fn) {
+            int result = fn(f->nodes[i], context);
+            if (result != 0)
+                return result;
+        }
+    }
+    return first < last ? (int) (last - first) : 0;
+}
+
+int rbtree_frozen_walk(rbtree_frozen f, rbtree_visitor_func fn, void* context)
+{
+    return walk_ranks(f, 0, f->count, fn, context);
+}
+
+/* both ends are found by search, so the walk itself compares no keys */
+int rbtree_frozen_walk_range(rbtree_frozen f, const void* lo, const void* hi, int flags,
+                             rbtree_visitor_func fn, void* context)
+{
+    size_t first = lo == NULL ? 0 : bound(f, lo, !(flags & RBTREE_RANGE_INCLUDE_LO));
+    size_t last = hi == NULL ? f->count : bound(f, hi, flags & RBTREE_RANGE_INCLUDE_HI);
+    return walk_ranks(f, first, last, fn, context);
+}
+
+static size_t block_lower_bound(rbtree_frozen f, int64_t y) {
+    size_t slot;
+    assert (f->keys != NULL || f->count == 0);
+    slot = block_search(f, y, 0);
+    return slot < f->blocks * BLOCK ? f->ranks[slot] : f->count;
+}
+
+rbtree_u64_node rbtree_frozen_u64_lookup(rbtree_frozen f, uint64_t key)
+{
+    return (rbtree_u64_node) block_lookup(f, (int64_t) (key - f->bias));
+}
+
+rbtree_u64_node rbtree_frozen_u64_lower_bound(rbtree_frozen f, uint64_t key)
+{
+    return (rbtree_u64_node) node_at(f, block_lower_bound(f, (int64_t) (key - f->bias)));
+}
+
+rbtree_s64_node rbtree_frozen_s64_lookup(rbtree_frozen f, int64_t key)
+{
+    return (rbtree_s64_node) block_lookup(f, key);
+}
+
+rbtree_s64_node rbtree_frozen_s64_lower_bound(rbtree_frozen f, int64_t key)
+{
+    return (rbtree_s64_node) node_at(f, block_lower_bound(f, key));
+}
+/* vim: set ts=8 sw=4 sts=4 et: */
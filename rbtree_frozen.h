@@ -0,0 +1,105 @@
+/* Frozen, read-only search indexes over red-black trees
+ * Copyright (c) 2008 Derrick Coetzee
+ * Douglas Clowes, February 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT
+ * OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _RBTREE_FROZEN_H_
+#define _RBTREE_FROZEN_H_
+
+#include "rbtree.h"
+#include "rbtree_u64.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Freezing moves every node of a tree, which is left empty, into a
+ * read-only index laid out in contiguous arrays for searching, and
+ * thawing links them back into a tree in O(n).  Nodes must not change
+ * while frozen; they are not copied.
+ *
+ * rbtree_freeze lays the keys out in Eytzinger (BFS) order, so the
+ * first levels of every search share a few cache lines and the next
+ * ones are prefetched ahead of the comparisons.  With a key_size it
+ * copies that many bytes of each key into the layout, and compare is
+ * called on the copies; with 0 it keeps pointers to the keys, and
+ * each comparison still has to fetch its key.  rbtree_freeze_u64
+ * and rbtree_freeze_s64 take trees of rbtree_u64.h nodes and copy the
+ * keys into a static B-tree of one 64-byte cache line per node, which
+ * a search ranks with one vector comparison (AVX2 when built with it)
+ * instead of three levels of binary search.
+ *
+ * Lookups and walks take the same keys and return the same nodes as
+ * on the tree; on an integer index the generic functions take probe
+ * nodes, as rbtree_u64.h does.
+ */
+typedef struct rbtree_frozen_t {
+    rbtree_node* nodes;                       /* private: in key order */
+    size_t count;
+    rbtree_compare_func compare;              /* private */
+    rbtree_augment_func augment;              /* private */
+#ifdef RBTREE_ABBREV_KEYS
+    rbtree_abbrev_func abbrev;                /* private */
+#endif
+    int flags;                                /* private */
+    char* eytzinger;                          /* private: keys or key pointers */
+    size_t* eytzinger_ranks;                  /* private */
+    size_t key_size;                          /* private */
+    int64_t* keys;                            /* private: B-tree blocks */
+    size_t* ranks;                            /* private: of each key */
+    size_t blocks;                            /* private */
+    uint64_t bias;                            /* private: maps keys to int64_t */
+} *rbtree_frozen;
+
+/* return 0, or -1 if out of memory, which leaves t untouched */
+int rbtree_freeze(rbtree_frozen f, rbtree t, size_t key_size);
+int rbtree_freeze_u64(rbtree_frozen f, rbtree t);
+int rbtree_freeze_s64(rbtree_frozen f, rbtree t);
+/* move the nodes back into t, which need not be initialized, and free f */
+void rbtree_thaw(rbtree_frozen f, rbtree t);
+/* free f, passing each node to free_fn, if not NULL, in key order */
+void rbtree_frozen_destroy(rbtree_frozen f, rbtree_free_func free_fn, void* context);
+
+rbtree_node rbtree_frozen_lookup(rbtree_frozen f, const void* key);
+/* first node with key >= key, or NULL */
+rbtree_node rbtree_frozen_lower_bound(rbtree_frozen f, const void* key);
+/* first node with key > key, or NULL */
+rbtree_node rbtree_frozen_upper_bound(rbtree_frozen f, const void* key);
+/* as rbtree_walk and rbtree_walk_range */
+int rbtree_frozen_walk(rbtree_frozen f, rbtree_visitor_func fn, void* context);
+int rbtree_frozen_walk_range(rbtree_frozen f, const void* lo, const void* hi, int flags,
+                             rbtree_visitor_func fn, void* context);
+
+/* integer indexes only */
+rbtree_u64_node rbtree_frozen_u64_lookup(rbtree_frozen f, uint64_t key);
+rbtree_u64_node rbtree_frozen_u64_lower_bound(rbtree_frozen f, uint64_t key);
+rbtree_s64_node rbtree_frozen_s64_lookup(rbtree_frozen f, int64_t key);
+rbtree_s64_node rbtree_frozen_s64_lower_bound(rbtree_frozen f, int64_t key);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+/* vim: set ts=8 sw=4 sts=4 et: */
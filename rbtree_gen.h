@@ -0,0 +1,172 @@
+/* Type-specialized red-black trees
+ * Copyright (c) 2008 Derrick Coetzee
+ * Douglas Clowes, February 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT
+ * OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _RBTREE_GEN_H_
+#define _RBTREE_GEN_H_
+
+#include "rbtree.h"
+#include <stddef.h>
+
+/*
+ * RBTREE_GENERATE(name, type, field, cmp) emits static inline functions
+ * for a tree of "type", which embeds a struct rbtree_node_t as "field".
+ * cmp(const type* a, const type* b) returns <0, 0 or >0 and may be a
+ * macro or an inline function, so the compiler can specialize every
+ * comparison.  Only the descent is generated: linking, rebalancing and
+ * deletion are the ones in rbtree.c.
+ *
+ *   void  name_init(rbtree t)
+ *   type* name_lookup(rbtree t, const type* key)
+ *   type* name_lower_bound(rbtree t, const type* key)
+ *   type* name_upper_bound(rbtree t, const type* key)
+ *   type* name_insert(rbtree t, type* elm)      returns the replaced elm
+ *   type* name_delete(rbtree t, const type* key)
+ *   type* name_remove(rbtree t, type* elm)
+ *   type* name_first(rbtree t), name_last(rbtree t)
+ *   type* name_next(rbtree t, type* elm), name_prev(rbtree t, type* elm)
+ *
+ * Keys are elements: fill in the key fields of a type on the stack to
+ * search.  Each inserted node's key points at its own element, and
+ * name_init installs a matching compare function, so the generic
+ * rbtree_* functions work on these trees as well.
+ */
+
+#define RBTREE_CONTAINER(ptr, type, field) \
+    ((type*) ((char*) (ptr) - offsetof(type, field)))
+
+#define RBTREE_GENERATE(name, type, field, cmp)                              \
+                                                                             \
+static inline type* name##_entry(rbtree_node n)                              \
+{                                                                            \
+    return n == NULL ? NULL : RBTREE_CONTAINER(n, type, field);              \
+}                                                                            \
+                                                                             \
+static inline int name##_compare(const void* left_key, const void* right_key) \
+{                                                                            \
+    return cmp((const type*) left_key, (const type*) right_key);             \
+}                                                                            \
+                                                                             \
+static inline void name##_init(rbtree t)                                     \
+{                                                                            \
+    rbtree_init(t, name##_compare);                                          \
+}                                                                            \
+                                                                             \
+static inline type* name##_lookup(rbtree t, const type* key)                 \
+{                                                                            \
+    rbtree_node n = t->root;                                                 \
+    while (n != NULL) {                                                      \
+        int comp_result = cmp(key, RBTREE_CONTAINER(n, type, field));        \
+        if (comp_result == 0)                                                \
+            return RBTREE_CONTAINER(n, type, field);                         \
+        n = comp_result < 0 ? n->left : n->right;                            \
+    }                                                                        \
+    return NULL;                                                             \
+}                                                                            \
+                                                                             \
+static inline type* name##_lower_bound(rbtree t, const type* key)            \
+{                                                                            \
+    rbtree_node n = t->root;                                                 \
+    rbtree_node best = NULL;                                                 \
+    while (n != NULL) {                                                      \
+        int comp_result = cmp(key, RBTREE_CONTAINER(n, type, field));        \
+        if (comp_result == 0)                                                \
+            return RBTREE_CONTAINER(n, type, field);                         \
+        if (comp_result < 0) {                                               \
+            best = n;                                                        \
+            n = n->left;                                                     \
+        } else {                                                             \
+            n = n->right;                                                    \
+        }                                                                    \
+    }                                                                        \
+    return name##_entry(best);                                               \
+}                                                                            \
+                                                                             \
+static inline type* name##_upper_bound(rbtree t, const type* key)            \
+{                                                                            \
+    rbtree_node n = t->root;                                                 \
+    rbtree_node best = NULL;                                                 \
+    while (n != NULL) {                                                      \
+        if (cmp(key, RBTREE_CONTAINER(n, type, field)) < 0) {                \
+            best = n;                                                        \
+            n = n->left;                                                     \
+        } else {                                                             \
+            n = n->right;                                                    \
+        }                                                                    \
+    }                                                                        \
+    return name##_entry(best);                                               \
+}                                                                            \
+                                                                             \
+static inline type* name##_insert(rbtree t, type* elm)                       \
+{                                                                            \
+    rbtree_node n = t->root;                                                 \
+    rbtree_node* link = &t->root;                                            \
+    elm->field.key = elm;                                                    \
+    while (n != NULL) {                                                      \
+        int comp_result = cmp(elm, RBTREE_CONTAINER(n, type, field));        \
+        if (comp_result == 0) {                                              \
+            rbtree_node_replace(t, n, &elm->field);                          \
+            return RBTREE_CONTAINER(n, type, field);                         \
+        }                                                                    \
+        link = comp_result < 0 ? &n->left : &n->right;                       \
+        if (*link == NULL)                                                   \
+            break;                                                           \
+        n = *link;                                                           \
+    }                                                                        \
+    rbtree_node_link(t, &elm->field, n, link);                               \
+    return NULL;                                                             \
+}                                                                            \
+                                                                             \
+static inline type* name##_remove(rbtree t, type* elm)                       \
+{                                                                            \
+    return name##_entry(rbtree_node_delete(t, elm ? &elm->field : NULL));    \
+}                                                                            \
+                                                                             \
+static inline type* name##_delete(rbtree t, const type* key)                 \
+{                                                                            \
+    type* elm = name##_lookup(t, key);                                       \
+    return elm == NULL ? NULL : name##_remove(t, elm);                       \
+}                                                                            \
+                                                                             \
+static inline type* name##_first(rbtree t)                                   \
+{                                                                            \
+    return name##_entry(rbtree_node_first(t));                               \
+}                                                                            \
+                                                                             \
+static inline type* name##_last(rbtree t)                                    \
+{                                                                            \
+    return name##_entry(rbtree_node_last(t));                                \
+}                                                                            \
+                                                                             \
+static inline type* name##_next(rbtree t, type* elm)                         \
+{                                                                            \
+    return name##_entry(rbtree_node_next(t, elm ? &elm->field : NULL));      \
+}                                                                            \
+                                                                             \
+static inline type* name##_prev(rbtree t, type* elm)                         \
+{                                                                            \
+    return name##_entry(rbtree_node_prev(t, elm ? &elm->field : NULL));      \
+}
+
+#endif
+/* vim: set ts=8 sw=4 sts=4 et: */
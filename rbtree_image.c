@@ -0,0 +1,422 @@
+/* Memory-mapped images of red-black trees
+ * Copyright (c) 2008 Derrick Coetzee
+ * Douglas Clowes, February 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT
+ * OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rbtree_image.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef rbtree_node node;
+
+/*
+ * The image is this header, padded to HEADER_SIZE, then the nodes,
+ * each padded to 8 bytes.  Offset 0 is the header, so no node is
+ * there and it stands for NULL.
+ */
+#define IMAGE_MAGIC "rbtree\0i"
+#define IMAGE_VERSION 1
+#define BYTE_ORDER_MARK 0x01020304u
+#define HEADER_SIZE 64
+
+struct image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t word_size;
+    uint32_t flags;       /* the tree's RBTREE_MULTI */
+    uint64_t node_count;
+    uint64_t root;
+    uint64_t size;
+};
+
+/*
+ * No consistent red-black tree is deeper than this, so a search of a
+ * corrupt image that gets this far gives up rather than loop.
+ */
+#define MAX_DEPTH (2 * 64)
+
+#define WRITE_BUFFER 65536
+
+static size_t pad8(size_t size) {
+    return (size + 7) & ~(size_t) 7;
+}
+
+struct writer {
+    int fd;
+    int error;
+    off_t offset;  /* where buf goes in the file */
+    size_t used;
+    char buf[WRITE_BUFFER];
+};
+
+static void flush(struct writer* w) {
+    size_t done = 0;
+    while (!w->error && done < w->used) {
+        ssize_t n = pwrite(w->fd, w->buf + done, w->used - done, w->offset);
+        if (n < 0) {
+            if (errno != EINTR)
+                w->error = errno;
+        } else {
+            done += n;
+            w->offset += n;
+        }
+    }
+    w->used = 0;
+}
+
+static void put(struct writer* w, const void* data, size_t size) {
+    while (size > 0) {
+        size_t n = WRITE_BUFFER - w->used;
+        if (n > size)
+            n = size;
+        memcpy(w->buf + w->used, data, n);
+        w->used += n;
+        data = (const char*) data + n;
+        size -= n;
+        if (w->used == WRITE_BUFFER)
+            flush(w);
+    }
+}
+
+static size_t codec_size(const struct rbtree_codec* codec, const void* data) {
+    if (codec == NULL)
+        return 0;
+    return codec->size ? codec->size(data, codec->context) : codec->fixed_size;
+}
+
+/* encode into *scratch, grown as needed, padded with zeros to 8 bytes */
+static int put_encoded(struct writer* w, const struct rbtree_codec* codec, const void* data,
+                       size_t size, char** scratch, size_t* scratch_size) {
+    size_t padded = pad8(size);
+    if (padded == 0)
+        return 0;
+    if (padded > *scratch_size) {
+        char* grown = realloc(*scratch, padded);
+        if (grown == NULL)
+            return -1;
+        *scratch = grown;
+        *scratch_size = padded;
+    }
+    if (codec->encode)
+        codec->encode(data, *scratch, codec->context);
+    else
+        memcpy(*scratch, data, size);
+    memset(*scratch + size, 0, padded - size);
+    put(w, *scratch, padded);
+    return 0;
+}
+
+/* the nodes in breadth-first order, with where each goes in the image */
+struct save_entry {
+    node n;
+    size_t parent;  /* index of the parent entry */
+    uint64_t offset;
+    uint32_t key_size;
+    uint32_t value_size;
+};
+
+int rbtree_save(rbtree t, int fd, const struct rbtree_codec* key_codec,
+                const struct rbtree_codec* value_codec)
+{
+    size_t count = t->node_count;
+    struct save_entry* q;
+    struct writer* w;
+    struct image_header header;
+    char* scratch = NULL;
+    size_t scratch_size = 0;
+    size_t i, tail, child;
+    uint64_t offset = HEADER_SIZE;
+    int error = 0;
+
+    q = malloc((count ? count : 1) * sizeof(*q));
+    w = malloc(sizeof(*w));
+    if (q == NULL || w == NULL) {
+        free(q);
+        free(w);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* lay the nodes out level by level */
+    tail = 0;
+    if (t->root != NULL) {
+        q[tail].n = t->root;
+        q[tail++].parent = 0;
+    }
+    for (i = 0; i < tail; ++i) {
+        size_t key_size = codec_size(key_codec, q[i].n->key);
+        size_t value_size = codec_size(value_codec, q[i].n->value);
+        if (key_size > UINT32_MAX || value_size > UINT32_MAX) {
+            error = EOVERFLOW;
+            break;
+        }
+        q[i].key_size = key_size;
+        q[i].value_size = value_size;
+        q[i].offset = offset;
+        offset += sizeof(struct rbtree_image_node_t) + pad8(key_size) + pad8(value_size);
+        if (q[i].n->left != NULL) {
+            q[tail].n = q[i].n->left;
+            q[tail++].parent = i;
+        }
+        if (q[i].n->right != NULL) {
+            q[tail].n = q[i].n->right;
+            q[tail++].parent = i;
+        }
+    }
+
+    w->fd = fd;
+    w->error = error;
+    w->offset = 0;
+    w->used = 0;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.word_size = sizeof(void*);
+    header.flags = t->flags & RBTREE_MULTI;
+    header.node_count = count;
+    header.root = count ? HEADER_SIZE : 0;
+    header.size = offset;
+    put(w, &header, sizeof(header));
+    put(w, (const char[HEADER_SIZE]) { 0 }, HEADER_SIZE - sizeof(header));
+
+    /* children were queued in order, so they come up in order here */
+    child = 1;
+    for (i = 0; i < count && !w->error; ++i) {
+        struct rbtree_image_node_t out;
+        out.left = q[i].n->left ? q[child++].offset : 0;
+        out.right = q[i].n->right ? q[child++].offset : 0;
+        out.parent = i ? q[q[i].parent].offset : 0;
+        out.key_size = q[i].key_size;
+        out.value_size = q[i].value_size;
+        put(w, &out, sizeof(out));
+        if (put_encoded(w, key_codec, q[i].n->key, q[i].key_size,
+                        &scratch, &scratch_size) != 0 ||
+            (value_codec != NULL &&
+             put_encoded(w, value_codec, q[i].n->value, q[i].value_size,
+                         &scratch, &scratch_size) != 0))
+            w->error = ENOMEM;
+    }
+    flush(w);
+    /* rbtree_map wants the file to be the image, so drop any old tail */
+    if (!w->error && ftruncate(fd, w->offset) != 0)
+        w->error = errno;
+
+    error = w->error;
+    free(scratch);
+    free(w);
+    free(q);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int rbtree_map(rbtree_image img, const char* path, rbtree_compare_func compare)
+{
+    const struct image_header* header;
+    struct stat st;
+    void* base;
+    int fd, error;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0) {
+        error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    if (st.st_size < HEADER_SIZE || (uint64_t) st.st_size > SIZE_MAX) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    error = errno;
+    close(fd);
+    if (base == MAP_FAILED) {
+        errno = error;
+        return -1;
+    }
+
+    header = base;
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != IMAGE_VERSION || header->byte_order != BYTE_ORDER_MARK ||
+        header->word_size != sizeof(void*) || header->size != (uint64_t) st.st_size ||
+        (header->root == 0) != (header->node_count == 0)) {
+        munmap(base, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    img->base = base;
+    img->size = st.st_size;
+    img->compare = compare;
+    img->node_count = header->node_count;
+    return 0;
+}
+
+void rbtree_unmap(rbtree_image img)
+{
+    if (img->base != NULL)
+        munmap((void*) img->base, img->size);
+    img->base = NULL;
+    img->size = 0;
+    img->node_count = 0;
+}
+
+/* NULL for offset 0, and for any node that would not fit in the image */
+static rbtree_inode node_at(rbtree_image img, uint64_t offset) {
+    rbtree_inode n;
+    if (offset < HEADER_SIZE || offset % 8 != 0 ||
+        offset > img->size - sizeof(struct rbtree_image_node_t))
+        return NULL;
+    n = (rbtree_inode) (img->base + offset);
+    if (pad8(n->key_size) + pad8(n->value_size) >
+        img->size - offset - sizeof(struct rbtree_image_node_t))
+        return NULL;
+    return n;
+}
+
+static const struct image_header* header(rbtree_image img) {
+    return (const struct image_header*) img->base;
+}
+
+static rbtree_inode root(rbtree_image img) {
+    return node_at(img, header(img)->root);
+}
+
+/* in a multimap, the first node with the key */
+static rbtree_inode bound(rbtree_image img, const void* key, int exact) {
+    rbtree_inode n = root(img);
+    rbtree_inode best = NULL;
+    rbtree_inode found = NULL;
+    int multi = header(img)->flags & RBTREE_MULTI;
+    int depth;
+
+    for (depth = 0; n != NULL && depth < MAX_DEPTH; ++depth) {
+        int comp_result = img->compare(key, rbtree_image_key(n));
+        if (comp_result == 0) {
+            found = n;
+            if (!multi)
+                break;
+            n = node_at(img, n->left);
+        } else if (comp_result < 0) {
+            best = n;
+            n = node_at(img, n->left);
+        } else {
+            n = node_at(img, n->right);
+        }
+    }
+    return found != NULL || exact ? found : best;
+}
+
+rbtree_inode rbtree_image_lookup(rbtree_image img, const void* key)
+{
+    return bound(img, key, 1);
+}
+
+rbtree_inode rbtree_image_lower_bound(rbtree_image img, const void* key)
+{
+    return bound(img, key, 0);
+}
+
+/* the extreme node under n on one side */
+static rbtree_inode extreme(rbtree_image img, rbtree_inode n, int right) {
+    int depth;
+    for (depth = 0; n != NULL && depth < MAX_DEPTH; ++depth) {
+        rbtree_inode child = node_at(img, right ? n->right : n->left);
+        if (child == NULL)
+            break;
+        n = child;
+    }
+    return n;
+}
+
+/* as rbtree_node_next, or rbtree_node_prev if right is 0 */
+static rbtree_inode step(rbtree_image img, rbtree_inode n, int right) {
+    rbtree_inode parent;
+    int depth;
+
+    if (n == NULL)
+        return NULL;
+    if ((right ? n->right : n->left) != 0)
+        return extreme(img, node_at(img, right ? n->right : n->left), !right);
+    for (depth = 0; depth < MAX_DEPTH; ++depth) {
+        uint64_t from = (const char*) n - img->base;
+        parent = node_at(img, n->parent);
+        if (parent == NULL || (right ? parent->right : parent->left) != from)
+            return parent;
+        n = parent;
+    }
+    return NULL;
+}
+
+rbtree_inode rbtree_image_first(rbtree_image img)
+{
+    return extreme(img, root(img), 0);
+}
+
+rbtree_inode rbtree_image_last(rbtree_image img)
+{
+    return extreme(img, root(img), 1);
+}
+
+rbtree_inode rbtree_image_next(rbtree_image img, rbtree_inode node)
+{
+    return step(img, node, 1);
+}
+
+rbtree_inode rbtree_image_prev(rbtree_image img, rbtree_inode node)
+{
+    return step(img, node, 0);
+}
+
+int rbtree_image_walk(rbtree_image img, rbtree_image_visitor_func f, void* context)
+{
+    rbtree_inode n;
+    int count = 0;
+
+    for (n = rbtree_image_first(img); n != NULL; n = rbtree_image_next(img, n)) {
+        /* a corrupt image can link the nodes in a cycle */
+        if ((size_t) count == img->node_count) {
+            errno = EINVAL;
+            return -1;
+        }
+        count++;
+        if (f) {
+            int result = f(n, context);
+            if (result != 0)
+                return result;
+        }
+    }
+    return count;
+}
+/* vim: set ts=8 sw=4 sts=4 et: */
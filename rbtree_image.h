@@ -0,0 +1,124 @@
+/* Memory-mapped images of red-black trees
+ * Copyright (c) 2008 Derrick Coetzee
+ * Douglas Clowes, February 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT
+ * OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _RBTREE_IMAGE_H_
+#define _RBTREE_IMAGE_H_
+
+#include "rbtree.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Tree images.  rbtree_save writes a tree to a file as an image whose
+ * nodes link to each other by offset from the start of the file, and
+ * rbtree_map maps such a file read-only and searches it in place:
+ * there is nothing to parse or allocate, so opening one is O(1) and
+ * pages are read only as searches touch them.  Processes mapping the
+ * same file share its pages through the page cache.
+ *
+ * Nodes are written in breadth-first order, so the top levels that
+ * every search passes through share the first few pages.  Keys and
+ * values are copied into the image by codecs; the compare function
+ * given to rbtree_map is called with the search key and a pointer to
+ * an encoded key in the image, 8-byte aligned.  Images hold native
+ * integers and are only read on machines of the same byte order and
+ * word size, which rbtree_map checks.
+ */
+
+/*
+ * A codec copies a key or value into the image.  size returns how
+ * many bytes data needs, or is NULL for fixed_size bytes each; encode
+ * writes them, or is NULL to copy them from data.
+ */
+struct rbtree_codec {
+    size_t fixed_size;
+    size_t (*size)(const void* data, void* context);
+    void (*encode)(const void* data, void* buf, void* context);
+    void* context;
+};
+
+/* a node in a mapped image: offsets are from the start of the image */
+typedef const struct rbtree_image_node_t {
+    uint64_t left;        /* private */
+    uint64_t right;       /* private */
+    uint64_t parent;      /* private */
+    uint32_t key_size;
+    uint32_t value_size;
+    /* the key, padded to 8 bytes, then the value */
+} *rbtree_inode;
+
+typedef struct rbtree_image_t {
+    const char* base;             /* private */
+    size_t size;                  /* private */
+    rbtree_compare_func compare;  /* private */
+    size_t node_count;
+} *rbtree_image;
+
+typedef int (*rbtree_image_visitor_func)(rbtree_inode node, void* context);
+
+/*
+ * Write t to fd as the whole file, from offset 0 and truncated after
+ * the image, with value_codec NULL to leave the values out.  fd must be
+ * a regular file open for writing; its position is not used or moved.
+ * Returns 0, or -1 with errno set.
+ */
+int rbtree_save(rbtree t, int fd, const struct rbtree_codec* key_codec,
+                const struct rbtree_codec* value_codec);
+/* returns 0, or -1 with errno set: EINVAL if path is not a usable image */
+int rbtree_map(rbtree_image img, const char* path, rbtree_compare_func compare);
+void rbtree_unmap(rbtree_image img);
+
+/* in a multimap image, the first node with the key */
+rbtree_inode rbtree_image_lookup(rbtree_image img, const void* key);
+/* first node with key >= key, or NULL */
+rbtree_inode rbtree_image_lower_bound(rbtree_image img, const void* key);
+rbtree_inode rbtree_image_first(rbtree_image img);
+rbtree_inode rbtree_image_last(rbtree_image img);
+rbtree_inode rbtree_image_next(rbtree_image img, rbtree_inode node);
+rbtree_inode rbtree_image_prev(rbtree_image img, rbtree_inode node);
+/*
+ * as rbtree_walk, but -1 with errno EINVAL if there are more nodes
+ * than the image holds, as there are if its links make a cycle
+ */
+int rbtree_image_walk(rbtree_image img, rbtree_image_visitor_func f, void* context);
+
+static inline const void* rbtree_image_key(rbtree_inode node)
+{
+    return node + 1;
+}
+
+static inline const void* rbtree_image_value(rbtree_inode node)
+{
+    return (const char*) (node + 1) + ((node->key_size + 7) & ~7u);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+/* vim: set ts=8 sw=4 sts=4 et: */
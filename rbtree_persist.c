@@ -0,0 +1,478 @@
+/* Persistent red-black trees with O(1) snapshots
+ * Copyright (c) 2008 Derrick Coetzee
+ * Douglas Clowes, February 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT
+ * OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rbtree_persist.h"
+#include <assert.h>
+#include <stdlib.h>
+
+typedef rbtree_pnode pnode;
+typedef enum rbtree_node_color color;
+
+#ifdef VERIFY_RBTREE
+static void verify_properties(rbtree_persist t);
+#else
+/* Make it go away */
+#define verify_properties(t)
+#endif
+
+static color node_color(pnode n) {
+    return n == NULL ? BLACK : n->color;
+}
+
+static void incref(pnode n) {
+    if (n != NULL)
+        __atomic_add_fetch(&n->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void decref(pnode n) {
+    /* recurse to the left, loop to the right */
+    while (n != NULL && __atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pnode right = n->right;
+        decref(n->left);
+        free(n);
+        n = right;
+    }
+}
+
+/*
+ * Every node an operation may create comes from a reserve filled
+ * before the tree is touched, so running out of memory can only
+ * happen up front and never leaves a half-balanced tree.  An
+ * operation copies at most the path, a sibling per level and two
+ * nephews, which is bounded by four times log2 of the size.
+ */
+static int reserve(rbtree_persist t) {
+    int need = 4;
+    int n;
+
+    for (n = t->node_count + 1; n > 0; n >>= 1)
+        need += 4;
+    while (t->num_spares < need) {
+        pnode spare = malloc(sizeof(*spare));
+        if (spare == NULL)
+            return -1;
+        spare->left = t->spares;
+        t->spares = spare;
+        t->num_spares++;
+    }
+    return 0;
+}
+
+static pnode new_node(rbtree_persist t) {
+    pnode n = t->spares;
+    assert (n != NULL);
+    t->spares = n->left;
+    t->num_spares--;
+    n->refs = 1;
+    return n;
+}
+
+/*
+ * Make the node at *link safe to change.  The node holding link is
+ * already private to this version, so if n is referenced once it is
+ * ours; otherwise another version shares it, and this version gets
+ * its own copy.
+ */
+static pnode writable(rbtree_persist t, pnode* link) {
+    pnode n = *link;
+    pnode copy;
+
+    if (n == NULL || __atomic_load_n(&n->refs, __ATOMIC_ACQUIRE) == 1)
+        return n;
+    copy = new_node(t);
+    copy->key = n->key;
+    copy->value = n->value;
+    copy->left = n->left;
+    copy->right = n->right;
+    copy->color = n->color;
+    incref(copy->left);
+    incref(copy->right);
+    *link = copy;
+    decref(n);
+    return copy;
+}
+
+/* the link that points at path[i] */
+static pnode* link_to(rbtree_persist t, pnode* path, int i) {
+    if (i == 0)
+        return &t->root;
+    return path[i - 1]->left == path[i] ? &path[i - 1]->left : &path[i - 1]->right;
+}
+
+void rbtree_persist_init(rbtree_persist t, rbtree_compare_func compare) {
+    t->root = NULL;
+    t->compare = compare;
+    t->node_count = 0;
+    t->spares = NULL;
+    t->num_spares = 0;
+}
+
+void rbtree_persist_destroy(rbtree_persist t) {
+    decref(t->root);
+    t->root = NULL;
+    t->node_count = 0;
+    while (t->spares != NULL) {
+        pnode next = t->spares->left;
+        free(t->spares);
+        t->spares = next;
+    }
+    t->num_spares = 0;
+}
+
+void rbtree_snapshot(rbtree_persist t, rbtree_persist snap) {
+    rbtree_persist_init(snap, t->compare);
+    incref(t->root);
+    snap->root = t->root;
+    snap->node_count = t->node_count;
+}
+
+rbtree_pnode rbtree_persist_node_lookup(rbtree_persist t, const void* key) {
+    pnode n = t->root;
+    while (n != NULL) {
+        int comp_result = t->compare(key, n->key);
+        if (comp_result == 0)
+            return n;
+        n = comp_result < 0 ? n->left : n->right;
+    }
+    return NULL;
+}
+
+void* rbtree_persist_lookup(rbtree_persist t, const void* key) {
+    pnode n = rbtree_persist_node_lookup(t, key);
+    return n == NULL ? NULL : n->value;
+}
+
+/*
+ * Insertion and deletion are the same cases as in rbtree.c, but they
+ * keep the path from the root in an array in place of parent pointers
+ * and make each node writable before changing it.
+ */
+int rbtree_persist_insert(rbtree_persist t, void* key, void* value) {
+    pnode path[RBTREE_MAX_HEIGHT + 1];
+    pnode* link = &t->root;
+    pnode n, p, g, u;
+    int depth = 0;
+
+    if (reserve(t) < 0)
+        return -1;
+    while (*link != NULL) {
+        int comp_result;
+        n = writable(t, link);
+        path[depth++] = n;
+        comp_result = t->compare(key, n->key);
+        if (comp_result == 0) {
+            n->key = key;
+            n->value = value;
+            return 0;
+        }
+        link = comp_result < 0 ? &n->left : &n->right;
+    }
+    n = new_node(t);
+    n->key = key;
+    n->value = value;
+    n->left = NULL;
+    n->right = NULL;
+    n->color = RED;
+    *link = n;
+    path[depth] = n;
+    t->node_count += 1;
+
+    while (depth > 0 && path[depth - 1]->color == RED) {
+        p = path[depth - 1];
+        g = path[depth - 2]; /* a red node is never the root */
+        n = path[depth];
+        if (p == g->left) {
+            if (node_color(g->right) == RED) {
+                u = writable(t, &g->right);
+                p->color = BLACK;
+                u->color = BLACK;
+                g->color = RED;
+                depth -= 2;
+                continue;
+            }
+            if (n == p->right) {
+                p->right = n->left;
+                n->left = p;
+                g->left = n;
+                p = n;
+            }
+            link = link_to(t, path, depth - 2);
+            g->left = p->right;
+            p->right = g;
+            *link = p;
+        } else {
+            if (node_color(g->left) == RED) {
+                u = writable(t, &g->left);
+                p->color = BLACK;
+                u->color = BLACK;
+                g->color = RED;
+                depth -= 2;
+                continue;
+            }
+            if (n == p->left) {
+                p->left = n->right;
+                n->right = p;
+                g->right = n;
+                p = n;
+            }
+            link = link_to(t, path, depth - 2);
+            g->right = p->left;
+            p->left = g;
+            *link = p;
+        }
+        p->color = BLACK;
+        g->color = RED;
+        break;
+    }
+    /* the root is on the path, so it is already writable */
+    t->root->color = BLACK;
+
+    verify_properties(t);
+    return 1;
+}
+
+int rbtree_persist_delete(rbtree_persist t, const void* key) {
+    pnode path[RBTREE_MAX_HEIGHT + 2];
+    pnode* link = &t->root;
+    pnode n, x, p, s;
+    int depth = 0;
+    int left = 0;
+    color removed;
+
+    /* look before copying anything */
+    if (rbtree_persist_node_lookup(t, key) == NULL)
+        return 0;
+    if (reserve(t) < 0)
+        return -1;
+    while (1) {
+        int comp_result;
+        n = writable(t, link);
+        path[depth++] = n;
+        comp_result = t->compare(key, n->key);
+        if (comp_result == 0)
+            break;
+        link = comp_result < 0 ? &n->left : &n->right;
+    }
+    if (n->left != NULL && n->right != NULL) {
+        /* two children: take the predecessor's place and delete it */
+        pnode found = n;
+        link = &n->left;
+        while (1) {
+            n = writable(t, link);
+            path[depth++] = n;
+            if (n->right == NULL)
+                break;
+            link = &n->right;
+        }
+        found->key = n->key;
+        found->value = n->value;
+    }
+
+    /* n has at most one child, which takes its place */
+    x = n->left != NULL ? n->left : n->right;
+    depth--;
+    if (depth > 0)
+        left = path[depth - 1]->left == n;
+    *link_to(t, path, depth) = x;
+    removed = n->color;
+    free(n);
+    t->node_count -= 1;
+
+    /* x is a child of path[depth - 1], on the left if left */
+    while (removed == BLACK && depth > 0 && node_color(x) == BLACK) {
+        p = path[depth - 1];
+        if (left) {
+            s = writable(t, &p->right);
+            if (s->color == RED) {
+                s->color = BLACK;
+                p->color = RED;
+                *link_to(t, path, depth - 1) = s;
+                p->right = s->left;
+                s->left = p;
+                path[depth - 1] = s;
+                path[depth++] = p;
+                s = writable(t, &p->right);
+            }
+            if (node_color(s->left) == BLACK && node_color(s->right) == BLACK) {
+                s->color = RED;
+                x = p;
+                depth--;
+                left = depth > 0 && path[depth - 1]->left == x;
+                continue;
+            }
+            if (node_color(s->right) == BLACK) {
+                pnode sl = writable(t, &s->left);
+                sl->color = BLACK;
+                s->color = RED;
+                s->left = sl->right;
+                sl->right = s;
+                p->right = sl;
+                s = sl;
+            }
+            writable(t, &s->right)->color = BLACK;
+            s->color = p->color;
+            p->color = BLACK;
+            *link_to(t, path, depth - 1) = s;
+            p->right = s->left;
+            s->left = p;
+        } else {
+            s = writable(t, &p->left);
+            if (s->color == RED) {
+                s->color = BLACK;
+                p->color = RED;
+                *link_to(t, path, depth - 1) = s;
+                p->left = s->right;
+                s->right = p;
+                path[depth - 1] = s;
+                path[depth++] = p;
+                s = writable(t, &p->left);
+            }
+            if (node_color(s->left) == BLACK && node_color(s->right) == BLACK) {
+                s->color = RED;
+                x = p;
+                depth--;
+                left = depth > 0 && path[depth - 1]->left == x;
+                continue;
+            }
+            if (node_color(s->left) == BLACK) {
+                pnode sr = writable(t, &s->right);
+                sr->color = BLACK;
+                s->color = RED;
+                s->right = sr->left;
+                sr->left = s;
+                p->left = sr;
+                s = sr;
+            }
+            writable(t, &s->left)->color = BLACK;
+            s->color = p->color;
+            p->color = BLACK;
+            *link_to(t, path, depth - 1) = s;
+            p->left = s->right;
+            s->right = p;
+        }
+        removed = RED; /* done */
+    }
+    if (removed == BLACK && node_color(x) == RED) {
+        /* a red child absorbs the missing black */
+        link = depth == 0 ? &t->root : left ? &path[depth - 1]->left : &path[depth - 1]->right;
+        writable(t, link)->color = BLACK;
+    }
+    if (t->root != NULL && t->root->color == RED)
+        t->root->color = BLACK;
+
+    verify_properties(t);
+    return 1;
+}
+
+rbtree_pnode rbtree_cursor_first(rbtree_cursor c, rbtree_persist t) {
+    pnode n = t->root;
+    c->depth = 0;
+    while (n != NULL) {
+        c->stack[c->depth++] = n;
+        n = n->left;
+    }
+    return c->depth == 0 ? NULL : c->stack[c->depth - 1];
+}
+
+rbtree_pnode rbtree_cursor_last(rbtree_cursor c, rbtree_persist t) {
+    pnode n = t->root;
+    c->depth = 0;
+    while (n != NULL) {
+        c->stack[c->depth++] = n;
+        n = n->right;
+    }
+    return c->depth == 0 ? NULL : c->stack[c->depth - 1];
+}
+
+/*
+ * The cursor holds the path from the root to the current node,
+ * which is all a parent pointer would have given us.
+ */
+rbtree_pnode rbtree_cursor_next(rbtree_cursor c) {
+    pnode n;
+
+    if (c->depth == 0)
+        return NULL;
+    n = c->stack[c->depth - 1];
+    if (n->right != NULL) {
+        for (n = n->right; n != NULL; n = n->left)
+            c->stack[c->depth++] = n;
+    } else {
+        /* go up until we come from a left-hand child */
+        do {
+            n = c->stack[--c->depth];
+        } while (c->depth > 0 && c->stack[c->depth - 1]->right == n);
+        if (c->depth == 0)
+            return NULL;
+    }
+    return c->stack[c->depth - 1];
+}
+
+rbtree_pnode rbtree_cursor_prev(rbtree_cursor c) {
+    pnode n;
+
+    if (c->depth == 0)
+        return NULL;
+    n = c->stack[c->depth - 1];
+    if (n->left != NULL) {
+        for (n = n->left; n != NULL; n = n->right)
+            c->stack[c->depth++] = n;
+    } else {
+        /* go up until we come from a right-hand child */
+        do {
+            n = c->stack[--c->depth];
+        } while (c->depth > 0 && c->stack[c->depth - 1]->left == n);
+        if (c->depth == 0)
+            return NULL;
+    }
+    return c->stack[c->depth - 1];
+}
+
+#ifdef VERIFY_RBTREE
+/* returns the black height of n, checking colors, order and counts */
+static int verify_node(rbtree_persist t, pnode n, int* count) {
+    int left, right;
+
+    if (n == NULL)
+        return 1;
+    assert (n->refs >= 1);
+    assert (n->color == BLACK || (node_color(n->left) == BLACK && node_color(n->right) == BLACK));
+    assert (n->left == NULL || t->compare(n->left->key, n->key) < 0);
+    assert (n->right == NULL || t->compare(n->right->key, n->key) > 0);
+    ++*count;
+    left = verify_node(t, n->left, count);
+    right = verify_node(t, n->right, count);
+    assert (left == right);
+    return left + (n->color == BLACK);
+}
+
+static void verify_properties(rbtree_persist t) {
+    int count = 0;
+    assert (node_color(t->root) == BLACK);
+    verify_node(t, t->root, &count);
+    assert (count == t->node_count);
+}
+#endif
+
+/* vim: set ts=8 sw=4 sts=4 et: */
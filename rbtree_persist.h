@@ -0,0 +1,96 @@
+/* Persistent red-black trees with O(1) snapshots
+ * Copyright (c) 2008 Derrick Coetzee
+ * Douglas Clowes, February 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT
+ * OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _RBTREE_PERSIST_H_
+#define _RBTREE_PERSIST_H_
+
+#include "rbtree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Persistent trees.  Insert and delete copy only the nodes on the path
+ * they change (O(log n)) and leave every older version intact, so
+ * taking a snapshot is O(1) and a snapshot never sees later writes.
+ * Nodes are reference counted and owned by the library; a node shared
+ * with no other version is updated in place rather than copied.  The
+ * counts are atomic, so snapshots may be read and released on other
+ * threads while one thread writes.
+ *
+ * Nodes have no parent pointers, since one node may sit in many
+ * versions; iterate with a cursor instead.  Keys and values belong to
+ * the caller and must outlive every version that holds them.
+ */
+#define RBTREE_MAX_HEIGHT (2 * 8 * (int) sizeof(void*))
+
+typedef struct rbtree_pnode_t {
+    void* key;
+    void* value;
+    struct rbtree_pnode_t* left;   /* private */
+    struct rbtree_pnode_t* right;  /* private */
+    unsigned int refs;             /* private */
+    enum rbtree_node_color color;  /* private */
+} *rbtree_pnode;
+
+/* a version of a tree: the working tree or a snapshot of it */
+typedef struct rbtree_persist_t {
+    rbtree_pnode root;
+    rbtree_compare_func compare;  /* private */
+    int node_count;
+    rbtree_pnode spares;          /* private */
+    int num_spares;               /* private */
+} *rbtree_persist;
+
+typedef struct rbtree_cursor_t {
+    rbtree_pnode stack[RBTREE_MAX_HEIGHT];  /* private */
+    int depth;                              /* private */
+} *rbtree_cursor;
+
+void rbtree_persist_init(rbtree_persist t, rbtree_compare_func compare);
+/* drop this version; nodes no other version holds are freed */
+void rbtree_persist_destroy(rbtree_persist t);
+/* O(1): snap becomes an independent version with t's current contents */
+void rbtree_snapshot(rbtree_persist t, rbtree_persist snap);
+
+/* returns 1 if added, 0 if an equal key was replaced, -1 if out of memory */
+int rbtree_persist_insert(rbtree_persist t, void* key, void* value);
+/* returns 1 if deleted, 0 if not found, -1 if out of memory */
+int rbtree_persist_delete(rbtree_persist t, const void* key);
+void* rbtree_persist_lookup(rbtree_persist t, const void* key);
+rbtree_pnode rbtree_persist_node_lookup(rbtree_persist t, const void* key);
+
+/* cursors stay valid while their version exists and is not modified */
+rbtree_pnode rbtree_cursor_first(rbtree_cursor c, rbtree_persist t);
+rbtree_pnode rbtree_cursor_last(rbtree_cursor c, rbtree_persist t);
+rbtree_pnode rbtree_cursor_next(rbtree_cursor c);
+rbtree_pnode rbtree_cursor_prev(rbtree_cursor c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+/* vim: set ts=8 sw=4 sts=4 et: */
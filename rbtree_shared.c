@@ -0,0 +1,259 @@
+/* Red-black trees shared by lock-free readers and a single writer
+ * Copyright (c) 2008 Derrick Coetzee
+ * Douglas Clowes, February 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT
+ * OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rbtree_shared.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#ifndef RBTREE_SHARED
+#error "build rbtree.c and rbtree_shared.c with -DRBTREE_SHARED"
+#endif
+
+/*
+ * A search can loop or run long if it races with a rotation; no
+ * consistent red-black tree is deeper than this, so a reader that gets
+ * this far knows it must retry.
+ */
+#define MAX_DEPTH (2 * 8 * sizeof(size_t))
+
+/* retire this many nodes between attempts to free them */
+#define RECLAIM_BATCH 64
+
+/* a pause in a spin loop, to spare the core and the contended line */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#define load_relaxed(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+/* pairs with the release stores of rbtree.c's links */
+#define load_link(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+
+void rbtree_shared_init(rbtree_shared s, rbtree_compare_func compare)
+{
+    int i;
+
+    rbtree_init(&s->tree, compare);
+    s->seq = 0;
+    s->epoch = 1;
+    s->retired = NULL;
+    s->num_retired = 0;
+    s->max_retired = 0;
+    for (i = 0; i < RBTREE_SHARED_MAX_READERS; ++i) {
+        s->readers[i].epoch = 0;
+        s->readers[i].in_use = 0;
+    }
+}
+
+void rbtree_shared_destroy(rbtree_shared s)
+{
+    size_t i;
+
+    for (i = 0; i < s->num_retired; ++i)
+        s->retired[i].free_fn(s->retired[i].node, s->retired[i].context);
+    free(s->retired);
+    s->retired = NULL;
+    s->num_retired = 0;
+    s->max_retired = 0;
+}
+
+int rbtree_shared_reader_register(rbtree_shared s)
+{
+    int i;
+
+    for (i = 0; i < RBTREE_SHARED_MAX_READERS; ++i) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&s->readers[i].in_use, &expected, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return i;
+    }
+    return -1;
+}
+
+void rbtree_shared_reader_unregister(rbtree_shared s, int reader)
+{
+    __atomic_store_n(&s->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->readers[reader].in_use, 0, __ATOMIC_RELEASE);
+}
+
+void rbtree_shared_read_lock(rbtree_shared s, int reader)
+{
+    unsigned long epoch = __atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&s->readers[reader].epoch, epoch, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void rbtree_shared_read_unlock(rbtree_shared s, int reader)
+{
+    __atomic_store_n(&s->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+rbtree_node rbtree_shared_lookup(rbtree_shared s, const void* key)
+{
+    rbtree_compare_func compare = s->tree.compare;
+
+    while (1) {
+        unsigned long seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        rbtree_node n, found = NULL;
+        size_t depth = 0;
+
+        if (seq & 1) {
+            cpu_relax(); /* writer busy */
+            continue;
+        }
+        n = load_link(&s->tree.root);
+        while (n != NULL && depth++ < MAX_DEPTH) {
+            int comp_result = compare(key, load_relaxed(&n->key));
+            if (comp_result == 0) {
+                found = n;
+                break;
+            }
+            n = comp_result < 0 ? load_link(&n->left) : load_link(&n->right);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (depth <= MAX_DEPTH && load_relaxed(&s->seq) == seq)
+            return found;
+    }
+}
+
+void rbtree_shared_write_begin(rbtree_shared s)
+{
+    assert ((s->seq & 1) == 0);
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void rbtree_shared_write_end(rbtree_shared s)
+{
+    assert ((s->seq & 1) == 1);
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Spin until no reader is still inside a section it entered at or
+ * before epoch.
+ */
+static void wait_for_readers(rbtree_shared s, unsigned long epoch)
+{
+    int i;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < RBTREE_SHARED_MAX_READERS; ++i) {
+        unsigned long e;
+        while ((e = __atomic_load_n(&s->readers[i].epoch, __ATOMIC_SEQ_CST)) != 0 &&
+               e <= epoch)
+            cpu_relax();
+    }
+}
+
+void rbtree_shared_retire(rbtree_shared s, rbtree_node node,
+                          rbtree_free_func free_fn, void* context)
+{
+    struct rbtree_retired_t* r;
+    unsigned long epoch;
+
+    if (s->num_retired == s->max_retired && rbtree_shared_reclaim(s) == s->max_retired) {
+        size_t max = s->max_retired ? 2 * s->max_retired : RECLAIM_BATCH;
+        r = realloc(s->retired, max * sizeof(*r));
+        if (r == NULL) {
+            /* no room to defer: wait out the readers and free it now */
+            epoch = s->epoch;
+            __atomic_store_n(&s->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+            wait_for_readers(s, epoch);
+            free_fn(node, context);
+            return;
+        }
+        s->retired = r;
+        s->max_retired = max;
+    }
+    r = &s->retired[s->num_retired++];
+    r->node = node;
+    r->free_fn = free_fn;
+    r->context = context;
+    /*
+     * node is already unreachable; readers that start after the epoch
+     * moves past r->epoch cannot find it
+     */
+    r->epoch = s->epoch;
+    __atomic_store_n(&s->epoch, s->epoch + 1, __ATOMIC_SEQ_CST);
+    if (s->num_retired % RECLAIM_BATCH == 0)
+        rbtree_shared_reclaim(s);
+}
+
+size_t rbtree_shared_reclaim(rbtree_shared s)
+{
+    unsigned long oldest = __atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST);
+    size_t i, kept = 0;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < RBTREE_SHARED_MAX_READERS; ++i) {
+        unsigned long epoch = __atomic_load_n(&s->readers[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+    for (i = 0; i < s->num_retired; ++i) {
+        struct rbtree_retired_t* r = &s->retired[i];
+        if (r->epoch < oldest)
+            r->free_fn(r->node, r->context);
+        else
+            s->retired[kept++] = *r;
+    }
+    s->num_retired = kept;
+    return kept;
+}
+
+void rbtree_shared_insert(rbtree_shared s, rbtree_node node,
+                          rbtree_free_func free_fn, void* context)
+{
+    rbtree_node replaced;
+
+    /* make the new node's links visible before the node itself */
+    node->left = NULL;
+    node->right = NULL;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rbtree_shared_write_begin(s);
+    replaced = rbtree_insert(&s->tree, node);
+    rbtree_shared_write_end(s);
+    if (replaced != NULL)
+        rbtree_shared_retire(s, replaced, free_fn, context);
+}
+
+int rbtree_shared_delete(rbtree_shared s, const void* key,
+                         rbtree_free_func free_fn, void* context)
+{
+    rbtree_node deleted;
+
+    rbtree_shared_write_begin(s);
+    deleted = rbtree_delete(&s->tree, key);
+    rbtree_shared_write_end(s);
+    if (deleted == NULL)
+        return 0;
+    rbtree_shared_retire(s, deleted, free_fn, context);
+    return 1;
+}
+
+/* vim: set ts=8 sw=4 sts=4 et: */
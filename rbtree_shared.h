@@ -0,0 +1,121 @@
+/* Red-black trees shared by lock-free readers and a single writer
+ * Copyright (c) 2008 Derrick Coetzee
+ * Douglas Clowes, February 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT
+ * OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _RBTREE_SHARED_H_
+#define _RBTREE_SHARED_H_
+
+#include "rbtree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A tree that any number of reader threads search without locks while
+ * one writer thread changes it with the ordinary rbtree functions.
+ *
+ * Readers validate each search against a sequence count that the
+ * writer bumps around every change, and retry if it moved.  Nodes
+ * the writer removes are retired rather than freed, and only freed
+ * once every reader that might still hold them has left its read-side
+ * section (epoch-based reclamation).
+ *
+ * Reader threads register once for a slot, then bracket searches with
+ * rbtree_shared_read_lock/unlock; nodes found stay valid until the
+ * unlock.  The writer brackets changes with rbtree_shared_write_begin/
+ * end (or uses rbtree_shared_insert/delete) and hands every removed
+ * node to rbtree_shared_retire.  Keys must not change while a node is
+ * in the tree.
+ *
+ * rbtree.c and rbtree_shared.c must be built with RBTREE_SHARED, which
+ * makes every link the writer stores an atomic store, so that readers
+ * (which load links and keys atomically) never race with it.  A search
+ * only ever follows links that were in the tree at some point of its
+ * read-side section, and nodes stay allocated until every such section
+ * has ended, so a search that raced reads stale memory, never freed
+ * memory, and the sequence check sends it round again.
+ *
+ * Needs the GCC/Clang __atomic builtins.
+ */
+#ifndef RBTREE_SHARED_MAX_READERS
+#define RBTREE_SHARED_MAX_READERS 64
+#endif
+
+struct rbtree_reader_slot_t {
+    unsigned long epoch;  /* 0 when not reading */
+    int in_use;
+    char pad[64 - sizeof(unsigned long) - sizeof(int)];
+};
+
+struct rbtree_retired_t {
+    rbtree_node node;
+    unsigned long epoch;
+    rbtree_free_func free_fn;
+    void* context;
+};
+
+typedef struct rbtree_shared_t {
+    struct rbtree_t tree;                 /* writer only */
+    unsigned long seq;                    /* private: odd while writing */
+    unsigned long epoch;                  /* private */
+    struct rbtree_retired_t* retired;     /* private */
+    size_t num_retired;                   /* private */
+    size_t max_retired;                   /* private */
+    struct rbtree_reader_slot_t readers[RBTREE_SHARED_MAX_READERS];
+} *rbtree_shared;
+
+void rbtree_shared_init(rbtree_shared s, rbtree_compare_func compare);
+/* free all retired nodes; no reader may be active */
+void rbtree_shared_destroy(rbtree_shared s);
+
+/* returns a reader slot, or -1 if all are taken */
+int rbtree_shared_reader_register(rbtree_shared s);
+void rbtree_shared_reader_unregister(rbtree_shared s, int reader);
+void rbtree_shared_read_lock(rbtree_shared s, int reader);
+void rbtree_shared_read_unlock(rbtree_shared s, int reader);
+rbtree_node rbtree_shared_lookup(rbtree_shared s, const void* key);
+
+void rbtree_shared_write_begin(rbtree_shared s);
+void rbtree_shared_write_end(rbtree_shared s);
+/*
+ * free node with free_fn once no reader can reach it; if there is no
+ * memory to defer it, waits for the readers and frees it at once, so
+ * call it after rbtree_shared_write_end
+ */
+void rbtree_shared_retire(rbtree_shared s, rbtree_node node,
+                          rbtree_free_func free_fn, void* context);
+/* free what can be freed now; returns the number still waiting */
+size_t rbtree_shared_reclaim(rbtree_shared s);
+/* write-side wrappers: replaced and deleted nodes are retired */
+void rbtree_shared_insert(rbtree_shared s, rbtree_node node,
+                          rbtree_free_func free_fn, void* context);
+int rbtree_shared_delete(rbtree_shared s, const void* key,
+                         rbtree_free_func free_fn, void* context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+/* vim: set ts=8 sw=4 sts=4 et: */
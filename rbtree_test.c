@@ -27,10 +27,23 @@
  */
 
 #include "rbtree.h"
+#include "rbtree_gen.h"
+#include "rbtree_u64.h"
+#ifdef RBTREE_SHARED
+#include "rbtree_shared.h"
+#include <pthread.h>
+#endif
+#include "rbtree_persist.h"
+#include "rbtree_frozen.h"
+#include "rbtree_image.h"
+#include "rbtree_arena.h"
 #include <stdio.h>
+#include <stddef.h> /* offsetof() */
 #include <assert.h>
 #include <stdlib.h> /* rand() */
 #include <string.h> /* strcmp() */
+#include <errno.h>
+#include <unistd.h> /* ftruncate() */
 
 static int compare_int(const void* leftp, const void* rightp) {
     int left = * (int *)leftp;
@@ -58,7 +71,7 @@ static void print_tree_helper(rbtree_node n, int indent) {
     }
     for(i=0; i<indent; i++)
         fputs(" ", stdout);
-    if (n->color == BLACK)
+    if (rbtree_node_color(n) == BLACK)
         printf("%d\n", * (int *)n->key);
     else
         printf("<%d>\n", * (int *)n->key);
@@ -89,6 +102,1807 @@ static int do_nuffin(rbtree_node node, void *context)
     return 0;
 }
 
+/*
+ * Build trees of every size up to 100 from sorted arrays,
+ * check them and tear them down again
+ */
+static void test_build_sorted(int *errors)
+{
+    data_node dnodes[100];
+    rbtree_node nodes[100];
+    struct rbtree_t tree;
+    rbtree t = &tree;
+    rbtree_node node;
+    int i, n, key;
+
+    for (n = 0; n <= 100; ++n) {
+        rbtree_init(t, (rbtree_compare_func) compare_int);
+        for (i = 0; i < n; ++i) {
+            dnodes[i].skey = 2 * i;
+            dnodes[i].rbnode.key = &dnodes[i].skey;
+            dnodes[i].rbnode.value = &dnodes[i].sval;
+            nodes[i] = &dnodes[i].rbnode;
+        }
+        if (rbtree_build_sorted(t, nodes, n) != 0 || t->node_count != n) {
+            printf("%2d: failed build_sorted(%d)\n", ++*errors, n);
+            continue;
+        }
+        i = 0;
+        for (node = rbtree_node_first(t); node; node = rbtree_node_next(t, node))
+            if (*(int *)node->key != 2 * i++)
+                break;
+        if (node != NULL || i != n)
+            printf("%2d: failed build_sorted(%d) order\n", ++*errors, n);
+        for (key = -1; key <= 2 * n; ++key)
+            if ((rbtree_node_lookup(t, &key) != NULL) != (key >= 0 && key % 2 == 0 && key < 2 * n))
+                break;
+        if (key <= 2 * n)
+            printf("%2d: failed build_sorted(%d) lookup %d\n", ++*errors, n, key);
+        for (i = 0; i < n; ++i)
+            rbtree_node_delete(t, nodes[(i * 7919) % n]); /* 7919 is prime */
+        if (t->root != NULL || t->node_count != 0)
+            printf("%2d: failed build_sorted(%d) delete\n", ++*errors, n);
+    }
+
+    /* unsorted and duplicate input is rejected */
+    rbtree_init(t, (rbtree_compare_func) compare_int);
+    dnodes[1].skey = 0;
+    if (rbtree_build_sorted(t, nodes, 3) != -1 || t->root != NULL)
+        printf("%2d: failed build_sorted duplicate\n", ++*errors);
+    dnodes[1].skey = -1;
+    if (rbtree_build_sorted(t, nodes, 3) != -1 || t->root != NULL)
+        printf("%2d: failed build_sorted unsorted\n", ++*errors);
+}
+
+/*
+ * Check bounds and range walks against brute force
+ * on a tree holding the even keys 0..98
+ */
+static void test_range(int *errors)
+{
+    data_node dnodes[50];
+    rbtree_node nodes[50];
+    struct rbtree_t tree;
+    rbtree t = &tree;
+    rbtree_node node;
+    int i, lo, hi, flags, expect;
+
+    rbtree_init(t, (rbtree_compare_func) compare_int);
+    for (i = 0; i < 50; ++i) {
+        dnodes[i].skey = 2 * i;
+        dnodes[i].rbnode.key = &dnodes[i].skey;
+        nodes[i] = &dnodes[i].rbnode;
+    }
+    rbtree_build_sorted(t, nodes, 50);
+
+    for (lo = -2; lo <= 100; ++lo) {
+        node = rbtree_node_lower_bound(t, &lo);
+        expect = lo < 0 ? 0 : (lo + 1) / 2 * 2;
+        if (expect >= 100 ? node != NULL : (node == NULL || *(int *)node->key != expect))
+            printf("%2d: failed lower_bound(%d)\n", ++*errors, lo);
+        node = rbtree_node_upper_bound(t, &lo);
+        expect = lo < 0 ? 0 : (lo + 2) / 2 * 2;
+        if (expect >= 100 ? node != NULL : (node == NULL || *(int *)node->key != expect))
+            printf("%2d: failed upper_bound(%d)\n", ++*errors, lo);
+        for (hi = lo; hi <= 100; hi += 3)
+            for (flags = 0; flags <= RBTREE_RANGE_CLOSED; ++flags) {
+                expect = 0;
+                for (i = 0; i < 100; i += 2)
+                    if ((i > lo || (i == lo && (flags & RBTREE_RANGE_INCLUDE_LO))) &&
+                        (i < hi || (i == hi && (flags & RBTREE_RANGE_INCLUDE_HI))))
+                        ++expect;
+                if (rbtree_walk_range(t, &lo, &hi, flags, NULL, NULL) != expect)
+                    printf("%2d: failed walk_range(%d, %d, %d)\n", ++*errors, lo, hi, flags);
+            }
+    }
+    if (rbtree_walk_range(t, NULL, NULL, 0, NULL, NULL) != 50)
+        printf("%2d: failed walk_range unbounded\n", ++*errors);
+}
+
+/* visitor state for test_walk */
+typedef struct {
+    int last;
+    int visits;
+    int stop_at;
+    int bad;
+} walk_state;
+
+static int check_ascending(rbtree_node node, void *context)
+{
+    walk_state *ws = context;
+    if (ws->visits++ > 0 && *(int *)node->key <= ws->last)
+        ws->bad = 1;
+    ws->last = *(int *)node->key;
+    return ws->last == ws->stop_at ? 42 : 0;
+}
+
+static int check_descending(rbtree_node node, void *context)
+{
+    walk_state *ws = context;
+    if (ws->visits++ > 0 && *(int *)node->key >= ws->last)
+        ws->bad = 1;
+    ws->last = *(int *)node->key;
+    return 0;
+}
+
+/* children must already be marked when their parent is visited */
+static int check_postorder(rbtree_node node, void *context)
+{
+    walk_state *ws = context;
+    ws->visits++;
+    if ((node->left && *(int *)node->left->value != 1) ||
+        (node->right && *(int *)node->right->value != 1))
+        ws->bad = 1;
+    *(int *)node->value = 1;
+    return 0;
+}
+
+/*
+ * Check walk order and early termination
+ */
+static void test_walk(int *errors)
+{
+    static data_node dnodes[1000];
+    struct rbtree_t tree;
+    rbtree t = &tree;
+    walk_state ws;
+    int i;
+
+    rbtree_init(t, (rbtree_compare_func) compare_int);
+    for (i = 0; i < 1000; ++i) {
+        dnodes[i].skey = (i * 7919) % 1000;
+        dnodes[i].sval = 0;
+        dnodes[i].rbnode.key = &dnodes[i].skey;
+        dnodes[i].rbnode.value = &dnodes[i].sval;
+        rbtree_insert(t, &dnodes[i].rbnode);
+    }
+
+    memset(&ws, 0, sizeof(ws));
+    ws.stop_at = -1;
+    if (rbtree_walk(t, check_ascending, &ws) != 1000 || ws.bad || ws.visits != 1000)
+        printf("%2d: failed walk\n", ++*errors);
+    memset(&ws, 0, sizeof(ws));
+    ws.stop_at = 500;
+    if (rbtree_walk(t, check_ascending, &ws) != 42 || ws.bad || ws.visits != 501)
+        printf("%2d: failed walk early stop\n", ++*errors);
+    memset(&ws, 0, sizeof(ws));
+    ws.stop_at = 600;
+    if (rbtree_walk_range(t, &ws.stop_at, NULL, RBTREE_RANGE_CLOSED, check_ascending, &ws) != 42 ||
+        ws.visits != 1)
+        printf("%2d: failed walk_range early stop\n", ++*errors);
+    memset(&ws, 0, sizeof(ws));
+    if (rbtree_walk_reverse(t, check_descending, &ws) != 1000 || ws.bad || ws.visits != 1000)
+        printf("%2d: failed walk_reverse\n", ++*errors);
+    memset(&ws, 0, sizeof(ws));
+    if (rbtree_walk_postorder(t, check_postorder, &ws) != 1000 || ws.bad || ws.visits != 1000)
+        printf("%2d: failed walk_postorder\n", ++*errors);
+    i = rbtree_walk(t, NULL, NULL) - 1 - rbtree_node_walk(t->root->right, NULL, NULL);
+    if (rbtree_node_walk_reverse(t->root->left, NULL, NULL) != i ||
+        rbtree_node_walk_postorder(t->root->left, NULL, NULL) != i)
+        printf("%2d: failed subtree walk\n", ++*errors);
+}
+
+static inline int compare_dnode(const data_node* left, const data_node* right)
+{
+    return (left->skey > right->skey) - (left->skey < right->skey);
+}
+
+RBTREE_GENERATE(dtree, data_node, rbnode, compare_dnode)
+
+/* with the link after the key, a NULL element is not a NULL link */
+typedef struct {
+    int skey;
+    struct rbtree_node_t rbnode;
+} tail_node;
+
+static inline int compare_tnode(const tail_node* left, const tail_node* right)
+{
+    return (left->skey > right->skey) - (left->skey < right->skey);
+}
+
+RBTREE_GENERATE(ttree, tail_node, rbnode, compare_tnode)
+
+/*
+ * Check a generated tree against the generic API
+ */
+static void test_generate(int *errors)
+{
+    static data_node dnodes[1000];
+    struct rbtree_t tree;
+    rbtree t = &tree;
+    data_node probe, *dn;
+    int i, dups = 0, found = 0;
+
+    dtree_init(t);
+    for (i = 0; i < 1000; ++i) {
+        dnodes[i].skey = rand() % 2000;
+        if (dtree_insert(t, &dnodes[i]) != NULL)
+            ++dups;
+    }
+    if (t->node_count + dups != 1000)
+        printf("%2d: failed generated insert\n", ++*errors);
+    for (probe.skey = -1; probe.skey <= 2000; ++probe.skey) {
+        dn = dtree_lookup(t, &probe);
+        if (dn != NULL)
+            ++found;
+        if (dn != dtree_entry(rbtree_node_lookup(t, &probe)))
+            break;
+        dn = dtree_lower_bound(t, &probe);
+        if (dn != dtree_entry(rbtree_node_lower_bound(t, &probe)))
+            break;
+        dn = dtree_upper_bound(t, &probe);
+        if (dn != dtree_entry(rbtree_node_upper_bound(t, &probe)))
+            break;
+    }
+    if (probe.skey <= 2000 || found != t->node_count)
+        printf("%2d: failed generated lookup %d\n", ++*errors, probe.skey);
+    i = 0;
+    for (dn = dtree_first(t); dn != NULL; dn = dtree_next(t, dn))
+        ++i;
+    for (dn = dtree_last(t); dn != NULL; dn = dtree_prev(t, dn))
+        --i;
+    if (i != 0 || ttree_next(t, NULL) != NULL || ttree_prev(t, NULL) != NULL ||
+        ttree_remove(t, NULL) != NULL)
+        printf("%2d: failed generated iteration\n", ++*errors);
+    for (probe.skey = 0; probe.skey < 2000; ++probe.skey)
+        if ((dn = dtree_delete(t, &probe)) != NULL && dn->skey != probe.skey)
+            break;
+    if (probe.skey < 2000 || t->node_count != 0)
+        printf("%2d: failed generated delete\n", ++*errors);
+}
+
+/*
+ * Check the integer-keyed trees across the full key range
+ */
+static void test_u64(int *errors)
+{
+    static struct rbtree_u64_node_t unodes[1000];
+    static struct rbtree_s64_node_t snodes[1000];
+    struct rbtree_t utree, stree;
+    rbtree ut = &utree, st = &stree;
+    rbtree_u64_node un;
+    rbtree_s64_node sn;
+    uint64_t ulast;
+    int64_t slast;
+    int i, count;
+
+    rbtree_u64_init(ut);
+    rbtree_s64_init(st);
+    for (i = 0; i < 1000; ++i) {
+        unodes[i].key = (uint64_t) i * 0x9E3779B97F4A7C15ULL;
+        unodes[i].node.value = &unodes[i];
+        rbtree_u64_insert(ut, &unodes[i]);
+        snodes[i].key = (int64_t) unodes[i].key;
+        rbtree_s64_insert(st, &snodes[i]);
+    }
+    for (i = 0; i < 1000; ++i)
+        if (rbtree_u64_lookup(ut, unodes[i].key) != &unodes[i] ||
+            rbtree_s64_node_lookup(st, snodes[i].key) != &snodes[i] ||
+            rbtree_u64_node_lookup(ut, unodes[i].key + 1) != NULL)
+            break;
+    if (i < 1000)
+        printf("%2d: failed u64 lookup %d\n", ++*errors, i);
+
+    count = 0;
+    for (un = rbtree_u64_node_first(ut); un; un = rbtree_u64_node_next(ut, un), ++count)
+        if (count > 0 && un->key <= ulast)
+            break;
+        else
+            ulast = un->key;
+    if (un != NULL || count != 1000)
+        printf("%2d: failed u64 order\n", ++*errors);
+    count = 0;
+    for (sn = rbtree_s64_node_last(st); sn; sn = rbtree_s64_node_prev(st, sn), ++count)
+        if (count > 0 && sn->key >= slast)
+            break;
+        else
+            slast = sn->key;
+    if (sn != NULL || count != 1000 || rbtree_s64_node_first(st)->key >= 0)
+        printf("%2d: failed s64 order\n", ++*errors);
+
+    for (i = 0; i < 1000; ++i) {
+        if (rbtree_u64_delete(ut, unodes[i].key) != &unodes[i])
+            break;
+        if (rbtree_s64_node_delete(st, &snodes[i]) != &snodes[i])
+            break;
+    }
+    if (i < 1000 || rbtree_u64_walk(ut, NULL, NULL) != 0 || rbtree_s64_walk(st, NULL, NULL) != 0)
+        printf("%2d: failed u64 delete\n", ++*errors);
+}
+
+/*
+ * Batched lookups must match one-at-a-time lookups
+ */
+static void test_lookup_batch(int *errors)
+{
+    static data_node dnodes[1000];
+    static int keys[3000];
+    static const void* kptrs[3000];
+    static rbtree_node out[3000];
+    struct rbtree_t tree;
+    rbtree t = &tree;
+    int i;
+
+    rbtree_init(t, (rbtree_compare_func) compare_int);
+    rbtree_lookup_batch(t, kptrs, 0, out);
+    for (i = 0; i < 1000; ++i) {
+        dnodes[i].skey = rand() % 2000;
+        dnodes[i].rbnode.key = &dnodes[i].skey;
+        rbtree_insert(t, &dnodes[i].rbnode);
+    }
+    for (i = 0; i < 3000; ++i) {
+        keys[i] = rand() % 2000;
+        kptrs[i] = &keys[i];
+    }
+    for (i = 0; i <= 3000; i += 3000 / 7) {
+        int j, n = 3000 - i;
+        rbtree_lookup_batch(t, kptrs + i, n, out);
+        for (j = 0; j < n; ++j)
+            if (out[j] != rbtree_node_lookup(t, kptrs[i + j]))
+                break;
+        if (j < n)
+            printf("%2d: failed lookup_batch %d\n", ++*errors, i + j);
+    }
+}
+
+/* counts comparisons for test_hint */
+static int num_compares;
+
+static int counting_compare_int(const void* leftp, const void* rightp) {
+    ++num_compares;
+    return compare_int(leftp, rightp);
+}
+
+/*
+ * Hinted inserts and lookups must agree with plain ones,
+ * and sequential inserts must be cheap
+ */
+static void test_hint(int *errors)
+{
+    static data_node dnodes[1000];
+    struct rbtree_t tree;
+    rbtree t = &tree;
+    rbtree_node hint = NULL;
+    int i, key;
+
+    rbtree_init(t, counting_compare_int);
+    num_compares = 0;
+    for (i = 0; i < 1000; ++i) {
+        dnodes[i].skey = 2 * i;
+        dnodes[i].rbnode.key = &dnodes[i].skey;
+        rbtree_insert_hint(t, &dnodes[i].rbnode, hint);
+        hint = &dnodes[i].rbnode;
+    }
+    if (num_compares > 2 * 1000 || t->node_count != 1000)
+        printf("%2d: failed insert_hint sequential (%d compares)\n", ++*errors, num_compares);
+
+    for (i = 0; i < 1000; ++i) {
+        hint = &dnodes[rand() % 1000].rbnode;
+        key = rand() % 2001 - 1;
+        if (rbtree_node_lookup_hint(t, &key, hint) != rbtree_node_lookup(t, &key))
+            break;
+    }
+    if (i < 1000)
+        printf("%2d: failed lookup_hint %d from %d\n", ++*errors, key, *(int *)hint->key);
+
+    for (i = 0; i < 1000; i += 2)
+        rbtree_node_delete(t, &dnodes[i].rbnode);
+    for (i = 0; i < 1000; i += 2) {
+        dnodes[i].skey = 2 * ((i * 7919) % 1000) + 1;
+        rbtree_insert_hint(t, &dnodes[i].rbnode, &dnodes[(i * 31 + 1) % 1000].rbnode);
+    }
+    key = -1;
+    for (hint = rbtree_node_first(t); hint; hint = rbtree_node_next(t, hint))
+        if (*(int *)hint->key <= key)
+            break;
+        else
+            key = *(int *)hint->key;
+    if (hint != NULL || t->node_count != rbtree_walk(t, NULL, NULL))
+        printf("%2d: failed insert_hint random\n", ++*errors);
+}
+
+/* upsert callbacks counting keys, with nodes from an array */
+typedef struct {
+    data_node *next;
+    data_node *end;
+    int made;
+    int updated;
+} upsert_state;
+
+static rbtree_node make_counter(const void *key, void *context)
+{
+    upsert_state *us = context;
+    data_node *dnode;
+
+    if (us->next == us->end)
+        return NULL;
+    dnode = us->next++;
+    dnode->skey = *(const int *)key;
+    dnode->sval = 1;
+    dnode->rbnode.key = &dnode->skey;
+    us->made++;
+    return &dnode->rbnode;
+}
+
+static void update_counter(rbtree_node node, void *context)
+{
+    ((data_node *) node)->sval++;
+    ((upsert_state *) context)->updated++;
+}
+
+/*
+ * Count 5000 draws of 500 keys with upsert, one descent each,
+ * and keep the first of duplicates with find_or_insert
+ */
+static void test_upsert(int *errors)
+{
+    static data_node dnodes[1000];
+    static int counts[500];
+    struct rbtree_t tree;
+    rbtree t = &tree;
+    upsert_state us;
+    rbtree_node node;
+    int i, key, inserted, distinct = 0;
+
+    memset(counts, 0, sizeof(counts));
+    us.next = dnodes;
+    us.end = dnodes + 1000;
+    us.made = us.updated = 0;
+    rbtree_init(t, counting_compare_int);
+    num_compares = 0;
+    for (i = 0; i < 5000; ++i) {
+        key = rand() % 500;
+        distinct += counts[key]++ == 0;
+        node = rbtree_upsert(t, &key, make_counter, update_counter, &us);
+        if (node == NULL || *(int *)node->key != key || ((data_node *) node)->sval != counts[key])
+            break;
+    }
+    /* a descent of a 500 node tree is at most 2 log2 500 deep */
+    if (i < 5000 || us.made != distinct || us.updated != 5000 - distinct ||
+        t->node_count != distinct || num_compares > 5000 * 18)
+        printf("%2d: failed upsert\n", ++*errors);
+    key = 500;
+    us.end = us.next;
+    if (rbtree_upsert(t, &key, make_counter, update_counter, &us) != NULL ||
+        t->node_count != distinct || rbtree_node_lookup(t, &key) != NULL)
+        printf("%2d: failed upsert without a node\n", ++*errors);
+
+    key = 250;
+    dnodes[999].skey = key;
+    dnodes[999].rbnode.key = &dnodes[999].skey;
+    node = rbtree_node_lookup(t, &key);
+    if (rbtree_find_or_insert(t, &dnodes[999].rbnode, &inserted) != node || inserted ||
+        rbtree_node_lookup(t, &key) != node)
+        printf("%2d: failed find_or_insert existing\n", ++*errors);
+
+    /* in a multimap the first node with the key is found */
+    rbtree_init_flags(t, (rbtree_compare_func) compare_int, RBTREE_MULTI);
+    for (i = 0; i < 10; ++i) {
+        dnodes[i].skey = i / 2;
+        dnodes[i].rbnode.key = &dnodes[i].skey;
+        rbtree_insert(t, &dnodes[i].rbnode);
+    }
+    dnodes[10].skey = 3;
+    dnodes[10].rbnode.key = &dnodes[10].skey;
+    dnodes[11].skey = 7;
+    dnodes[11].rbnode.key = &dnodes[11].skey;
+    if (rbtree_find_or_insert(t, &dnodes[10].rbnode, &inserted) != &dnodes[6].rbnode || inserted ||
+        rbtree_find_or_insert(t, &dnodes[11].rbnode, &inserted) != &dnodes[11].rbnode || !inserted ||
+        t->node_count != 11 || rbtree_node_last(t) != &dnodes[11].rbnode)
+        printf("%2d: failed find_or_insert multimap\n", ++*errors);
+}
+
+/*
+ * Run a tree out of a node pool, reusing freed nodes
+ */
+static void test_pool(int *errors)
+{
+    struct rbtree_pool_t pool;
+    struct rbtree_t tree;
+    rbtree t = &tree;
+    data_node *dnode;
+    void *head;
+    int i, key, deleted = 0;
+
+    rbtree_init(t, (rbtree_compare_func) compare_int);
+    rbtree_pool_init(&pool, sizeof(data_node), 100);
+    for (i = 0; i < 5000; ++i) {
+        dnode = rbtree_pool_alloc(&pool);
+        dnode->skey = rand() % 5000;
+        dnode->rbnode.key = &dnode->skey;
+        rbtree_pool_insert(t, &pool, &dnode->rbnode);
+    }
+    for (key = 0; key < 5000; key += 2)
+        deleted += rbtree_pool_delete(t, &pool, &key);
+    for (key = 0; key < 5000; key += 2)
+        if (rbtree_node_lookup(t, &key) != NULL)
+            break;
+    if (deleted == 0 || key < 5000 || t->node_count != rbtree_walk(t, NULL, NULL))
+        printf("%2d: failed pool delete\n", ++*errors);
+    /* freed nodes are handed out again before new slab space */
+    head = pool.free_list;
+    dnode = rbtree_pool_alloc(&pool);
+    if (head == NULL || (void *) dnode != head)
+        printf("%2d: failed pool reuse\n", ++*errors);
+    rbtree_pool_free(&pool, dnode);
+    rbtree_pool_release(t, &pool);
+    if (t->root != NULL || t->node_count != 0 || pool.slabs != NULL)
+        printf("%2d: failed pool release\n", ++*errors);
+}
+
+#ifdef RBTREE_SHARED
+/*
+ * Shared tree test: the even keys 0..1998 stay in the tree
+ * while the writer churns the odd keys
+ */
+typedef struct {
+    rbtree_shared s;
+    int stop;
+    int bad;
+} shared_state;
+
+static void free_dnode(rbtree_node node, void *context)
+{
+    (void) context;
+    free(node);
+}
+
+static void *shared_reader(void *arg)
+{
+    shared_state *ss = arg;
+    int reader = rbtree_shared_reader_register(ss->s);
+    unsigned int seed = (unsigned int) reader;
+    rbtree_node node;
+    int key;
+
+    while (!__atomic_load_n(&ss->stop, __ATOMIC_ACQUIRE)) {
+        rbtree_shared_read_lock(ss->s, reader);
+        key = rand_r(&seed) % 2000;
+        node = rbtree_shared_lookup(ss->s, &key);
+        if ((node == NULL && key % 2 == 0) || (node != NULL && *(int *)node->key != key))
+            __atomic_store_n(&ss->bad, 1, __ATOMIC_RELAXED);
+        rbtree_shared_read_unlock(ss->s, reader);
+    }
+    rbtree_shared_reader_unregister(ss->s, reader);
+    return NULL;
+}
+
+static void test_shared(int *errors)
+{
+    struct rbtree_shared_t shared;
+    shared_state ss;
+    pthread_t readers[4];
+    data_node *dnode;
+    int i, key;
+
+    rbtree_shared_init(&shared, (rbtree_compare_func) compare_int);
+    ss.s = &shared;
+    ss.stop = 0;
+    ss.bad = 0;
+    for (i = 0; i < 2000; ++i) {
+        dnode = calloc(1, sizeof(data_node));
+        dnode->skey = i;
+        dnode->rbnode.key = &dnode->skey;
+        rbtree_shared_insert(&shared, &dnode->rbnode, free_dnode, NULL);
+    }
+    for (i = 0; i < 4; ++i)
+        pthread_create(&readers[i], NULL, shared_reader, &ss);
+    for (i = 0; i < 50000; ++i) {
+        key = 2 * (rand() % 1000) + 1;
+        if (i % 2 == 0) {
+            dnode = calloc(1, sizeof(data_node));
+            dnode->skey = key;
+            dnode->rbnode.key = &dnode->skey;
+            rbtree_shared_insert(&shared, &dnode->rbnode, free_dnode, NULL);
+        } else {
+            rbtree_shared_delete(&shared, &key, free_dnode, NULL);
+        }
+    }
+    __atomic_store_n(&ss.stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < 4; ++i)
+        pthread_join(readers[i], NULL);
+    if (ss.bad)
+        printf("%2d: failed shared lookup\n", ++*errors);
+    if (rbtree_shared_reclaim(&shared) != 0)
+        printf("%2d: failed shared reclaim\n", ++*errors);
+    while ((dnode = (data_node *) rbtree_node_first(&shared.tree)) != NULL)
+        rbtree_shared_delete(&shared, dnode->rbnode.key, free_dnode, NULL);
+    rbtree_shared_destroy(&shared);
+}
+#endif
+
+static void count_free_dnode(rbtree_node node, void *context)
+{
+    __atomic_add_fetch((int *) context, 1, __ATOMIC_RELAXED);
+    free(node);
+}
+
+/* keep b's node, as a tagged it */
+static rbtree_node merge_dnode(rbtree_node a, rbtree_node b, void *context)
+{
+    (void) a;
+    (void) context;
+    return b;
+}
+
+static void fill_set(rbtree t, const char *in, int n, int tag)
+{
+    data_node *dnode;
+    int i;
+
+    rbtree_init(t, (rbtree_compare_func) compare_int);
+    for (i = 0; i < n; ++i) {
+        if (!in[i])
+            continue;
+        dnode = calloc(1, sizeof(data_node));
+        dnode->skey = i;
+        dnode->sval = tag;
+        dnode->rbnode.key = &dnode->skey;
+        rbtree_insert(t, &dnode->rbnode);
+    }
+}
+
+/*
+ * Check union, intersection and difference of two random sets
+ * against brute force; big enough to fork with RBTREE_THREADS, and
+ * done again there with a small grain and several workers, so that
+ * the pool runs however few CPUs there are
+ */
+#define SET_KEYS (MAXENT < 40000 ? MAXENT : 40000)
+#ifdef RBTREE_THREADS
+#define SET_PASSES 2
+#else
+#define SET_PASSES 1
+#endif
+
+static void test_set_ops(int *errors)
+{
+    static char in_a[SET_KEYS], in_b[SET_KEYS];
+    struct rbtree_t a, b;
+    rbtree_node node;
+    data_node *dnode;
+    int op, kind, i, both, expect, count, freed, last;
+
+    for (i = 0, both = 0; i < SET_KEYS; ++i) {
+        in_a[i] = rand() % 3 != 0;
+        in_b[i] = rand() % 2;
+        both += in_a[i] && in_b[i];
+    }
+    for (op = 0; op < 3 * SET_PASSES; ++op) {
+        kind = op % 3;
+#ifdef RBTREE_THREADS
+        if (op == 3)
+            rbtree_set_threads(16, 4);
+#endif
+        fill_set(&a, in_a, SET_KEYS, 0);
+        fill_set(&b, in_b, SET_KEYS, 1);
+#ifdef RBTREE_STATS
+        rbtree_stats_reset(&a);
+#endif
+        count = a.node_count + b.node_count;
+        freed = 0;
+        if (kind == 0)
+            expect = rbtree_union(&a, &b, merge_dnode, count_free_dnode, &freed);
+        else if (kind == 1)
+            expect = rbtree_intersection(&a, &b, merge_dnode, count_free_dnode, &freed);
+        else
+            expect = rbtree_difference(&a, &b, count_free_dnode, &freed);
+        if (expect != both || b.root != NULL || b.node_count != 0 ||
+            freed + a.node_count != count)
+            printf("%2d: failed set op %d counts\n", ++*errors, op);
+#ifdef RBTREE_STATS
+        /* every subproblem splits, so every one compares */
+        if (a.counters.comparisons < (unsigned long) SET_KEYS / 4)
+            printf("%2d: failed set op %d stats\n", ++*errors, op);
+#endif
+        count = 0;
+        last = -1;
+        for (node = rbtree_node_first(&a); node; node = rbtree_node_next(&a, node)) {
+            dnode = (data_node *) node;
+            i = dnode->skey;
+            if (kind == 0)
+                expect = in_a[i] || in_b[i];
+            else if (kind == 1)
+                expect = in_a[i] && in_b[i];
+            else
+                expect = in_a[i] && !in_b[i];
+            if (i <= last || !expect || dnode->sval != (kind != 2 && in_b[i]))
+                break;
+            last = i;
+            ++count;
+        }
+        if (node != NULL || count != a.node_count)
+            printf("%2d: failed set op %d result\n", ++*errors, op);
+        while ((node = rbtree_node_first(&a)) != NULL)
+            free(rbtree_node_delete(&a, node));
+    }
+#ifdef RBTREE_THREADS
+    rbtree_set_threads(RBTREE_SET_GRAIN, RBTREE_SET_WORKERS);
+#endif
+    rbtree_init(&a, (rbtree_compare_func) compare_int);
+    if (rbtree_union(&a, &a, NULL, NULL, NULL) != -1)
+        printf("%2d: failed set op on itself\n", ++*errors);
+}
+
+static void count_node(rbtree_node node, void *context)
+{
+    (void) node;
+    ++*(int *) context;
+}
+
+/*
+ * Delete ranges of every shape from a tree of the even keys 0..198
+ * and check the rest against brute force, then clear it
+ */
+static void test_delete_range(int *errors)
+{
+    data_node dnodes[100];
+    struct rbtree_t tree;
+    rbtree t = &tree;
+    int i, lo, hi, flags, expect, freed, ok;
+
+    for (lo = -2; lo <= 200; lo += 3) {
+        for (hi = lo - 4; hi <= 202; hi += 5) {
+            for (flags = 0; flags < 4; ++flags) {
+                rbtree_init(t, (rbtree_compare_func) compare_int);
+                for (i = 0; i < 100; ++i) {
+                    dnodes[i].skey = 2 * ((i * 37) % 100);
+                    dnodes[i].rbnode.key = &dnodes[i].skey;
+                    rbtree_insert(t, &dnodes[i].rbnode);
+                }
+                expect = rbtree_walk_range(t, &lo, &hi, flags, NULL, NULL);
+                freed = 0;
+                ok = rbtree_delete_range(t, &lo, &hi, flags, count_node, &freed) == expect &&
+                     freed == expect && t->node_count == 100 - expect &&
+                     rbtree_walk_range(t, &lo, &hi, flags, NULL, NULL) == 0 &&
+                     rbtree_walk(t, NULL, NULL) == t->node_count;
+                for (i = 0; ok && i < 200; i += 2) {
+                    int gone = (i > lo || (i == lo && (flags & RBTREE_RANGE_INCLUDE_LO))) &&
+                               (i < hi || (i == hi && (flags & RBTREE_RANGE_INCLUDE_HI)));
+                    ok = (rbtree_node_lookup(t, &i) == NULL) == gone;
+                }
+                if (!ok)
+                    printf("%2d: failed delete_range %d %d %d\n", ++*errors, lo, hi, flags);
+            }
+        }
+    }
+
+    /* unbounded ranges, then what is left */
+    rbtree_init(t, (rbtree_compare_func) compare_int);
+    for (i = 0; i < 100; ++i)
+        rbtree_insert(t, &dnodes[i].rbnode);
+    lo = 50;
+    freed = 0;
+    if (rbtree_delete_range(t, NULL, &lo, 0, count_node, &freed) != 25 ||
+        rbtree_delete_range(t, &lo, NULL, 0, count_node, &freed) != 74 ||
+        freed != 99 || t->node_count != 1 || *(int *) t->root->key != 50)
+        printf("%2d: failed delete_range unbounded\n", ++*errors);
+    freed = 0;
+    rbtree_clear(t, count_node, &freed);
+    if (freed != 1 || t->root != NULL || t->node_count != 0)
+        printf("%2d: failed clear\n", ++*errors);
+}
+
+/*
+ * Check the shape statistics of trees of several sizes against
+ * the red-black bounds, and that the counters count, hinted inserts
+ * and batched lookups included
+ */
+static void test_stats(int *errors)
+{
+    static data_node dnodes[1000];
+#ifdef RBTREE_STATS
+    static const void* keys[1000];
+    static rbtree_node found[1000];
+#endif
+    struct rbtree_t tree;
+    rbtree t = &tree;
+    struct rbtree_stats stats;
+    int i, n, bound;
+
+    for (n = 0; n <= 1000; n += 125) {
+        rbtree_init(t, (rbtree_compare_func) compare_int);
+        for (i = 0; i < n; ++i) {
+            dnodes[i].skey = (i * 7919) % n;
+            dnodes[i].rbnode.key = &dnodes[i].skey;
+            rbtree_insert(t, &dnodes[i].rbnode);
+        }
+        rbtree_stats(t, &stats);
+        for (bound = 0; (1 << bound) <= n; ++bound)
+            ;
+        if (stats.node_count != n || stats.height > 2 * bound ||
+            stats.height < bound || stats.black_height * 2 < stats.height ||
+            stats.average_depth > stats.height || (n > 0 && stats.average_depth < 1) ||
+            stats.memory < (size_t) n * sizeof(struct rbtree_node_t))
+            printf("%2d: failed stats %d\n", ++*errors, n);
+#ifdef RBTREE_STATS
+        if (n > 0 && (stats.counters.comparisons == 0 || stats.counters.descents < (unsigned long) n ||
+                      stats.counters.max_descent_depth > (unsigned long) stats.height ||
+                      (n > 2 && (stats.counters.rotations == 0 || stats.counters.recolorings == 0 ||
+                                 stats.counters.fixups == 0))))
+            printf("%2d: failed stats counters %d\n", ++*errors, n);
+#ifdef RBTREE_STATS_LATENCY
+        {
+            unsigned long inserts = 0;
+            for (i = 0; i < RBTREE_LATENCY_BUCKETS; ++i)
+                inserts += stats.counters.latency[RBTREE_OP_INSERT][i];
+            if (inserts != (unsigned long) n)
+                printf("%2d: failed stats latency %d\n", ++*errors, n);
+        }
+#endif
+        rbtree_stats_reset(t);
+        rbtree_stats(t, &stats);
+        if (stats.counters.comparisons != 0 || stats.counters.descents != 0)
+            printf("%2d: failed stats reset %d\n", ++*errors, n);
+        for (i = 0; i < n; ++i)
+            keys[i] = &dnodes[i].skey;
+        rbtree_lookup_batch(t, keys, n, found);
+        rbtree_stats(t, &stats);
+        if (stats.counters.descents != (unsigned long) n ||
+            stats.counters.descent_depth < (unsigned long) n ||
+            stats.counters.max_descent_depth > (unsigned long) stats.height)
+            printf("%2d: failed stats batch %d\n", ++*errors, n);
+#ifdef RBTREE_STATS_LATENCY
+        {
+            unsigned long lookups = 0;
+            for (i = 0; i < RBTREE_LATENCY_BUCKETS; ++i)
+                lookups += stats.counters.latency[RBTREE_OP_LOOKUP][i];
+            if (lookups != (unsigned long) n)
+                printf("%2d: failed stats batch latency %d\n", ++*errors, n);
+        }
+#endif
+        /* rebuild with each insert hinted by the one before */
+        rbtree_init(t, (rbtree_compare_func) compare_int);
+        for (i = 0; i < n; ++i)
+            rbtree_insert_hint(t, &dnodes[i].rbnode, i ? &dnodes[i - 1].rbnode : NULL);
+        rbtree_stats(t, &stats);
+        if (stats.counters.descents != (unsigned long) n ||
+            stats.counters.descent_depth < (unsigned long) n - (n > 0))
+            printf("%2d: failed stats hint %d\n", ++*errors, n);
+#ifdef RBTREE_STATS_LATENCY
+        {
+            unsigned long inserts = 0;
+            for (i = 0; i < RBTREE_LATENCY_BUCKETS; ++i)
+                inserts += stats.counters.latency[RBTREE_OP_INSERT][i];
+            if (inserts != (unsigned long) n)
+                printf("%2d: failed stats hint latency %d\n", ++*errors, n);
+        }
+#endif
+#endif
+    }
+}
+
+/*
+ * A WAVL tree through inserts, deletes, build_sorted and delete_range;
+ * with VERIFY_RBTREE every change checks the ranks
+ */
+static void test_wavl(int *errors)
+{
+    static data_node dnodes[1000];
+    static rbtree_node nodes[1000];
+    struct rbtree_t tree, other;
+    rbtree t = &tree;
+    struct rbtree_stats stats;
+    int i, n, key, bound, freed;
+
+    rbtree_init_flags(t, (rbtree_compare_func) compare_int, RBTREE_WAVL);
+    for (i = 0; i < 1000; ++i) {
+        dnodes[i].skey = (i * 7919) % 1000;
+        dnodes[i].rbnode.key = &dnodes[i].skey;
+        rbtree_insert(t, &dnodes[i].rbnode);
+    }
+    /* with no deletes it is an AVL tree, under 1.44 log2 n high */
+    rbtree_stats(t, &stats);
+    for (bound = 0; (1 << bound) <= 1000; ++bound)
+        ;
+    if (stats.node_count != 1000 || 2 * stats.height > 3 * bound ||
+        stats.black_height < stats.height - 1 || stats.black_height > 2 * bound)
+        printf("%2d: failed wavl insert\n", ++*errors);
+
+    /* every other key, at most two rotations each */
+    for (i = 0; i < 1000; i += 2) {
+        key = (i * 7907) % 1000;
+#ifdef RBTREE_STATS
+        rbtree_stats_reset(t);
+#endif
+        if (rbtree_delete(t, &key) == NULL)
+            break;
+#ifdef RBTREE_STATS
+        rbtree_stats(t, &stats);
+        if (stats.counters.rotations > 2)
+            break;
+#endif
+    }
+    if (i < 1000 || t->node_count != 500)
+        printf("%2d: failed wavl delete %d\n", ++*errors, i);
+    for (i = 0; i < 1000; ++i) {
+        key = (i * 7907) % 1000;
+        if ((rbtree_node_lookup(t, &key) == NULL) != (i % 2 == 0))
+            break;
+    }
+    if (i < 1000 || rbtree_walk(t, NULL, NULL) != 500)
+        printf("%2d: failed wavl lookup %d\n", ++*errors, i);
+
+    /* red-black only operations refuse it */
+    rbtree_init(&other, (rbtree_compare_func) compare_int);
+    key = 500;
+    if (rbtree_join(t, NULL, &other) != -1 || rbtree_join(&other, NULL, t) != -1 ||
+        rbtree_union(t, &other, NULL, NULL, NULL) != -1 || t->node_count != 500)
+        printf("%2d: failed wavl refuse\n", ++*errors);
+#ifdef RBTREE_ORDER_STATISTICS
+    if (rbtree_split(t, &key, t, &other) != NULL || t->node_count != 500)
+        printf("%2d: failed wavl refuse split\n", ++*errors);
+#endif
+
+    key = 250;
+    freed = 0;
+    if (rbtree_delete_range(t, &key, NULL, RBTREE_RANGE_INCLUDE_LO, count_node, &freed) != 375 ||
+        freed != 375 || t->node_count != 125 || rbtree_walk(t, NULL, NULL) != 125 ||
+        *(int *) rbtree_node_last(t)->key >= 250)
+        printf("%2d: failed wavl delete_range\n", ++*errors);
+    rbtree_clear(t, NULL, NULL);
+
+    /* build, then interleave inserts with the built keys and delete those */
+    for (n = 0; n <= 500; n += 37) {
+        rbtree_init_flags(t, (rbtree_compare_func) compare_int, RBTREE_WAVL);
+        for (i = 0; i < n; ++i) {
+            dnodes[i].skey = 2 * i;
+            dnodes[i].rbnode.key = &dnodes[i].skey;
+            nodes[i] = &dnodes[i].rbnode;
+        }
+        if (rbtree_build_sorted(t, nodes, n) != 0) {
+            printf("%2d: failed wavl build_sorted %d\n", ++*errors, n);
+            continue;
+        }
+        for (i = 0; i < n; ++i) {
+            dnodes[n + i].skey = 2 * i + 1;
+            dnodes[n + i].rbnode.key = &dnodes[n + i].skey;
+            rbtree_insert(t, &dnodes[n + i].rbnode);
+        }
+        for (i = 0; i < n; ++i)
+            rbtree_node_delete(t, nodes[(i * 7919) % n]);
+        if (t->node_count != n || rbtree_walk(t, NULL, NULL) != n ||
+            (n > 0 && *(int *) rbtree_node_first(t)->key != 1))
+            printf("%2d: failed wavl build_sorted %d delete\n", ++*errors, n);
+    }
+}
+
+/* keys ascend and equal keys keep their insertion order, by sval */
+static int check_stable(rbtree t)
+{
+    rbtree_node node, prev = NULL;
+    int count = 0;
+
+    for (node = rbtree_node_first(t); node; prev = node, node = rbtree_node_next(t, node), ++count) {
+        data_node *a = (data_node *) prev, *b = (data_node *) node;
+        if (prev != NULL && (a->skey > b->skey || (a->skey == b->skey && a->sval >= b->sval)))
+            return -1;
+    }
+    return count == t->node_count ? count : -1;
+}
+
+/*
+ * A multimap: thirty nodes for each of 100 keys, inserted directly
+ * and with hints, then looked up and deleted by key and by range
+ */
+static void test_multi(int *errors)
+{
+    static data_node dnodes[3000];
+    static rbtree_node nodes[300];
+    const void *keys[100];
+    rbtree_node out[100];
+    struct rbtree_t tree, left, right;
+    rbtree t = &tree;
+    rbtree_node node, end, hint = NULL;
+    int i, key, count;
+
+    rbtree_init_flags(t, (rbtree_compare_func) compare_int, RBTREE_MULTI);
+    for (i = 0; i < 3000; ++i) {
+        dnodes[i].skey = i % 100;
+        dnodes[i].sval = i;
+        dnodes[i].rbnode.key = &dnodes[i].skey;
+        if (i < 1500 ? rbtree_insert(t, &dnodes[i].rbnode) != NULL :
+            rbtree_insert_hint(t, &dnodes[i].rbnode, hint) != NULL)
+            break;
+        hint = &dnodes[i].rbnode;
+    }
+    if (i < 3000 || t->node_count != 3000 || check_stable(t) != 3000)
+        printf("%2d: failed multi insert\n", ++*errors);
+
+    for (key = 0; key < 100; ++key) {
+        keys[key] = &dnodes[key].skey;
+        node = rbtree_equal_range(t, &key, &end);
+        for (count = 0; node != end; node = rbtree_node_next(t, node), ++count)
+            if (((data_node *) node)->skey != key)
+                break;
+        node = rbtree_node_lookup(t, &key);
+        if (count != 30 || rbtree_count_key(t, &key) != 30 ||
+            node != &dnodes[key].rbnode ||
+            rbtree_node_lookup_hint(t, &key, &dnodes[(key * 37) % 3000].rbnode) != node)
+            break;
+    }
+    if (key < 100)
+        printf("%2d: failed multi lookup %d\n", ++*errors, key);
+    rbtree_lookup_batch(t, keys, 100, out);
+    for (key = 0; key < 100; ++key)
+        if (out[key] != &dnodes[key].rbnode)
+            break;
+    if (key < 100)
+        printf("%2d: failed multi lookup_batch %d\n", ++*errors, key);
+    key = 100;
+    if (rbtree_node_lookup(t, &key) != NULL || rbtree_count_key(t, &key) != 0 ||
+        rbtree_equal_range(t, &key, &end) != NULL || end != NULL)
+        printf("%2d: failed multi lookup missing\n", ++*errors);
+
+    /* delete one removes the first; delete all and ranges remove every duplicate */
+    key = 0;
+    if (rbtree_delete(t, &key) != &dnodes[0].rbnode || rbtree_count_key(t, &key) != 29)
+        printf("%2d: failed multi delete one\n", ++*errors);
+    key = 1;
+    if (rbtree_delete_all(t, &key, NULL, NULL) != 30 || rbtree_count_key(t, &key) != 0 ||
+        rbtree_equal_range(t, &key, &end) != end || ((data_node *) end)->skey != 2)
+        printf("%2d: failed multi delete all\n", ++*errors);
+    i = 10;
+    key = 12;
+    if (rbtree_delete_range(t, &i, &key, RBTREE_RANGE_CLOSED, NULL, NULL) != 90)
+        printf("%2d: failed multi delete closed range\n", ++*errors);
+    i = 20;
+    key = 22;
+    if (rbtree_delete_range(t, &i, &key, RBTREE_RANGE_HALF_OPEN, NULL, NULL) != 60 ||
+        rbtree_count_key(t, &key) != 30 || t->node_count != 3000 - 1 - 30 - 90 - 60 ||
+        check_stable(t) != t->node_count)
+        printf("%2d: failed multi delete half-open range\n", ++*errors);
+
+#ifdef RBTREE_ORDER_STATISTICS
+    /* split keeps the duplicates together, on the right, and join puts them back */
+    count = t->node_count;
+    key = 50;
+    if (rbtree_split(t, &key, &left, &right) != NULL ||
+        ((data_node *) rbtree_node_last(&left))->skey != 49 ||
+        rbtree_node_first(&right) != &dnodes[50].rbnode ||
+        rbtree_count_key(&right, &key) != 30 ||
+        rbtree_join(&left, NULL, &right) != 0 ||
+        left.node_count != count || check_stable(&left) != count)
+        printf("%2d: failed multi split/join\n", ++*errors);
+#endif
+    rbtree_init_flags(&right, (rbtree_compare_func) compare_int, RBTREE_MULTI);
+    if (rbtree_union(&left, &right, NULL, NULL, NULL) != -1)
+        printf("%2d: failed multi union refused\n", ++*errors);
+
+    /* duplicates in order build, and a WAVL multimap deletes them all */
+    rbtree_init_flags(t, (rbtree_compare_func) compare_int, RBTREE_MULTI | RBTREE_WAVL);
+    for (i = 0; i < 300; ++i) {
+        dnodes[i].skey = i / 30;
+        dnodes[i].sval = i;
+        dnodes[i].rbnode.key = &dnodes[i].skey;
+        nodes[i] = &dnodes[i].rbnode;
+    }
+    key = 3;
+    if (rbtree_build_sorted(t, nodes, 300) != 0 || check_stable(t) != 300 ||
+        rbtree_delete_all(t, &key, NULL, NULL) != 30 ||
+        rbtree_insert(t, &dnodes[95].rbnode) != NULL || rbtree_count_key(t, &key) != 1 ||
+        check_stable(t) != 271)
+        printf("%2d: failed multi wavl\n", ++*errors);
+}
+
+/* checks the keys of t are lo, lo + step, ... below hi */
+static int check_keys(rbtree t, int lo, int hi, int step)
+{
+    rbtree_node node;
+    int key = lo;
+
+    for (node = rbtree_node_first(t); node; node = rbtree_node_next(t, node)) {
+        if (*(int *)node->key != key)
+            return 0;
+        key += step;
+    }
+    return key >= hi && t->node_count == (hi - lo + step - 1) / step;
+}
+
+/*
+ * Split a tree of the even keys 0..998 at every kind of key,
+ * then join the halves back together; without order statistics,
+ * only join trees built by insertion
+ */
+static void test_split_join(int *errors)
+{
+    static data_node dnodes[500], small[10];
+    rbtree_node nodes[500];
+    struct rbtree_t tree, left, right;
+    rbtree t = &tree;
+    rbtree_node node;
+    int i, key;
+
+    for (i = 0; i < 500; ++i) {
+        dnodes[i].skey = 2 * i;
+        dnodes[i].rbnode.key = &dnodes[i].skey;
+        nodes[i] = &dnodes[i].rbnode;
+    }
+#ifdef RBTREE_ORDER_STATISTICS
+    for (key = -1; key <= 1000; key += 7) {
+        rbtree_init(t, (rbtree_compare_func) compare_int);
+        for (i = 0; i < 500; ++i)
+            rbtree_insert(t, nodes[(i * 7919) % 500]);
+        node = rbtree_split(t, &key, &left, &right);
+        if ((node != NULL) != (key >= 0 && key % 2 == 0 && key < 1000) ||
+            (node != NULL && *(int *)node->key != key) || t->root != NULL) {
+            printf("%2d: failed split %d\n", ++*errors, key);
+            continue;
+        }
+        if (!check_keys(&left, 0, key < 0 ? 0 : key > 998 ? 1000 : key, 2) ||
+            !check_keys(&right, key < 0 ? 0 : key + (key % 2 ? 1 : 2), 1000, 2))
+            printf("%2d: failed split %d halves\n", ++*errors, key);
+        if (node != NULL && left.root != NULL && right.root != NULL &&
+            rbtree_join(&right, node, &left) != -1)
+            printf("%2d: failed join %d out of order\n", ++*errors, key);
+        if (rbtree_join(&left, node, &right) != 0 || !check_keys(&left, 0, 1000, 2) ||
+            right.root != NULL || right.node_count != 0)
+            printf("%2d: failed join %d\n", ++*errors, key);
+    }
+
+    /* split a tree into itself, and join without a pivot */
+    key = 500;
+    node = rbtree_split(&left, &key, &left, &right);
+    if (node == NULL || rbtree_join(&left, NULL, &right) != 0 || left.node_count != 499)
+        printf("%2d: failed join without pivot\n", ++*errors);
+
+#endif
+
+    /* join trees of very different heights, both ways round */
+    rbtree_init(t, (rbtree_compare_func) compare_int);
+    rbtree_init(&left, (rbtree_compare_func) compare_int);
+    rbtree_init(&right, (rbtree_compare_func) compare_int);
+    node = nodes[30];
+    for (i = 0; i < 500; ++i)
+        if (i != 30 && i != 250)
+            rbtree_insert(i < 30 ? t : &left, nodes[i]);
+    for (i = 0; i < 10; ++i) {
+        small[i].skey = 1000 + 2 * i;
+        small[i].rbnode.key = &small[i].skey;
+        rbtree_insert(&right, &small[i].rbnode);
+    }
+    if (!check_keys(t, 0, 60, 2) ||
+        rbtree_join(&left, NULL, &right) != 0 || rbtree_join(&tree, node, &left) != 0 ||
+        tree.node_count != 509 || left.root != NULL)
+        printf("%2d: failed join of unequal heights\n", ++*errors);
+    key = -1;
+    for (node = rbtree_node_first(&tree); node; node = rbtree_node_next(&tree, node)) {
+        if (*(int *)node->key <= key)
+            break;
+        key = *(int *)node->key;
+    }
+    if (node != NULL || key != 1018)
+        printf("%2d: failed join of unequal heights order\n", ++*errors);
+}
+
+/*
+ * Search frozen indexes against brute force and against an unfrozen
+ * copy, then thaw them back into trees
+ */
+static void test_frozen(int *errors)
+{
+    static data_node dnodes[1000];
+    static struct rbtree_u64_node_t unodes[2][1000];
+    static struct rbtree_s64_node_t snodes[1000];
+    struct rbtree_frozen_t frozen;
+    rbtree_frozen f = &frozen;
+    struct rbtree_t tree, utree;
+    rbtree t = &tree, ut = &utree;
+    struct rbtree_u64_node_t probe;
+    walk_state ws;
+    rbtree_node n;
+    int i, key, lo, hi, flags, n_keys;
+
+    for (n_keys = 0; n_keys <= 1000; n_keys += 333) {
+        rbtree_init(t, (rbtree_compare_func) compare_int);
+        for (i = 0; i < n_keys; ++i) {
+            dnodes[i].skey = 2 * ((i * 7919) % n_keys);
+            dnodes[i].rbnode.key = &dnodes[i].skey;
+            rbtree_insert(t, &dnodes[i].rbnode);
+        }
+        memset(&ws, 0, sizeof(ws));
+        ws.stop_at = -1;
+        /* odd sizes copy the keys into the index */
+        if (rbtree_freeze(f, t, n_keys % 2 ? sizeof(int) : 0) != 0 || t->root != NULL || t->node_count != 0 ||
+            f->count != (size_t) n_keys || rbtree_frozen_walk(f, check_ascending, &ws) != n_keys ||
+            ws.bad || ws.visits != n_keys)
+            printf("%2d: failed freeze %d\n", ++*errors, n_keys);
+        for (key = -1; key <= 2 * n_keys; ++key) {
+            int lower = key < 0 ? 0 : (key + 1) / 2 * 2;
+            int upper = key < 0 ? 0 : key / 2 * 2 + 2;
+            n = rbtree_frozen_lookup(f, &key);
+            if ((n != NULL) != (key >= 0 && key % 2 == 0 && key < 2 * n_keys) ||
+                (n != NULL && *(int *) n->key != key))
+                break;
+            n = rbtree_frozen_lower_bound(f, &key);
+            if (lower < 2 * n_keys ? n == NULL || *(int *) n->key != lower : n != NULL)
+                break;
+            n = rbtree_frozen_upper_bound(f, &key);
+            if (upper < 2 * n_keys ? n == NULL || *(int *) n->key != upper : n != NULL)
+                break;
+        }
+        if (key <= 2 * n_keys)
+            printf("%2d: failed frozen lookup %d %d\n", ++*errors, n_keys, key);
+        for (lo = -1; lo <= 2 * n_keys; lo += 7)
+            for (hi = lo - 2; hi <= 2 * n_keys + 1; hi += 11)
+                for (flags = 0; flags < 4; ++flags) {
+                    int expect = 0;
+                    for (i = 0; i < n_keys; ++i)
+                        expect += (2 * i > lo || (2 * i == lo && (flags & RBTREE_RANGE_INCLUDE_LO))) &&
+                                  (2 * i < hi || (2 * i == hi && (flags & RBTREE_RANGE_INCLUDE_HI)));
+                    if (rbtree_frozen_walk_range(f, &lo, &hi, flags, NULL, NULL) != expect)
+                        printf("%2d: failed frozen walk_range %d %d %d\n", ++*errors, lo, hi, flags);
+                }
+        rbtree_thaw(f, t);
+        key = 0;
+        if (t->node_count != n_keys || rbtree_walk(t, NULL, NULL) != n_keys ||
+            (n_keys > 0 && (rbtree_delete(t, &key) != &dnodes[0].rbnode ||
+                            rbtree_insert(t, &dnodes[0].rbnode) != NULL)))
+            printf("%2d: failed thaw %d\n", ++*errors, n_keys);
+    }
+
+    /* integer indexes, including the extreme keys */
+    for (n_keys = 0; n_keys <= 1000; n_keys += 111) {
+        rbtree_u64_init(ut);
+        rbtree_u64_init(t);
+        for (i = 0; i < n_keys; ++i) {
+            unodes[0][i].key = unodes[1][i].key =
+                i < 2 ? (uint64_t) -i : (uint64_t) i * 0x9E3779B97F4A7C15ULL;
+            rbtree_u64_insert(ut, &unodes[0][i]);
+            rbtree_u64_insert(t, &unodes[1][i]);
+        }
+        if (rbtree_freeze_u64(f, ut) != 0) {
+            printf("%2d: failed freeze_u64 %d\n", ++*errors, n_keys);
+            continue;
+        }
+        for (i = 0; i < 3 * n_keys + 3; ++i) {
+            rbtree_u64_node expect, got;
+            probe.key = i % 3 == 2 ? (uint64_t) i << 40 : unodes[1][i / 3 % (n_keys ? n_keys : 1)].key + i % 3;
+            expect = rbtree_u64_node_lower_bound(t, probe.key);
+            got = rbtree_frozen_u64_lower_bound(f, probe.key);
+            if ((expect == NULL ? got != NULL : got == NULL || got->key != expect->key) ||
+                (rbtree_frozen_u64_lookup(f, probe.key) != NULL) !=
+                (rbtree_u64_node_lookup(t, probe.key) != NULL) ||
+                rbtree_frozen_lower_bound(f, &probe) != (rbtree_node) got)
+                break;
+            expect = rbtree_u64_node_upper_bound(t, probe.key);
+            n = rbtree_frozen_upper_bound(f, &probe);
+            if (expect == NULL ? n != NULL : n == NULL || ((rbtree_u64_node) n)->key != expect->key)
+                break;
+        }
+        if (i < 3 * n_keys + 3)
+            printf("%2d: failed frozen u64 %d %d\n", ++*errors, n_keys, i);
+        rbtree_thaw(f, ut);
+        if (ut->node_count != n_keys ||
+            (n_keys > 0 && rbtree_u64_node_lookup(ut, unodes[0][n_keys / 2].key) == NULL))
+            printf("%2d: failed thaw u64 %d\n", ++*errors, n_keys);
+    }
+
+    rbtree_s64_init(t);
+    for (i = 0; i < 1000; ++i) {
+        snodes[i].key = (i - 500) * 3;
+        rbtree_s64_insert(t, &snodes[i]);
+    }
+    if (rbtree_freeze_s64(f, t) != 0) {
+        printf("%2d: failed freeze_s64\n", ++*errors);
+        return;
+    }
+    for (i = -1600; i < 1600; ++i) {
+        rbtree_s64_node sn = rbtree_frozen_s64_lower_bound(f, i);
+        int64_t expect = i <= -1500 ? -1500 : (i + 1500 + 2) / 3 * 3 - 1500;
+        if ((expect < 1500 ? sn == NULL || sn->key != expect : sn != NULL) ||
+            (rbtree_frozen_s64_lookup(f, i) != NULL) != (i % 3 == 0 && i >= -1500 && i < 1500))
+            break;
+    }
+    if (i < 1600)
+        printf("%2d: failed frozen s64 %d\n", ++*errors, i);
+    rbtree_frozen_destroy(f, NULL, NULL);
+}
+
+static size_t string_size(const void* data, void* context)
+{
+    (void) context;
+    return strlen(data) + 1;
+}
+
+static int compare_string(const void* left, const void* right)
+{
+    return strcmp(left, right);
+}
+
+/*
+ * Save trees, map the images and search them in place; a truncated
+ * image must not map, and a walk of one whose links make a cycle must
+ * stop
+ */
+static void test_image(int *errors)
+{
+    static data_node dnodes[1000];
+    static const char* const words[] = { "pear", "apple", "fig", "quince", "banana" };
+    static struct rbtree_node_t snodes[5];
+    const struct rbtree_codec int_codec = { sizeof(int), NULL, NULL, NULL };
+    const struct rbtree_codec string_codec = { 0, string_size, NULL, NULL };
+    struct rbtree_image_t image;
+    rbtree_image img = &image;
+    struct rbtree_t tree;
+    rbtree t = &tree;
+    rbtree_inode n;
+    char path[] = "/tmp/rbtree_testXXXXXX";
+    int i, key, fd, n_keys;
+    uint64_t offset, root;
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        printf("%2d: failed image mkstemp\n", ++*errors);
+        return;
+    }
+    for (n_keys = 0; n_keys <= 1000; n_keys += 250) {
+        rbtree_init(t, (rbtree_compare_func) compare_int);
+        for (i = 0; i < n_keys; ++i) {
+            dnodes[i].skey = 2 * ((i * 7919) % n_keys);
+            dnodes[i].sval = -dnodes[i].skey;
+            dnodes[i].rbnode.key = &dnodes[i].skey;
+            dnodes[i].rbnode.value = &dnodes[i].sval;
+            rbtree_insert(t, &dnodes[i].rbnode);
+        }
+        if (rbtree_save(t, fd, &int_codec, &int_codec) != 0 ||
+            rbtree_map(img, path, (rbtree_compare_func) compare_int) != 0) {
+            printf("%2d: failed image save %d\n", ++*errors, n_keys);
+            continue;
+        }
+        for (key = -1; key <= 2 * n_keys; ++key) {
+            n = rbtree_image_lookup(img, &key);
+            if ((n != NULL) != (key >= 0 && key % 2 == 0 && key < 2 * n_keys) ||
+                (n != NULL && (*(const int *) rbtree_image_key(n) != key ||
+                               *(const int *) rbtree_image_value(n) != -key)))
+                break;
+            n = rbtree_image_lower_bound(img, &key);
+            if (key < 2 * n_keys - 1 ? n == NULL || *(const int *) rbtree_image_key(n) != (key + 1) / 2 * 2
+                                     : n != NULL)
+                break;
+        }
+        if (key <= 2 * n_keys)
+            printf("%2d: failed image lookup %d %d\n", ++*errors, n_keys, key);
+        i = 0;
+        for (n = rbtree_image_first(img); n != NULL; n = rbtree_image_next(img, n))
+            if (*(const int *) rbtree_image_key(n) != 2 * i++)
+                break;
+        if (n != NULL || i != n_keys || img->node_count != (size_t) n_keys ||
+            rbtree_image_walk(img, NULL, NULL) != n_keys)
+            printf("%2d: failed image order %d\n", ++*errors, n_keys);
+        for (n = rbtree_image_last(img); n != NULL; n = rbtree_image_prev(img, n))
+            if (*(const int *) rbtree_image_key(n) != 2 * --i)
+                break;
+        if (n != NULL || i != 0)
+            printf("%2d: failed image reverse %d\n", ++*errors, n_keys);
+        rbtree_unmap(img);
+    }
+
+    /* variable-sized keys, and no values */
+    rbtree_init(t, compare_string);
+    for (i = 0; i < 5; ++i) {
+        snodes[i].key = (void *) words[i];
+        rbtree_insert(t, &snodes[i]);
+    }
+    if (rbtree_save(t, fd, &string_codec, NULL) != 0 ||
+        rbtree_map(img, path, compare_string) != 0) {
+        printf("%2d: failed image save strings\n", ++*errors);
+    } else {
+        n = rbtree_image_lookup(img, "fig");
+        if (n == NULL || strcmp(rbtree_image_key(n), "fig") != 0 || n->value_size != 0 ||
+            rbtree_image_lookup(img, "grape") != NULL ||
+            strcmp(rbtree_image_key(rbtree_image_first(img)), "apple") != 0 ||
+            strcmp(rbtree_image_key(rbtree_image_next(img, n)), "pear") != 0)
+            printf("%2d: failed image strings\n", ++*errors);
+        /* point the last node's right link back at the root */
+        n = rbtree_image_last(img);
+        offset = (const char *) n - img->base + offsetof(struct rbtree_image_node_t, right);
+        while (n->parent != 0)
+            n = (rbtree_inode) (img->base + n->parent);
+        root = (const char *) n - img->base;
+        rbtree_unmap(img);
+        if (pwrite(fd, &root, sizeof(root), offset) != sizeof(root) ||
+            rbtree_map(img, path, compare_string) != 0) {
+            printf("%2d: failed image corrupt\n", ++*errors);
+        } else {
+            if (rbtree_image_walk(img, NULL, NULL) != -1 || errno != EINVAL)
+                printf("%2d: failed image cycle\n", ++*errors);
+            rbtree_unmap(img);
+        }
+    }
+
+    /* a multimap finds the first of equal keys */
+    rbtree_init_flags(t, (rbtree_compare_func) compare_int, RBTREE_MULTI);
+    for (i = 0; i < 200; ++i) {
+        dnodes[i].skey = i % 20;
+        dnodes[i].sval = i;
+        dnodes[i].rbnode.key = &dnodes[i].skey;
+        dnodes[i].rbnode.value = &dnodes[i].sval;
+        rbtree_insert(t, &dnodes[i].rbnode);
+    }
+    if (rbtree_save(t, fd, &int_codec, &int_codec) != 0 ||
+        rbtree_map(img, path, (rbtree_compare_func) compare_int) != 0) {
+        printf("%2d: failed image save multi\n", ++*errors);
+    } else {
+        for (key = 0; key < 20; ++key) {
+            n = rbtree_image_lower_bound(img, &key);
+            if (n == NULL || n != rbtree_image_lookup(img, &key) ||
+                *(const int *) rbtree_image_value(n) != key ||
+                (key > 0 && *(const int *) rbtree_image_key(rbtree_image_prev(img, n)) != key - 1))
+                break;
+        }
+        if (key < 20 || rbtree_image_walk(img, NULL, NULL) != 200)
+            printf("%2d: failed image multi %d\n", ++*errors, key);
+        rbtree_unmap(img);
+    }
+
+    if (ftruncate(fd, 100) != 0 ||
+        rbtree_map(img, path, compare_string) != -1 || errno != EINVAL)
+        printf("%2d: failed image truncated\n", ++*errors);
+    close(fd);
+    unlink(path);
+}
+
+/*
+ * Arena tree: a random mix of inserts and deletes checked against
+ * a table of the keys present, then a copy checked against the tree
+ */
+typedef struct {
+    int key;
+    int value;
+} arena_elem;
+
+static int count_arena(rbtree_arena a, uint32_t node, void *context)
+{
+    (void) a;
+    (void) node;
+    ++*(int *) context;
+    return 0;
+}
+
+static void test_arena(int *errors)
+{
+    static int present[2000];
+    struct rbtree_arena_t arena, copy;
+    rbtree_arena a = &arena;
+    arena_elem elem, *e;
+    uint32_t node;
+    int i, count = 0, visited = 0, last = -1;
+
+    memset(present, 0, sizeof(present));
+    rbtree_arena_init(a, sizeof(arena_elem), (rbtree_compare_func) compare_int);
+    if (rbtree_arena_first(a) != RBTREE_ARENA_NIL || rbtree_arena_walk(a, NULL, NULL) != 0)
+        printf("%2d: failed arena empty\n", ++*errors);
+    for (i = 0; i < 20000; ++i) {
+        elem.key = rand() % 2000;
+        elem.value = i;
+        if (rand() % 3 == 0) {
+            if (rbtree_arena_delete(a, &elem, &elem) != (present[elem.key] != 0) ||
+                (present[elem.key] && elem.value != present[elem.key] - 1))
+                break;
+            count -= present[elem.key] != 0;
+            present[elem.key] = 0;
+        } else {
+            node = rbtree_arena_insert(a, &elem);
+            e = rbtree_arena_elem(a, node);
+            if (node == RBTREE_ARENA_NIL || e->key != elem.key || e->value != i)
+                break;
+            count += present[elem.key] == 0;
+            present[elem.key] = i + 1;
+        }
+    }
+    if (i < 20000 || a->node_count != (uint32_t) count)
+        printf("%2d: failed arena insert/delete at %d\n", ++*errors, i);
+    /* freed slots are reused before the arena grows */
+    if (a->used > 2000 + 1)
+        printf("%2d: failed arena reuse\n", ++*errors);
+
+    for (node = rbtree_arena_first(a); node != RBTREE_ARENA_NIL; node = rbtree_arena_next(a, node)) {
+        e = rbtree_arena_elem(a, node);
+        if (e->key <= last || present[e->key] != e->value + 1)
+            break;
+#ifdef RBTREE_ORDER_STATISTICS
+        if (rbtree_arena_select(a, visited) != node || rbtree_arena_rank(a, node) != (size_t) visited)
+            break;
+#endif
+        last = e->key;
+        ++visited;
+    }
+    if (node != RBTREE_ARENA_NIL || visited != count)
+        printf("%2d: failed arena order\n", ++*errors);
+    for (node = rbtree_arena_last(a), visited = 0; node != RBTREE_ARENA_NIL; node = rbtree_arena_prev(a, node))
+        ++visited;
+    if (visited != count)
+        printf("%2d: failed arena reverse order\n", ++*errors);
+
+    for (i = 0; i < 2000; ++i) {
+        elem.key = i;
+        node = rbtree_arena_lower_bound(a, &elem);
+        e = node ? rbtree_arena_elem(a, node) : NULL;
+        if ((rbtree_arena_lookup(a, &elem) != RBTREE_ARENA_NIL) != (present[i] != 0) ||
+            (present[i] && (e == NULL || e->key != i)) ||
+            (!present[i] && e != NULL && present[e->key] == 0))
+            break;
+        node = rbtree_arena_upper_bound(a, &elem);
+        if (node != RBTREE_ARENA_NIL && ((arena_elem *) rbtree_arena_elem(a, node))->key <= i)
+            break;
+    }
+    if (i < 2000)
+        printf("%2d: failed arena lookup %d\n", ++*errors, i);
+
+    /* the copy is a separate tree with the same indices */
+    if (rbtree_arena_copy(&copy, a) != 0)
+        printf("%2d: failed arena copy\n", ++*errors);
+    node = rbtree_arena_first(a);
+    elem = *(arena_elem *) rbtree_arena_elem(a, node);
+    rbtree_arena_node_delete(a, node);
+    visited = 0;
+    if (rbtree_arena_first(&copy) != node ||
+        rbtree_arena_lookup(&copy, &elem) != node ||
+        rbtree_arena_walk(&copy, count_arena, &visited) != count || visited != count ||
+        rbtree_arena_walk(a, NULL, NULL) != count - 1)
+        printf("%2d: failed arena copy contents\n", ++*errors);
+    rbtree_arena_destroy(&copy);
+
+    rbtree_arena_clear(a);
+    if (a->root != RBTREE_ARENA_NIL || a->node_count != 0 ||
+        rbtree_arena_reserve(a, 4000) != 0 || a->capacity < 4001 ||
+        rbtree_arena_insert(a, &elem) != 1)
+        printf("%2d: failed arena clear\n", ++*errors);
+    rbtree_arena_destroy(a);
+}
+
+/*
+ * Take snapshots while changing a persistent tree and check that
+ * each one still holds what it held when it was taken
+ */
+static void test_persist(int *errors)
+{
+    static int keys[1000];
+    static char present[4][1000];
+    struct rbtree_persist_t tree, snaps[4];
+    struct rbtree_cursor_t cursor;
+    rbtree_pnode n;
+    int i, s, k, count, last, result;
+
+    for (i = 0; i < 1000; ++i)
+        keys[i] = i;
+    rbtree_persist_init(&tree, (rbtree_compare_func) compare_int);
+    memset(present, 0, sizeof(present));
+    for (s = 0; s < 4; ++s) {
+        for (i = 0; i < 3000; ++i) {
+            k = rand() % 1000;
+            if (rand() % 3 == 0) {
+                result = rbtree_persist_delete(&tree, &keys[k]);
+                if (result != present[s][k])
+                    printf("%2d: failed persist delete %d\n", ++*errors, k);
+                present[s][k] = 0;
+            } else {
+                result = rbtree_persist_insert(&tree, &keys[k], &keys[k]);
+                if (result != !present[s][k])
+                    printf("%2d: failed persist insert %d\n", ++*errors, k);
+                present[s][k] = 1;
+            }
+        }
+        rbtree_snapshot(&tree, &snaps[s]);
+        if (s < 3)
+            memcpy(present[s + 1], present[s], sizeof(present[s]));
+    }
+    /* change the working tree beyond all of them */
+    for (k = 0; k < 1000; k += 2)
+        rbtree_persist_delete(&tree, &keys[k]);
+    rbtree_persist_destroy(&tree);
+
+    for (s = 0; s < 4; ++s) {
+        for (k = 0; k < 1000; ++k) {
+            if ((rbtree_persist_lookup(&snaps[s], &keys[k]) != NULL) != present[s][k]) {
+                printf("%2d: failed persist snapshot %d key %d\n", ++*errors, s, k);
+                break;
+            }
+        }
+        count = 0;
+        last = -1;
+        for (n = rbtree_cursor_first(&cursor, &snaps[s]); n; n = rbtree_cursor_next(&cursor)) {
+            if (*(int *) n->key <= last || !present[s][*(int *) n->key])
+                break;
+            last = *(int *) n->key;
+            ++count;
+        }
+        if (n != NULL || count != snaps[s].node_count)
+            printf("%2d: failed persist cursor next %d\n", ++*errors, s);
+        count = 0;
+        last = 1000;
+        for (n = rbtree_cursor_last(&cursor, &snaps[s]); n; n = rbtree_cursor_prev(&cursor)) {
+            if (*(int *) n->key >= last)
+                break;
+            last = *(int *) n->key;
+            ++count;
+        }
+        if (n != NULL || count != snaps[s].node_count)
+            printf("%2d: failed persist cursor prev %d\n", ++*errors, s);
+    }
+    for (s = 0; s < 4; ++s)
+        rbtree_persist_destroy(&snaps[s]);
+}
+
+typedef struct {
+    struct rbtree_interval_node_t inode;
+    int lo;
+    int hi;
+} interval_node;
+
+/*
+ * Check interval overlap queries against brute force
+ * while inserting and deleting intervals, two to each low endpoint;
+ * then in a WAVL tree, and in a map, which keeps one of each pair
+ */
+static void test_interval(int *errors)
+{
+    static interval_node inodes[500];
+    struct rbtree_t tree;
+    rbtree t = &tree;
+    int pass, i, j, lo, hi, expect;
+
+    for (pass = 0; pass < 2; ++pass) {
+        if (pass == 0)
+            rbtree_interval_init(t, (rbtree_compare_func) compare_int);
+        else
+            rbtree_interval_init_flags(t, (rbtree_compare_func) compare_int,
+                                       RBTREE_MULTI | RBTREE_WAVL);
+        for (i = 0; i < 500; ++i) {
+            j = (i * 7919) % 500;
+            inodes[j].lo = 4 * (j / 2);
+            inodes[j].hi = inodes[j].lo + rand() % 200;
+            inodes[j].inode.node.key = &inodes[j].lo;
+            inodes[j].inode.high = &inodes[j].hi;
+            rbtree_insert(t, &inodes[j].inode.node);
+        }
+        if (t->node_count != 500)
+            printf("%2d: failed interval duplicates %d\n", ++*errors, pass);
+        for (i = 0; i < 500; i += 3)
+            rbtree_node_delete(t, &inodes[i].inode.node);
+
+        for (lo = -10; lo < 1200; lo += 23) {
+            hi = lo + rand() % 100;
+            expect = 0;
+            for (i = 0; i < 500; ++i)
+                if (i % 3 != 0 && inodes[i].lo <= hi && inodes[i].hi >= lo)
+                    ++expect;
+            if (rbtree_interval_overlaps(t, &lo, &hi, NULL, NULL) != expect)
+                printf("%2d: failed interval_overlaps(%d, %d) %d\n", ++*errors, lo, hi, pass);
+        }
+    }
+
+    rbtree_interval_init_flags(t, (rbtree_compare_func) compare_int, 0);
+    for (i = 0; i < 4; ++i)
+        rbtree_insert(t, &inodes[i].inode.node);
+    lo = 0;
+    hi = 4;
+    if (t->node_count != 2 || rbtree_interval_overlaps(t, &lo, &hi, NULL, NULL) != 2)
+        printf("%2d: failed interval map\n", ++*errors);
+}
+
+#ifdef RBTREE_ABBREV_KEYS
+static int counting_compare_string(const void* left, const void* right)
+{
+    ++num_compares;
+    return strcmp(left, right);
+}
+
+/* the first eight bytes, big-endian, which order as strcmp does */
+static uint64_t string_prefix(const void* key)
+{
+    const unsigned char *s = key;
+    uint64_t abbrev = 0;
+    int i;
+
+    for (i = 0; i < 8; ++i) {
+        abbrev = abbrev << 8 | *s;
+        if (*s)
+            ++s;
+    }
+    return abbrev;
+}
+
+/*
+ * Strings, the first 1000 random and the rest sharing a long prefix,
+ * must be found and ordered the same with and without abbreviations,
+ * and the random ones found with few calls of the compare function
+ */
+static void test_abbrev(int *errors)
+{
+    static data_node dnodes[2000];
+    static char strings[2000][24];
+    struct rbtree_t tree;
+    rbtree t = &tree;
+    rbtree_node node, prev;
+    int i, j, plain = 0, abbreviated = 0;
+
+    rbtree_init(t, counting_compare_string);
+    for (i = 0; i < 2000; ++i) {
+        if (i < 1000) {
+            for (j = 0; j < 6 + i % 12; ++j)
+                strings[i][j] = 'a' + rand() % 26;
+            sprintf(strings[i] + j, "%d", i);
+        } else {
+            sprintf(strings[i], "/usr/local/%d", i);
+        }
+        dnodes[i].rbnode.key = strings[i];
+        rbtree_insert(t, &dnodes[i].rbnode);
+        /* switch abbreviations on halfway, over the nodes already in */
+        if (i == 499)
+            rbtree_set_abbrev(t, string_prefix);
+    }
+    for (node = rbtree_node_first(t), prev = NULL; node; prev = node, node = rbtree_node_next(t, node))
+        if (prev != NULL && strcmp(prev->key, node->key) >= 0)
+            break;
+    if (node != NULL)
+        printf("%2d: failed abbrev order\n", ++*errors);
+
+    for (j = 0; j < 2; ++j) {
+        rbtree_set_abbrev(t, j ? string_prefix : NULL);
+        num_compares = 0;
+        for (i = 0; i < 2000; ++i) {
+            node = rbtree_node_lookup(t, strings[i]);
+            if (node == NULL || strcmp(node->key, strings[i]) != 0 ||
+                rbtree_node_lower_bound(t, strings[i]) != node)
+                break;
+            if (i == 999)
+                *(j ? &abbreviated : &plain) = num_compares;
+        }
+        if (i < 2000)
+            printf("%2d: failed abbrev lookup %d %s\n", ++*errors, j, strings[i]);
+    }
+    if (abbreviated * 4 > plain)
+        printf("%2d: failed abbrev compares %d vs %d\n", ++*errors, abbreviated, plain);
+
+    for (i = 0; i < 2000; i += 2)
+        rbtree_delete(t, strings[i]);
+    for (i = 0; i < 2000; ++i)
+        if (rbtree_node_lookup(t, strings[i]) != (i % 2 ? &dnodes[i].rbnode : NULL))
+            break;
+    if (i < 2000 || t->node_count != rbtree_walk(t, NULL, NULL))
+        printf("%2d: failed abbrev delete\n", ++*errors);
+}
+#endif
+
+#ifdef RBTREE_ORDER_STATISTICS
+/*
+ * Check select and rank against an in-order walk
+ * while inserting and deleting random keys
+ */
+static void test_order_statistics(int *errors)
+{
+    static data_node dnodes[1000];
+    struct rbtree_t tree;
+    rbtree t = &tree;
+    rbtree_node node;
+    size_t k;
+    int i, round;
+
+    rbtree_init(t, (rbtree_compare_func) compare_int);
+    for (round = 0; round < 4; ++round) {
+        for (i = 0; i < 1000; ++i) {
+            if (round % 2 == 0) {
+                if (round > 0 && rbtree_node_lookup(t, &dnodes[i].skey) == &dnodes[i].rbnode)
+                    continue;
+                dnodes[i].skey = rand();
+                dnodes[i].rbnode.key = &dnodes[i].skey;
+                rbtree_insert(t, &dnodes[i].rbnode);
+            } else if (i % 3 == 0 && rbtree_node_lookup(t, &dnodes[i].skey) == &dnodes[i].rbnode) {
+                rbtree_node_delete(t, &dnodes[i].rbnode);
+            }
+        }
+        k = 0;
+        for (node = rbtree_node_first(t); node; node = rbtree_node_next(t, node), ++k)
+            if (rbtree_node_select(t, k) != node || rbtree_node_rank(t, node) != k)
+                break;
+        if (node != NULL || k != (size_t) t->node_count || rbtree_node_select(t, k) != NULL)
+            printf("%2d: failed order statistics round %d\n", ++*errors, round);
+    }
+}
+#endif
+
 int main() {
     int inorder = 1;
     int invalid = 0;
@@ -252,6 +2066,35 @@ int main() {
         printf("%2d: failed invalid == 1)\n", ++errors);
     if (inorder == 0)
         printf("%2d: failed inorder == 0)\n", ++errors);
+    test_build_sorted(&errors);
+    test_range(&errors);
+    test_interval(&errors);
+    test_walk(&errors);
+    test_generate(&errors);
+    test_u64(&errors);
+    test_lookup_batch(&errors);
+    test_hint(&errors);
+    test_upsert(&errors);
+    test_split_join(&errors);
+    test_delete_range(&errors);
+    test_pool(&errors);
+    test_stats(&errors);
+    test_wavl(&errors);
+    test_multi(&errors);
+#ifdef RBTREE_SHARED
+    test_shared(&errors);
+#endif
+    test_set_ops(&errors);
+    test_persist(&errors);
+    test_frozen(&errors);
+    test_image(&errors);
+    test_arena(&errors);
+#ifdef RBTREE_ABBREV_KEYS
+    test_abbrev(&errors);
+#endif
+#ifdef RBTREE_ORDER_STATISTICS
+    test_order_statistics(&errors);
+#endif
     if (errors) {
         printf("Failed\n");
         return EXIT_FAILURE;
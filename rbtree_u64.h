@@ -0,0 +1,146 @@
+/* Red-black trees with inline 64-bit integer keys
+ * Copyright (c) 2008 Derrick Coetzee
+ * Douglas Clowes, February 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT
+ * OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR
+ * THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _RBTREE_U64_H_
+#define _RBTREE_U64_H_
+
+#include "rbtree_gen.h"
+#include <stdint.h>
+
+/*
+ * Integer-keyed trees.  The key is stored in the node itself and
+ * compared with plain integer instructions, so a lookup touches one
+ * cache line per level and makes no indirect calls.  rbtree_u64 takes
+ * unsigned keys, rbtree_s64 signed ones; otherwise they mirror the
+ * generic API.  Embed the node in your own struct (as the first member
+ * to cast visitor arguments back) and set node.value as you like.
+ */
+typedef struct rbtree_u64_node_t {
+    struct rbtree_node_t node;
+    uint64_t key;
+} *rbtree_u64_node;
+
+typedef struct rbtree_s64_node_t {
+    struct rbtree_node_t node;
+    int64_t key;
+} *rbtree_s64_node;
+
+static inline int rbtree_u64_compare_nodes(const struct rbtree_u64_node_t* left,
+                                           const struct rbtree_u64_node_t* right)
+{
+    return (left->key > right->key) - (left->key < right->key);
+}
+
+static inline int rbtree_s64_compare_nodes(const struct rbtree_s64_node_t* left,
+                                           const struct rbtree_s64_node_t* right)
+{
+    return (left->key > right->key) - (left->key < right->key);
+}
+
+RBTREE_GENERATE(rbtree_u64_gen, struct rbtree_u64_node_t, node, rbtree_u64_compare_nodes)
+RBTREE_GENERATE(rbtree_s64_gen, struct rbtree_s64_node_t, node, rbtree_s64_compare_nodes)
+
+#define RBTREE_INT_API(prefix, node_type, key_type)                          \
+                                                                             \
+static inline void prefix##_init(rbtree t)                                   \
+{                                                                            \
+    prefix##_gen_init(t);                                                    \
+}                                                                            \
+                                                                             \
+static inline node_type prefix##_node_lookup(rbtree t, key_type key)         \
+{                                                                            \
+    struct prefix##_node_t probe;                                            \
+    probe.key = key;                                                         \
+    return prefix##_gen_lookup(t, &probe);                                   \
+}                                                                            \
+                                                                             \
+static inline void* prefix##_lookup(rbtree t, key_type key)                  \
+{                                                                            \
+    node_type n = prefix##_node_lookup(t, key);                              \
+    return n == NULL ? NULL : n->node.value;                                 \
+}                                                                            \
+                                                                             \
+static inline node_type prefix##_node_lower_bound(rbtree t, key_type key)    \
+{                                                                            \
+    struct prefix##_node_t probe;                                            \
+    probe.key = key;                                                         \
+    return prefix##_gen_lower_bound(t, &probe);                              \
+}                                                                            \
+                                                                             \
+static inline node_type prefix##_node_upper_bound(rbtree t, key_type key)    \
+{                                                                            \
+    struct prefix##_node_t probe;                                            \
+    probe.key = key;                                                         \
+    return prefix##_gen_upper_bound(t, &probe);                              \
+}                                                                            \
+                                                                             \
+/* you must free the returned node */                                        \
+static inline node_type prefix##_insert(rbtree t, node_type n)               \
+{                                                                            \
+    return prefix##_gen_insert(t, n);                                        \
+}                                                                            \
+                                                                             \
+/* you must free the returned node */                                        \
+static inline node_type prefix##_delete(rbtree t, key_type key)              \
+{                                                                            \
+    struct prefix##_node_t probe;                                            \
+    probe.key = key;                                                         \
+    return prefix##_gen_delete(t, &probe);                                   \
+}                                                                            \
+                                                                             \
+static inline node_type prefix##_node_delete(rbtree t, node_type n)          \
+{                                                                            \
+    return n == NULL ? NULL : prefix##_gen_remove(t, n);                     \
+}                                                                            \
+                                                                             \
+static inline node_type prefix##_node_first(rbtree t)                        \
+{                                                                            \
+    return prefix##_gen_first(t);                                            \
+}                                                                            \
+                                                                             \
+static inline node_type prefix##_node_last(rbtree t)                         \
+{                                                                            \
+    return prefix##_gen_last(t);                                             \
+}                                                                            \
+                                                                             \
+static inline node_type prefix##_node_next(rbtree t, node_type n)            \
+{                                                                            \
+    return n == NULL ? NULL : prefix##_gen_next(t, n);                       \
+}                                                                            \
+                                                                             \
+static inline node_type prefix##_node_prev(rbtree t, node_type n)            \
+{                                                                            \
+    return n == NULL ? NULL : prefix##_gen_prev(t, n);                       \
+}                                                                            \
+                                                                             \
+static inline int prefix##_walk(rbtree t, rbtree_visitor_func f, void *context) \
+{                                                                            \
+    return rbtree_walk(t, f, context);                                       \
+}
+
+RBTREE_INT_API(rbtree_u64, rbtree_u64_node, uint64_t)
+RBTREE_INT_API(rbtree_s64, rbtree_s64_node, int64_t)
+
+#endif
+/* vim: set ts=8 sw=4 sts=4 et: */